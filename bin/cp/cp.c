@@ -1,15 +1,26 @@
 #include <sos/globals.h>
 #include <sos/sos.h>
 #include <stdio.h>
+#include <string.h>
+
+// As much as SOS can take in one read or write
+static char buf[SYSCALL_BUFSIZ];
 
 int main(int argc, char **argv) {
 	fildes_t fd, fd_out;
 	char *file1, *file2;
-	char buf[IO_MAX_BUFFER];
-	int num_read, num_written = 0;
+	int num_read, num_written = 0, total = 0, timed = 0;
+	uint64_t start;
+
+	if (argc == 4 && strcmp(argv[1], "-t") == 0) {
+		// Report how long it took
+		timed = 1;
+		argc--;
+		argv++;
+	}
 
 	if (argc != 3) {
-		printf("Usage: cp from to %d\n", argc);
+		printf("Usage: cp [-t] from to %d\n", argc);
 		return 1;
 	}
 
@@ -29,8 +40,12 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
-	while ((num_read = read( fd, buf, IO_MAX_BUFFER) ) > 0) {
+	start = uptime();
+
+	while ((num_read = read( fd, buf, SYSCALL_BUFSIZ) ) > 0) {
 		num_written = write(fd_out, buf, num_read);
+		if (num_written < 0) break;
+		total += num_written;
 	}
 
 	if ((num_read != SOS_VFS_EOF && num_read < 0) || num_written < 0) {
@@ -42,6 +57,12 @@ int main(int argc, char **argv) {
 
 	close(fd);
 	close(fd_out);
+
+	if (timed) {
+		int ms = (int) ((uptime() - start) / 1000);
+		printf("%d KB in %d ms, %d KB/s\n", total / 1024, ms,
+				(ms > 0) ? (total / 1024) * 1000 / ms : 0);
+	}
+
 	return 0;
 }
-
@@ -0,0 +1,164 @@
+#include <l4/schedule.h>
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Measures how long killing a process takes with more and more other
+ * processes around, forkbomb style, each holding on to a good part of
+ * memory (so that between them most of it is swapped out).  Tearing down
+ * a process should only depend on what it has itself, so the time to kill
+ * a small one should stay flat however many others there are.  Every
+ * process is another copy of this program, told how many pages to touch by
+ * CONFIG_FN; once it has touched them it says so through a page shared
+ * with the parent, and waits to be killed.
+ */
+
+#define PAGESIZE 4096
+#define MAX_HOGS 16
+#define HOG_PAGES 192
+#define VICTIM_PAGES 64
+#define VICTIMS 8
+#define CONFIG_FN ".exitbench"
+#define SELF "exitbench"
+
+typedef struct {
+	volatile int ready; // the child has touched all its pages
+} Header;
+
+static char *window;
+
+static int setConfig(int pages) {
+	char buf[32];
+	fildes_t fd = open(CONFIG_FN, FM_WRITE);
+
+	if (fd < 0) {
+		printf("exitbench: can't open %s: %s\n", CONFIG_FN, sos_error_msg(fd));
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "%d %lu\n", pages, (unsigned long) window);
+	write(fd, buf, strlen(buf));
+	close(fd);
+	return 0;
+}
+
+static pid_t start(int pages) {
+	Header *h = (Header*) window;
+	pid_t child;
+
+	// One at a time, so that there is only ever one child to hear from
+	if (setConfig(pages) < 0) return -1;
+	h->ready = 0;
+
+	if ((child = process_create(SELF)) < 0) {
+		printf("exitbench: couldn't start %s\n", SELF);
+		return -1;
+	}
+
+	while (!h->ready) L4_Yield();
+	return child;
+}
+
+static unsigned timeKill(pid_t pid) {
+	uint64_t before = uptime();
+	process_delete(pid);
+	return (unsigned) (uptime() - before);
+}
+
+static int child(fildes_t fd) {
+	Header *h = (Header*) window;
+	char buf[32], *next;
+	int nread, pages;
+	char *mem;
+
+	nread = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[(nread > 0) ? nread : 0] = '\0';
+	pages = strtol(buf, &next, 10);
+
+	if (strtoul(next, NULL, 10) != (unsigned long) window) {
+		printf("exitbench: window at %p here, not %s", window, next);
+		return 1;
+	}
+
+	if (share_vm(window, PAGESIZE, 1) < 0) {
+		printf("exitbench: share_vm failed\n");
+		return 1;
+	}
+
+	if ((mem = malloc(pages * PAGESIZE)) == NULL) {
+		printf("exitbench: can't allocate %d pages\n", pages);
+		return 1;
+	}
+
+	for (int i = 0; i < pages; i++) {
+		mem[i * PAGESIZE] = (char) i;
+	}
+
+	h->ready = 1;
+
+	for (;;) {
+		usleep(1000000);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	char *mem = malloc(2 * PAGESIZE);
+	window = (char*) (((unsigned long) mem + PAGESIZE - 1) & ~(PAGESIZE - 1));
+
+	pid_t hogs[MAX_HOGS], victim;
+	unsigned us, total, worst, hogTotal;
+	int running = 0;
+
+	fildes_t fd = open(CONFIG_FN, FM_READ);
+	if (fd >= 0) {
+		// Started by the parent
+		return child(fd);
+	}
+
+	if (share_vm(window, PAGESIZE, 1) < 0) {
+		printf("exitbench: share_vm failed\n");
+		return 1;
+	}
+
+	printf("exitbench: killing %d page processes among %d page ones\n",
+			VICTIM_PAGES, HOG_PAGES);
+	printf("%6s %8s %10s %10s\n", "others", "pages", "avg (us)", "max (us)");
+
+	for (int n = 0; n <= MAX_HOGS; n = (n == 0) ? 1 : n * 2) {
+		while (running < n) {
+			if ((hogs[running] = start(HOG_PAGES)) < 0) goto out;
+			running++;
+		}
+
+		total = worst = 0;
+
+		for (int i = 0; i < VICTIMS; i++) {
+			if ((victim = start(VICTIM_PAGES)) < 0) goto out;
+			us = timeKill(victim);
+			total += us;
+			worst = (us > worst) ? us : worst;
+		}
+
+		printf("%6d %8d %10u %10u\n", n, n * HOG_PAGES,
+				total / VICTIMS, worst);
+	}
+
+out:
+	// And how long the big ones take, with the rest still around
+	hogTotal = 0;
+
+	for (int i = running - 1; i >= 0; i--) {
+		hogTotal += timeKill(hogs[i]);
+	}
+
+	if (running > 0) {
+		printf("killing a %d page process took %u us on average\n",
+				HOG_PAGES, hogTotal / running);
+	}
+
+	fremove(CONFIG_FN);
+	return 0;
+}
@@ -0,0 +1,89 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Measures sequential NFS throughput: writes a file and reads it back with
+ * each of a few request sizes, and says what SOS moves in one RPC.  Run it
+ * once on a SOS built with NFS over UDP and once over TCP (NFS_TCP) to
+ * compare the two.
+ */
+
+#define DATA_FN ".nfsbench"
+#define FILE_KB 512
+#define MAX_IO (16 * 1024)
+
+static char buf[MAX_IO];
+
+static int rate(int kb, unsigned long start) {
+	int ms = (int) (((unsigned long) uptime() - start) / 1000);
+	return (ms > 0) ? (int) (((long long) kb * 1000) / ms) : 0;
+}
+
+static int run(int size) {
+	unsigned long start;
+	int total = FILE_KB * 1024;
+	int done, n, wrate, rrate;
+	fildes_t fd;
+
+	if ((fd = open(DATA_FN, FM_WRITE)) < 0) {
+		printf("nfsbench: can't open %s: %s\n", DATA_FN, sos_error_msg(fd));
+		return -1;
+	}
+
+	start = (unsigned long) uptime();
+	for (done = 0; done < total; done += n) {
+		if ((n = write(fd, buf, size)) <= 0) break;
+	}
+	close(fd);
+
+	if (done < total) {
+		printf("nfsbench: only wrote %d bytes\n", done);
+		return -1;
+	}
+
+	wrate = rate(FILE_KB, start);
+
+	if ((fd = open(DATA_FN, FM_READ)) < 0) {
+		printf("nfsbench: can't open %s: %s\n", DATA_FN, sos_error_msg(fd));
+		return -1;
+	}
+
+	start = (unsigned long) uptime();
+	for (done = 0; done < total; done += n) {
+		if ((n = read(fd, buf, size)) <= 0) break;
+	}
+	close(fd);
+
+	if (done < total) {
+		printf("nfsbench: only read %d bytes\n", done);
+		return -1;
+	}
+
+	rrate = rate(FILE_KB, start);
+	printf("%8d %10d KB/s %10d KB/s\n", size, wrate, rrate);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	nfs_stat_t ns;
+	int r = 0;
+
+	memset(buf, 'n', sizeof(buf));
+	nfs_status(&ns);
+
+	printf("nfsbench: %d KB file, %d bytes per RPC\n", FILE_KB, ns.transfer);
+	printf("%8s %15s %15s\n", "size", "write", "read");
+
+	for (int size = 1024; size <= MAX_IO; size *= 2) {
+		if ((r = run(size)) < 0) break;
+	}
+
+	fremove(DATA_FN);
+
+	// Only NFS over TCP makes connections
+	nfs_status(&ns);
+	printf("nfsbench: %u TCP connects so far\n", ns.connects);
+	return (r < 0) ? 1 : 0;
+}
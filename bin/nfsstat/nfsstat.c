@@ -0,0 +1,60 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * NFS statistics from SOS.  With no arguments, the totals since booting;
+ * otherwise what happened in each interval of the given number of seconds
+ * (as many times as asked, or until killed).  The queue and round trip
+ * times are always as they are now, and times are in microseconds.
+ */
+
+static nfs_stat_t prev, curr;
+
+static void report(nfs_stat_t *now, nfs_stat_t *then, int seconds) {
+	unsigned calls = now->calls - then->calls;
+	unsigned retransmits = now->retransmits - then->retransmits;
+
+	printf("%8s %8s %8s %8s %8s %8s %8s %8s\n", "queued", "sent", "calls",
+			"retrans", "deferred", "dups", "srtt", "rto");
+	printf("%8d %8d %8u %8u %8u %8u %8u %8u\n", now->requests, now->in_flight,
+			calls / seconds, retransmits / seconds,
+			(now->deferred - then->deferred) / seconds,
+			(now->duplicates - then->duplicates) / seconds,
+			now->srtt_us, now->rto_us);
+
+	printf("%d bytes per read or write, %u connects\n", now->transfer,
+			now->connects - then->connects);
+
+	if (calls > 0) {
+		printf("%u.%u%% of calls resent, round trips vary by %u\n",
+				(retransmits * 100) / calls, ((retransmits * 1000) / calls) % 10,
+				now->rttvar_us);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int seconds = (argc > 1) ? atoi(argv[1]) : 0;
+	int count = (argc > 2) ? atoi(argv[2]) : 0;
+
+	memset(&prev, 0, sizeof(prev));
+	nfs_status(&curr);
+
+	if (seconds <= 0) {
+		report(&curr, &prev, 1);
+		return 0;
+	}
+
+	// Counts are per second from here on
+	for (int n = 0; (count <= 0) || (n < count); n++) {
+		prev = curr;
+		usleep(seconds * 1000000);
+		nfs_status(&curr);
+
+		printf("\n");
+		report(&curr, &prev, seconds);
+	}
+
+	return 0;
+}
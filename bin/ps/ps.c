@@ -18,10 +18,11 @@ int main(int argc, char *argv[]) {
 
 	processes = process_status(process, MAX_PROCESSES);
 
-	printf("%3s %8s %6s %10s %6s %-10s\n", "TID", "STATE", "SIZE", "STIME", "CTIME", "COMMAND");
+	printf("%3s %8s %6s %6s %8s %10s %6s %-10s\n", "TID", "STATE", "SIZE", "SWAP", "FAULTS", "STIME", "CTIME", "COMMAND");
 	for (i = 0; i < processes; i++) {
-		printf("%3d %8s %6d %10d %6d %-10s\n", process[i].pid, process_state_show(process[i].state),
-				process[i].size, process[i].stime, process[i].ctime, process[i].command);
+		printf("%3d %8s %6d %6d %8d %10d %6d %-10s\n", process[i].pid, process_state_show(process[i].state),
+				process[i].size, process[i].swap, process[i].faults, process[i].stime, process[i].ctime,
+				process[i].command);
 	}
 
 	free(process);
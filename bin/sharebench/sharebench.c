@@ -0,0 +1,245 @@
+#include <l4/schedule.h>
+#include <sos/globals.h>
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Measures streaming data from one process to another through a window
+ * both have shared with share_vm, against sending the same data through a
+ * file (SOS has no pipes, and a file goes through the same copy in to and
+ * out of the pager buffer that a pipe would).  Both times include starting
+ * the receiver, which is another copy of this program told what to do by
+ * CONFIG_FN.  Both copies allocate the window first thing, so it is at the
+ * same address in each.
+ */
+
+#define PAGESIZE 4096
+#define SLOTS 15
+#define WINDOW_SIZE ((SLOTS + 1) * PAGESIZE)
+#define CHUNKS 512
+#define CHUNK_WORDS (PAGESIZE / sizeof(int))
+#define CONFIG_FN ".sharebench"
+#define DATA_FN ".sharebench.data"
+#define SELF "sharebench"
+
+// The first page of the window, the rest of it is a ring of SLOTS chunks
+typedef struct {
+	volatile int ready; // the receiver has shared the window
+	volatile int head;  // chunks written by the sender
+	volatile int tail;  // chunks read by the receiver
+} Header;
+
+static char *window;
+static int chunk[CHUNK_WORDS];
+
+static int *slot(int n) {
+	return (int*) (window + PAGESIZE * (1 + (n % SLOTS)));
+}
+
+static void fill(int *buf, int n) {
+	for (int i = 0; i < CHUNK_WORDS; i++) {
+		buf[i] = n * CHUNK_WORDS + i;
+	}
+}
+
+static int check(int *buf, int n) {
+	for (int i = 0; i < CHUNK_WORDS; i++) {
+		if (buf[i] != n * CHUNK_WORDS + i) return 1;
+	}
+
+	return 0;
+}
+
+static int ioSize(int done) {
+	// What is left of the chunk, in pieces the VFS can take at once
+	return (PAGESIZE - done < IO_MAX_BUFFER) ? PAGESIZE - done : IO_MAX_BUFFER;
+}
+
+static int setConfig(char mode) {
+	char buf[32];
+	fildes_t fd = open(CONFIG_FN, FM_WRITE);
+
+	if (fd < 0) {
+		printf("sharebench: can't open %s: %s\n", CONFIG_FN, sos_error_msg(fd));
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "%c %lu\n", mode, (unsigned long) window);
+	write(fd, buf, strlen(buf));
+	close(fd);
+	return 0;
+}
+
+static void report(char *how, uint64_t start, uint64_t finish) {
+	int ms = (int) ((finish - start) / 1000);
+	int kb = CHUNKS * PAGESIZE / 1024;
+
+	printf("%-8s %6d KB %8d ms %8d KB/s\n", how, kb, ms,
+			(ms > 0) ? (kb * 1000) / ms : 0);
+}
+
+static int sendShared(void) {
+	Header *h = (Header*) window;
+	uint64_t start;
+	pid_t child;
+
+	h->ready = 0;
+	h->head = 0;
+	h->tail = 0;
+
+	if (setConfig('s') < 0) return 1;
+
+	if (share_vm(window, WINDOW_SIZE, 1) < 0) {
+		printf("sharebench: share_vm failed\n");
+		return 1;
+	}
+
+	start = uptime();
+
+	if ((child = process_create(SELF)) < 0) {
+		printf("sharebench: couldn't start %s\n", SELF);
+		return 1;
+	}
+
+	while (!h->ready) L4_Yield();
+
+	for (int n = 0; n < CHUNKS; n++) {
+		while (h->head - h->tail == SLOTS) L4_Yield();
+		fill(slot(n), n);
+		h->head = n + 1;
+	}
+
+	process_wait(child);
+	report("shared", start, uptime());
+	return 0;
+}
+
+static int receiveShared(void) {
+	Header *h = (Header*) window;
+	int bad = 0;
+
+	if (share_vm(window, WINDOW_SIZE, 1) < 0) {
+		printf("sharebench: share_vm failed\n");
+		return 1;
+	}
+
+	h->ready = 1;
+
+	for (int n = 0; n < CHUNKS; n++) {
+		while (h->head == n) L4_Yield();
+		bad += check(slot(n), n);
+		h->tail = n + 1;
+	}
+
+	return bad;
+}
+
+static int sendFile(void) {
+	uint64_t start;
+	fildes_t fd;
+	pid_t child;
+
+	if (setConfig('f') < 0) return 1;
+
+	start = uptime();
+
+	if ((fd = open(DATA_FN, FM_WRITE)) < 0) {
+		printf("sharebench: can't open %s: %s\n", DATA_FN, sos_error_msg(fd));
+		return 1;
+	}
+
+	for (int n = 0; n < CHUNKS; n++) {
+		fill(chunk, n);
+
+		for (int done = 0; done < PAGESIZE; ) {
+			int nwrite = write(fd, (char*) chunk + done, ioSize(done));
+			if (nwrite <= 0) break;
+			done += nwrite;
+		}
+	}
+
+	close(fd);
+
+	if ((child = process_create(SELF)) < 0) {
+		printf("sharebench: couldn't start %s\n", SELF);
+		return 1;
+	}
+
+	process_wait(child);
+	report("file", start, uptime());
+
+	fremove(DATA_FN);
+	return 0;
+}
+
+static int receiveFile(void) {
+	fildes_t fd = open(DATA_FN, FM_READ);
+	int bad = 0;
+
+	if (fd < 0) {
+		printf("sharebench: can't open %s: %s\n", DATA_FN, sos_error_msg(fd));
+		return 1;
+	}
+
+	for (int n = 0; n < CHUNKS; n++) {
+		for (int done = 0; done < PAGESIZE; ) {
+			int nread = read(fd, (char*) chunk + done, ioSize(done));
+			if (nread <= 0) break;
+			done += nread;
+		}
+
+		bad += check(chunk, n);
+	}
+
+	close(fd);
+	return bad;
+}
+
+static int receive(fildes_t fd) {
+	char buf[32];
+	int nread, bad;
+
+	nread = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[(nread > 0) ? nread : 0] = '\0';
+
+	if (buf[0] == 's') {
+		if (strtoul(buf + 2, NULL, 10) != (unsigned long) window) {
+			printf("sharebench: window at %p here, not %s", window, buf + 2);
+			return 1;
+		}
+
+		bad = receiveShared();
+	} else {
+		bad = receiveFile();
+	}
+
+	if (bad) {
+		printf("sharebench: %d chunks came through wrong\n", bad);
+	}
+
+	return bad ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	char *mem = malloc(WINDOW_SIZE + PAGESIZE);
+	window = (char*) (((unsigned long) mem + PAGESIZE - 1) & ~(PAGESIZE - 1));
+
+	fildes_t fd = open(CONFIG_FN, FM_READ);
+	if (fd >= 0) {
+		// Started by the sender
+		return receive(fd);
+	}
+
+	printf("sharebench: %d pages through a %d page window\n", CHUNKS, SLOTS);
+
+	if (sendShared() != 0 || sendFile() != 0) {
+		fremove(CONFIG_FN);
+		return 1;
+	}
+
+	fremove(CONFIG_FN);
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Measures how long it takes to start a process: from process_create being
+ * called until it returns, until the new process gets to main (the child
+ * writes down when that was as soon as it can), and until it has exited.
+ * The first run is also the first time the child's text is read in, unless
+ * it has been run before; the rest only have to check the executable.
+ */
+
+#define RUNS 16
+#define CHILD "spawnbench_child"
+#define TIME_FN ".spawnbench"
+
+typedef struct {
+	unsigned long create; // process_create returned
+	unsigned long main;   // the child got to main
+	unsigned long exit;   // the child had exited
+} Times;
+
+static int spawn(Times *t) {
+	unsigned long start, started;
+	char buf[32];
+	int nread;
+	fildes_t fd;
+	pid_t child;
+
+	fremove(TIME_FN);
+	start = (unsigned long) uptime();
+
+	if ((child = process_create(CHILD)) < 0) {
+		printf("spawnbench: couldn't start %s\n", CHILD);
+		return -1;
+	}
+
+	t->create = (unsigned long) uptime() - start;
+	process_wait(child);
+	t->exit = (unsigned long) uptime() - start;
+
+	if ((fd = open(TIME_FN, FM_READ)) < 0) {
+		printf("spawnbench: can't open %s: %s\n", TIME_FN, sos_error_msg(fd));
+		return -1;
+	}
+
+	nread = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[(nread > 0) ? nread : 0] = '\0';
+
+	// (only the low bits, which is plenty for the difference)
+	started = strtoul(buf, NULL, 10);
+	t->main = started - start;
+	return 0;
+}
+
+static void report(char *what, Times *t) {
+	printf("%-8s %10lu %10lu %10lu\n", what, t->create, t->main, t->exit);
+}
+
+int main(int argc, char *argv[]) {
+	Times t, lo, hi, sum = { 0, 0, 0 };
+
+	printf("spawnbench: %d runs of %s (us after process_create)\n", RUNS, CHILD);
+	printf("%-8s %10s %10s %10s\n", "", "create", "main", "exit");
+
+	if (spawn(&t) < 0) return 1;
+	report("first", &t);
+
+	lo.create = lo.main = lo.exit = (unsigned long) -1;
+	hi.create = hi.main = hi.exit = 0;
+
+	for (int i = 1; i < RUNS; i++) {
+		if (spawn(&t) < 0) return 1;
+
+		sum.create += t.create;
+		sum.main += t.main;
+		sum.exit += t.exit;
+
+		lo.create = (t.create < lo.create) ? t.create : lo.create;
+		lo.main = (t.main < lo.main) ? t.main : lo.main;
+		lo.exit = (t.exit < lo.exit) ? t.exit : lo.exit;
+
+		hi.create = (t.create > hi.create) ? t.create : hi.create;
+		hi.main = (t.main > hi.main) ? t.main : hi.main;
+		hi.exit = (t.exit > hi.exit) ? t.exit : hi.exit;
+	}
+
+	sum.create /= RUNS - 1;
+	sum.main /= RUNS - 1;
+	sum.exit /= RUNS - 1;
+
+	report("min", &lo);
+	report("avg", &sum);
+	report("max", &hi);
+
+	fremove(TIME_FN);
+	return 0;
+}
@@ -0,0 +1,25 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Child for spawnbench: writes down when it got to main, and that's all.
+ */
+
+#define TIME_FN ".spawnbench"
+
+int main(int argc, char *argv[]) {
+	unsigned long started = (unsigned long) uptime();
+	char buf[32];
+
+	fildes_t fd = open(TIME_FN, FM_WRITE);
+	if (fd < 0) {
+		printf("spawnbench_child: can't open %s\n", TIME_FN);
+		return 1;
+	}
+
+	snprintf(buf, sizeof(buf), "%lu\n", started);
+	write(fd, buf, strlen(buf));
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,68 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Measures aggregate swap throughput: the same total working set (larger
+ * than the pager's frame limit) is split between 1, 2, 4, ... processes
+ * which all touch their share at once, so the pager has more swap I/O
+ * outstanding the more processes there are.
+ */
+
+#define TOTAL_PAGES 1536
+#define PASSES 3
+#define MAX_PROCS 8
+#define CONFIG_FN ".swapbench"
+#define CHILD "swapbench_child"
+
+static int setPages(int pages) {
+	char buf[16];
+	fildes_t fd = open(CONFIG_FN, FM_WRITE);
+
+	if (fd < 0) {
+		printf("swapbench: can't open %s: %s\n", CONFIG_FN, sos_error_msg(fd));
+		return -1;
+	}
+
+	snprintf(buf, sizeof(buf), "%d\n", pages);
+	write(fd, buf, strlen(buf));
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	pid_t children[MAX_PROCS];
+	uint64_t start, finish;
+	int ms, touched;
+
+	printf("procs  pages/proc  time (ms)  pages/sec  swap\n");
+
+	for (int procs = 1; procs <= MAX_PROCS; procs *= 2) {
+		if (setPages(TOTAL_PAGES / procs) < 0) return 1;
+
+		start = uptime();
+
+		for (int i = 0; i < procs; i++) {
+			children[i] = process_create(CHILD);
+
+			if (children[i] < 0) {
+				printf("swapbench: couldn't start %s\n", CHILD);
+				return 1;
+			}
+		}
+
+		for (int i = 0; i < procs; i++) {
+			process_wait(children[i]);
+		}
+
+		finish = uptime();
+		ms = (int) ((finish - start) / 1000);
+		touched = (TOTAL_PAGES / procs) * procs * PASSES;
+
+		printf("%5d  %10d  %9d  %9d  %4d\n", procs, TOTAL_PAGES / procs, ms,
+				(ms > 0) ? (touched * 1000) / ms : 0, swapuse());
+	}
+
+	fremove(CONFIG_FN);
+	return 0;
+}
@@ -0,0 +1,55 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Worker for swapbench: reads how many pages to use from .swapbench, then
+ * touches every one of them PASSES times, checking what was written on the
+ * previous pass survived being swapped.
+ */
+
+#define PAGESIZE 4096
+#define PASSES 3
+#define CONFIG_FN ".swapbench"
+
+int main(int argc, char *argv[]) {
+	char buf[16];
+	int pages, nread, failed = 0;
+	int *mem;
+
+	fildes_t fd = open(CONFIG_FN, FM_READ);
+	if (fd < 0) {
+		printf("swapbench_child: can't open %s\n", CONFIG_FN);
+		return 1;
+	}
+
+	nread = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[(nread > 0) ? nread : 0] = '\0';
+	pages = atoi(buf);
+
+	mem = (int*) malloc(pages * PAGESIZE);
+	if (mem == NULL) {
+		printf("swapbench_child: can't allocate %d pages\n", pages);
+		return 1;
+	}
+
+	for (int pass = 0; pass < PASSES; pass++) {
+		for (int i = 0; i < pages; i++) {
+			int *page = mem + (i * PAGESIZE / sizeof(int));
+
+			if ((pass > 0) && (*page != pass * pages + i - pages)) {
+				failed++;
+			}
+
+			*page = pass * pages + i;
+		}
+	}
+
+	if (failed) {
+		printf("swapbench_child %d: %d pages came back wrong\n", my_id(), failed);
+	}
+
+	free(mem);
+	return failed ? 1 : 0;
+}
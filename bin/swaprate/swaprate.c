@@ -0,0 +1,54 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Single process swap rate, like pt_test but timed: fills a heap bigger
+ * than the pager's frame limit and then walks it a few more times, printing
+ * how many pages per second were touched on each pass.
+ */
+
+#define PAGESIZE 4096
+#define PAGES 1536
+#define PASSES 4
+
+int main(int argc, char *argv[]) {
+	uint64_t start, finish;
+	int ms, failed = 0;
+	int *mem;
+
+	mem = (int*) malloc(PAGES * PAGESIZE);
+	if (mem == NULL) {
+		printf("swaprate: can't allocate %d pages\n", PAGES);
+		return 1;
+	}
+
+	printf("pass  time (ms)  pages/sec  swap\n");
+
+	for (int pass = 0; pass < PASSES; pass++) {
+		start = uptime();
+
+		for (int i = 0; i < PAGES; i++) {
+			int *page = mem + (i * PAGESIZE / sizeof(int));
+
+			if ((pass > 0) && (*page != (pass - 1) * PAGES + i)) {
+				failed++;
+			}
+
+			*page = pass * PAGES + i;
+		}
+
+		finish = uptime();
+		ms = (int) ((finish - start) / 1000);
+
+		printf("%4d  %9d  %9d  %4d\n", pass, ms,
+				(ms > 0) ? (PAGES * 1000) / ms : 0, swapuse());
+	}
+
+	if (failed) {
+		printf("swaprate: %d pages came back wrong\n", failed);
+	}
+
+	free(mem);
+	return failed ? 1 : 0;
+}
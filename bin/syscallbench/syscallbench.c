@@ -0,0 +1,78 @@
+#include <sos/globals.h>
+#include <sos/sos.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Measures how long system calls that pass data to and from SOS take when
+ * the data goes through the buffer SOS maps in to each process, against
+ * having the pager copy it in and out.  Each call is timed over ITERATIONS
+ * goes, and the copies on their own are timed at a few sizes.
+ */
+
+#define ITERATIONS 1000
+#define MAX_PROCS 32
+
+static char data[SYSCALL_BUFSIZ];
+
+static void report(char *what, int size, uint64_t start, uint64_t finish) {
+	int us = (int) ((finish - start) / ITERATIONS);
+	printf("%-12s %6d B %8d us/call\n", what, size, us);
+}
+
+static void benchStat(void) {
+	stat_t st;
+	uint64_t start = uptime();
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		stat("console", &st);
+	}
+
+	report("stat", sizeof(stat_t), start, uptime());
+}
+
+static void benchProcessStatus(void) {
+	process_t procs[MAX_PROCS];
+	uint64_t start = uptime();
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		process_status(procs, MAX_PROCS);
+	}
+
+	report("ps", sizeof(procs), start, uptime());
+}
+
+static void benchCopy(int size) {
+	uint64_t start = uptime();
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		copyin(data, size, 0);
+		copyout(data, size, 0);
+	}
+
+	report("copyin/out", size, start, uptime());
+}
+
+static void bench(char *how) {
+	printf("--- %s\n", how);
+	benchStat();
+	benchProcessStatus();
+
+	for (int size = 64; size <= SYSCALL_BUFSIZ; size *= 4) {
+		benchCopy(size);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	memset(data, 0xa5, sizeof(data));
+	printf("syscallbench: %d iterations each\n", ITERATIONS);
+
+	syscall_buffer(1);
+	bench("mapped buffer");
+
+	syscall_buffer(0);
+	bench("pager copy");
+
+	syscall_buffer(1);
+	return 0;
+}
@@ -1,10 +1,52 @@
 #include <sos/sos.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_PROCESSES 64
+
+/*
+ * Memory use overall and for each process, with fault rates measured over
+ * an interval (a second, or the number of seconds given).
+ */
+
+static process_t before[MAX_PROCESSES];
+static process_t after[MAX_PROCESSES];
+
+static process_t *findBefore(pid_t pid, int n) {
+	for (int i = 0; i < n; i++) {
+		if (before[i].pid == pid) return &before[i];
+	}
+
+	return NULL;
+}
 
 int main(int argc, char *argv[]) {
+	int seconds = (argc > 1) ? atoi(argv[1]) : 1;
+	int nbefore, nafter, faults, majflt;
+	process_t *prev;
+
+	if (seconds <= 0) seconds = 1;
+
+	nbefore = process_status(before, MAX_PROCESSES);
+	usleep(seconds * 1000000);
+	nafter = process_status(after, MAX_PROCESSES);
+
 	printf("Mem: %d\n", memuse());
 	printf("Phys: %d\n", physuse());
 	printf("Swap: %d\n", swapuse());
+
+	printf("%3s %6s %6s %6s %6s %8s %8s %-10s\n", "TID", "RSS", "LIMIT", "WSS",
+			"SWAP", "FLT/s", "MAJFLT/s", "COMMAND");
+
+	for (int i = 0; i < nafter; i++) {
+		prev = findBefore(after[i].pid, nbefore);
+		faults = after[i].faults - ((prev != NULL) ? prev->faults : 0);
+		majflt = after[i].majflt - ((prev != NULL) ? prev->majflt : 0);
+
+		printf("%3d %6d %6d %6d %6d %8d %8d %-10s\n", after[i].pid,
+				after[i].size, after[i].rss_limit, after[i].wss, after[i].swap,
+				faults / seconds, majflt / seconds, after[i].command);
+	}
+
 	return 0;
 }
-
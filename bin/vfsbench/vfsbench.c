@@ -0,0 +1,52 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Measures NFS throughput with more than one process using it at once, by
+ * starting several copies of stressvfs together and waiting for them all.
+ * Each copy writes STRESS_KB to its own files (and reads them back), so
+ * the rate is what they got through between them.
+ */
+
+#define STRESS "stressvfs"
+#define STRESS_KB (1024 * 4 * 4) // loops * files * (write size / 1024)
+#define MAX_COPIES 8
+
+static int run(int copies) {
+	pid_t children[MAX_COPIES];
+	unsigned long start;
+	int started, ms, kb;
+
+	start = (unsigned long) uptime();
+
+	for (started = 0; started < copies; started++) {
+		if ((children[started] = process_create(STRESS)) < 0) {
+			printf("vfsbench: couldn't start %s\n", STRESS);
+			break;
+		}
+	}
+
+	for (int i = 0; i < started; i++) {
+		process_wait(children[i]);
+	}
+
+	if (started < copies) return -1;
+
+	ms = (int) (((unsigned long) uptime() - start) / 1000);
+	kb = copies * STRESS_KB;
+	printf("%6d %8d KB %8d ms %8d KB/s\n", copies, kb, ms,
+			(ms > 0) ? (int) (((long long) kb * 1000) / ms) : 0);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	printf("vfsbench: copies of %s at once\n", STRESS);
+	printf("%6s %11s %11s %13s\n", "copies", "written", "time", "rate");
+
+	for (int copies = 1; copies <= MAX_COPIES; copies *= 2) {
+		if (run(copies) < 0) return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+#include <sos/sos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Page fault statistics from the pager.  With no arguments, the totals since
+ * booting; otherwise what happened in each interval of the given number of
+ * seconds (as many times as asked, or until killed).  Latencies are in
+ * microseconds, percentiles only to the power of 2 above them.
+ */
+
+static char *classNames[FAULT_CLASSES] = {
+	"resident", "refbit", "zero", "swapin", "file", "swapout", "copy",
+};
+
+static vm_stat_t prev, curr;
+static pager_stat_t prevPager, currPager;
+
+static unsigned percentile(fault_stat_t *fs, unsigned count, int pc) {
+	// Upper bound of the bucket the given percentile falls in
+	unsigned seen = 0;
+
+	for (int i = 0; i < FAULT_BUCKETS; i++) {
+		seen += fs->hist[i];
+		if (seen * 100 >= count * pc) return 1u << i;
+	}
+
+	return 1u << (FAULT_BUCKETS - 1);
+}
+
+static void diff(fault_stat_t *dest, fault_stat_t *now, fault_stat_t *then) {
+	dest->count = now->count - then->count;
+	dest->max_us = now->max_us;
+	dest->total_us = now->total_us - then->total_us;
+
+	for (int i = 0; i < FAULT_BUCKETS; i++) {
+		dest->hist[i] = now->hist[i] - then->hist[i];
+	}
+}
+
+static void report(vm_stat_t *now, vm_stat_t *then, pager_stat_t *pnow,
+		pager_stat_t *pthen, int seconds) {
+	fault_stat_t fs;
+
+	printf("%-9s %8s %8s %8s %8s %8s %8s\n", "class", "faults", "avg", "p50",
+			"p90", "p99", "max");
+
+	for (int i = 0; i < FAULT_CLASSES; i++) {
+		diff(&fs, &now->faults[i], &then->faults[i]);
+
+		if (fs.count == 0) {
+			printf("%-9s %8d %8s %8s %8s %8s %8s\n", classNames[i], 0,
+					"-", "-", "-", "-", "-");
+			continue;
+		}
+
+		printf("%-9s %8u %8u %8u %8u %8u %8u\n", classNames[i],
+				fs.count / seconds, (unsigned) (fs.total_us / fs.count),
+				percentile(&fs, fs.count, 50), percentile(&fs, fs.count, 90),
+				percentile(&fs, fs.count, 99), fs.max_us);
+	}
+
+	printf("%-9s %8u pages crossed by copyin/copyout\n", "",
+			(now->copy_pages - then->copy_pages) / seconds);
+	printf("%-9s %8u mapped, %u allocated, %u moved, %u broken\n", "large",
+			(pnow->large_maps - pthen->large_maps) / seconds,
+			(pnow->large_allocs - pthen->large_allocs) / seconds,
+			(pnow->large_moves - pthen->large_moves) / seconds,
+			(pnow->large_breaks - pthen->large_breaks) / seconds);
+	printf("%-9s %8u hits, %d pages (%d idle), %u changed files\n", "cache",
+			(pnow->cache_hits - pthen->cache_hits) / seconds,
+			pnow->cache_pages, pnow->cache_idle,
+			pnow->cache_stale - pthen->cache_stale);
+}
+
+int main(int argc, char *argv[]) {
+	int seconds = (argc > 1) ? atoi(argv[1]) : 0;
+	int count = (argc > 2) ? atoi(argv[2]) : 0;
+
+	memset(&prev, 0, sizeof(prev));
+	memset(&prevPager, 0, sizeof(prevPager));
+	vm_status(&curr);
+	pager_status(&currPager);
+
+	if (seconds <= 0) {
+		report(&curr, &prev, &currPager, &prevPager, 1);
+		return 0;
+	}
+
+	// Faults are per second from here on (max is still since booting)
+	for (int n = 0; (count <= 0) || (n < count); n++) {
+		prev = curr;
+		prevPager = currPager;
+		usleep(seconds * 1000000);
+		vm_status(&curr);
+		pager_status(&currPager);
+
+		printf("\n");
+		report(&curr, &prev, &currPager, &prevPager, seconds);
+	}
+
+	return 0;
+}
@@ -60,6 +60,7 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
 #ifdef __USE_POSIX
 #include <posix/pthread.h>
 #endif
@@ -73,21 +74,38 @@ fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
     pthread_testcancel();
 #endif
 
-    size_t elems, sz;
+    size_t total = size * nmemb, done = 0, r;
     unsigned char *p = ptr;
 
+    if (total == 0) {
+        return 0;
+    }
+
     lock_stream(stream);
-    for (elems = 0; elems < nmemb; elems++) {
-        for (sz = 0; sz < size; sz++, p++) {
-            int ch;
 
-            if ((ch = fgetc(stream)) == EOF) {
-                goto out;
-            }
-            *p = (unsigned char)ch;
+    /* Anything pushed back comes first */
+    while (done < total && stream->unget_pos) {
+        p[done++] = stream->unget_stack[--stream->unget_pos];
+    }
+
+    /* Then the rest in as few reads as the file gives it in, rather than a
+       character at a time */
+    while (done < total) {
+        r = stream->read_fn(p + done, stream->current_pos, total - done,
+                            stream->handle);
+        if (r == 0) {
+            stream->eof = 1;
+            break;
+        } else if (r > total - done) {
+            /* Error */
+            stream->eof = 1;
+            stream->error = errno;
+            break;
         }
+        done += r;
+        stream->current_pos += r;
     }
-  out:
+
     unlock_stream(stream);
-    return elems;
+    return done / size;
 }
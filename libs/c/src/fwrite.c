@@ -64,6 +64,7 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
 #ifdef __USE_POSIX
 #include <posix/pthread.h>
 #endif
@@ -77,9 +78,43 @@ fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
     pthread_testcancel();
 #endif
 
-    size_t elems, sz;
+    size_t elems, sz, total = size * nmemb, done = 0, r;
     const unsigned char *p = ptr;
 
+    if (total == 0) {
+        return 0;
+    }
+
+    /* Unbuffered, or too big to be worth buffering: write out anything
+       already buffered and then the lot in as few writes as it takes,
+       rather than a character at a time */
+    if (stream->buffering_mode == _IONBF ||
+        total >= (size_t)stream->buffer_size) {
+        if (stream->buffering_mode != _IONBF) {
+            fflush(stream);
+        }
+
+        lock_stream(stream);
+        assert(stream->write_fn != NULL);
+        while (done < total) {
+            r = stream->write_fn(p + done, stream->current_pos, total - done,
+                                 stream->handle);
+            if (r == 0) {
+                stream->eof = 1;
+                break;
+            } else if (r > total - done) {
+                /* Error */
+                stream->eof = 1;
+                stream->error = errno;
+                break;
+            }
+            done += r;
+            stream->current_pos += r;
+        }
+        unlock_stream(stream);
+        return done / size;
+    }
+
     lock_stream(stream);
     for (elems = 0; elems < nmemb; elems++) {
         for (sz = 0; sz < size; sz++, p++) {
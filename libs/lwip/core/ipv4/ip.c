@@ -41,6 +41,7 @@
  *
  */   
 /*-----------------------------------------------------------------------------------*/
+#include <string.h>
 
 #include "lwip/debug.h"
 
@@ -207,163 +208,195 @@ ip_forward(struct pbuf *p, struct ip_hdr *iphdr, struct netif *inp)
   netif->output(netif, p, (struct ip_addr *)&(iphdr->dest));
 }
 #endif /* IP_FORWARD */
-/*-----------------------------------------------------------------------------------*/
-/* ip_reass:
- *
- * Tries to reassemble a fragmented IP packet.
- */
-/*-----------------------------------------------------------------------------------*/
+#ifndef IP_REASSEMBLY
 #define IP_REASSEMBLY 0
+#endif
+#ifndef IP_REASS_BUFSIZE
 #define IP_REASS_BUFSIZE 5760
-#define IP_REASS_MAXAGE 10
+#endif
+#ifndef IP_REASS_SLOTS
+#define IP_REASS_SLOTS 1
+#endif
 
 #if IP_REASSEMBLY
-static u8_t ip_reassbuf[IP_HLEN + IP_REASS_BUFSIZE];
-static u8_t ip_reassbitmap[IP_REASS_BUFSIZE / (8 * 8)];
+/* Packets being put back together. A slot is in use while its age
+   is non-zero, and when they all are, a fragment of a new packet
+   takes over the one that was started longest ago (its other
+   fragments are presumably lost). */
+struct ip_reass_slot {
+  u8_t buf[IP_HLEN + IP_REASS_BUFSIZE];
+  u8_t bitmap[IP_REASS_BUFSIZE / (8 * 8) + 1];
+  u16_t len;
+  u8_t flags;
+  u32_t age;
+};
+
+static struct ip_reass_slot ip_reass_slots[IP_REASS_SLOTS];
+static u32_t ip_reass_started;
 static const u8_t bitmap_bits[8] = {0xff, 0x7f, 0x3f, 0x1f,
 				    0x0f, 0x07, 0x03, 0x01};
-static u16_t ip_reasslen;
-static u8_t ip_reassflags;
 #define IP_REASS_FLAG_LASTFRAG 0x01
-static u8_t ip_reasstmr;
 
+/* Finds the slot for the packet fraghdr is a fragment of, starting
+   one off (over the oldest if need be) if there isn't one yet. */
+static struct ip_reass_slot *
+ip_reass_slot(struct ip_hdr *fraghdr)
+{
+  struct ip_reass_slot *slot, *oldest;
+  struct ip_hdr *iphdr;
+  u16_t i;
+
+  oldest = &ip_reass_slots[0];
+  for(i = 0; i < IP_REASS_SLOTS; ++i) {
+    slot = &ip_reass_slots[i];
+    iphdr = (struct ip_hdr *)slot->buf;
+
+    if(slot->age != 0 &&
+       ip_addr_cmp(&iphdr->src, &fraghdr->src) &&
+       ip_addr_cmp(&iphdr->dest, &fraghdr->dest) &&
+       IPH_ID(iphdr) == IPH_ID(fraghdr) &&
+       IPH_PROTO(iphdr) == IPH_PROTO(fraghdr)) {
+      DEBUGF(IP_REASS_DEBUG, ("ip_reass: matching old packet in slot %d\n", i));
+      return slot;
+    }
+
+    if(slot->age < oldest->age) {
+      oldest = slot;
+    }
+  }
+
+  /* Write the IP header of the fragment into the reassembly buffer,
+     without any options since those aren't kept. */
+  DEBUGF(IP_REASS_DEBUG, ("ip_reass: new packet%s\n",
+			  oldest->age != 0 ? ", dropping oldest" : ""));
+  slot = oldest;
+  iphdr = (struct ip_hdr *)slot->buf;
+  memcpy(iphdr, fraghdr, IP_HLEN);
+  IPH_VHLTOS_SET(iphdr, 4, IP_HLEN / 4, IPH_TOS(fraghdr));
+  slot->age = ++ip_reass_started;
+  slot->flags = 0;
+  slot->len = 0;
+  /* Clear the bitmap. */
+  memset(slot->bitmap, 0, sizeof(slot->bitmap));
+  return slot;
+}
+
+/*-----------------------------------------------------------------------------------*/
+/* ip_reass:
+ *
+ * Tries to reassemble a fragmented IP packet.
+ */
+/*-----------------------------------------------------------------------------------*/
 static struct pbuf *
 ip_reass(struct pbuf *p)
 {
-  struct pbuf *q;
+  struct ip_reass_slot *slot;
   struct ip_hdr *fraghdr, *iphdr;
   u16_t offset, len;
   u16_t i;
   
-  iphdr = (struct ip_hdr *)ip_reassbuf;
   fraghdr = (struct ip_hdr *)p->payload;
-
-  /* If ip_reasstmr is zero, no packet is present in the buffer, so we
-     write the IP header of the fragment into the reassembly
-     buffer. The timer is updated with the maximum age. */
-  if(ip_reasstmr == 0) {
-    DEBUGF(IP_REASS_DEBUG, ("ip_reass: new packet\n"));
-    memcpy(iphdr, fraghdr, IP_HLEN);
-    ip_reasstmr = IP_REASS_MAXAGE;
-    ip_reassflags = 0;
-    /* Clear the bitmap. */
-    bzero(ip_reassbitmap, sizeof(ip_reassbitmap));
+  slot = ip_reass_slot(fraghdr);
+  iphdr = (struct ip_hdr *)slot->buf;
+
+  /* Find out the offset in the reassembly buffer where we should
+     copy the fragment. */
+  len = ntohs(IPH_LEN(fraghdr)) - IPH_HL(fraghdr) * 4;
+  offset = (ntohs(IPH_OFFSET(fraghdr)) & IP_OFFMASK) * 8;
+
+  /* If the offset or the offset + fragment length overflows the
+     reassembly buffer, we discard the entire packet. */
+  if(offset > IP_REASS_BUFSIZE ||
+     offset + len > IP_REASS_BUFSIZE) {
+    DEBUGF(IP_REASS_DEBUG, ("ip_reass: fragment outside of buffer (%d:%d/%d).\n",
+			    offset, offset + len, IP_REASS_BUFSIZE));
+    slot->age = 0;
+    goto nullreturn;
   }
 
-  /* Check if the incoming fragment matches the one currently present
-     in the reasembly buffer. If so, we proceed with copying the
-     fragment into the buffer. */
-  if(ip_addr_cmp(&iphdr->src, &fraghdr->src) &&
-     ip_addr_cmp(&iphdr->dest, &fraghdr->dest) &&
-     IPH_ID(iphdr) == IPH_ID(fraghdr)) {
-    DEBUGF(IP_REASS_DEBUG, ("ip_reass: matching old packet\n"));
-    /* Find out the offset in the reassembly buffer where we should
-       copy the fragment. */
-    len = ntohs(IPH_LEN(fraghdr)) - IPH_HL(fraghdr) * 4;
-    offset = (ntohs(IPH_OFFSET(fraghdr)) & IP_OFFMASK) * 8;
-
-    /* If the offset or the offset + fragment length overflows the
-       reassembly buffer, we discard the entire packet. */
-    if(offset > IP_REASS_BUFSIZE ||
-       offset + len > IP_REASS_BUFSIZE) {
-      DEBUGF(IP_REASS_DEBUG, ("ip_reass: fragment outside of buffer (%d:%d/%d).\n",
-			      offset, offset + len, IP_REASS_BUFSIZE));
-      ip_reasstmr = 0;
-      goto nullreturn;
-    }
-
-    /* Copy the fragment into the reassembly buffer, at the right
-       offset. */
-    DEBUGF(IP_REASS_DEBUG, ("ip_reass: copying with offset %d into %d:%d\n",
-			    offset, IP_HLEN + offset, IP_HLEN + offset + len));
-    memcpy(&ip_reassbuf[IP_HLEN + offset], 
-	  (u8_t *)fraghdr + IPH_HL(fraghdr) * 4, len);
-
-    /* Update the bitmap. */
-    if(offset / (8 * 8) == (offset + len) / (8 * 8)) {
-      DEBUGF(IP_REASS_DEBUG, ("ip_reass: updating single byte in bitmap.\n"));
-      /* If the two endpoints are in the same byte, we only update
-	 that byte. */
-      ip_reassbitmap[offset / (8 * 8)] |=
-	bitmap_bits[(offset / 8 ) & 7] &
-	~bitmap_bits[((offset + len) / 8 ) & 7];
-    } else {
-      /* If the two endpoints are in different bytes, we update the
-	 bytes in the endpoints and fill the stuff inbetween with
-	 0xff. */
-      ip_reassbitmap[offset / (8 * 8)] |= bitmap_bits[(offset / 8 ) & 7];
-      DEBUGF(IP_REASS_DEBUG, ("ip_reass: updating many bytes in bitmap (%d:%d).\n",
-			      1 + offset / (8 * 8), (offset + len) / (8 * 8)));
-      for(i = 1 + offset / (8 * 8); i < (offset + len) / (8 * 8); ++i) {
-	ip_reassbitmap[i] = 0xff;
-      }      
-      ip_reassbitmap[(offset + len) / (8 * 8)] |= ~bitmap_bits[((offset + len) / 8 ) & 7];
-    }
-    
-    /* If this fragment has the More Fragments flag set to zero, we
-       know that this is the last fragment, so we can calculate the
-       size of the entire packet. We also set the
-       IP_REASS_FLAG_LASTFRAG flag to indicate that we have received
-       the final fragment. */
-
-    if((ntohs(IPH_OFFSET(fraghdr)) & IP_MF) == 0) {
-      ip_reassflags |= IP_REASS_FLAG_LASTFRAG;
-      ip_reasslen = offset + len;
-      DEBUGF(IP_REASS_DEBUG, ("ip_reass: last fragment seen, total len %d\n", ip_reasslen));
-    }
-    
-    /* Finally, we check if we have a full packet in the buffer. We do
-       this by checking if we have the last fragment and if all bits
-       in the bitmap are set. */
-    if(ip_reassflags & IP_REASS_FLAG_LASTFRAG) {
-      /* Check all bytes up to and including all but the last byte in
-	 the bitmap. */
-      for(i = 0; i < ip_reasslen / (8 * 8) - 1; ++i) {
-	if(ip_reassbitmap[i] != 0xff) {
-	  DEBUGF(IP_REASS_DEBUG, ("ip_reass: last fragment seen, bitmap %d/%d failed (%x)\n", i, ip_reasslen / (8 * 8) - 1, ip_reassbitmap[i]));
-	  goto nullreturn;
-	}
-      }
-      /* Check the last byte in the bitmap. It should contain just the
-	 right amount of bits. */
-      if(ip_reassbitmap[ip_reasslen / (8 * 8)] !=
-	 (u8_t)~bitmap_bits[ip_reasslen / 8 & 7]) {
-	DEBUGF(IP_REASS_DEBUG, ("ip_reass: last fragment seen, bitmap %d didn't contain %x (%x)\n",
-				ip_reasslen / (8 * 8), ~bitmap_bits[ip_reasslen / 8 & 7],
-				ip_reassbitmap[ip_reasslen / (8 * 8)]));
+  /* Copy the fragment into the reassembly buffer, at the right
+     offset. */
+  DEBUGF(IP_REASS_DEBUG, ("ip_reass: copying with offset %d into %d:%d\n",
+			  offset, IP_HLEN + offset, IP_HLEN + offset + len));
+  memcpy(&slot->buf[IP_HLEN + offset], 
+	 (u8_t *)fraghdr + IPH_HL(fraghdr) * 4, len);
+
+  /* Update the bitmap. */
+  if(offset / (8 * 8) == (offset + len) / (8 * 8)) {
+    DEBUGF(IP_REASS_DEBUG, ("ip_reass: updating single byte in bitmap.\n"));
+    /* If the two endpoints are in the same byte, we only update
+       that byte. */
+    slot->bitmap[offset / (8 * 8)] |=
+      bitmap_bits[(offset / 8 ) & 7] &
+      ~bitmap_bits[((offset + len) / 8 ) & 7];
+  } else {
+    /* If the two endpoints are in different bytes, we update the
+       bytes in the endpoints and fill the stuff inbetween with
+       0xff. */
+    slot->bitmap[offset / (8 * 8)] |= bitmap_bits[(offset / 8 ) & 7];
+    DEBUGF(IP_REASS_DEBUG, ("ip_reass: updating many bytes in bitmap (%d:%d).\n",
+			    1 + offset / (8 * 8), (offset + len) / (8 * 8)));
+    for(i = 1 + offset / (8 * 8); i < (offset + len) / (8 * 8); ++i) {
+      slot->bitmap[i] = 0xff;
+    }      
+    slot->bitmap[(offset + len) / (8 * 8)] |= ~bitmap_bits[((offset + len) / 8 ) & 7];
+  }
+  
+  /* If this fragment has the More Fragments flag set to zero, we
+     know that this is the last fragment, so we can calculate the
+     size of the entire packet. We also set the
+     IP_REASS_FLAG_LASTFRAG flag to indicate that we have received
+     the final fragment. */
+
+  if((ntohs(IPH_OFFSET(fraghdr)) & IP_MF) == 0) {
+    slot->flags |= IP_REASS_FLAG_LASTFRAG;
+    slot->len = offset + len;
+    DEBUGF(IP_REASS_DEBUG, ("ip_reass: last fragment seen, total len %d\n", slot->len));
+  }
+  
+  /* Finally, we check if we have a full packet in the buffer. We do
+     this by checking if we have the last fragment and if all bits
+     in the bitmap are set. */
+  if(slot->flags & IP_REASS_FLAG_LASTFRAG) {
+    /* Check all bytes up to but not including the last byte in the
+       bitmap. */
+    for(i = 0; i < slot->len / (8 * 8); ++i) {
+      if(slot->bitmap[i] != 0xff) {
+	DEBUGF(IP_REASS_DEBUG, ("ip_reass: last fragment seen, bitmap %d/%d failed (%x)\n", i, slot->len / (8 * 8), slot->bitmap[i]));
 	goto nullreturn;
       }
+    }
+    /* Check the last byte in the bitmap. It should contain just the
+       right amount of bits. */
+    if(slot->bitmap[slot->len / (8 * 8)] !=
+       (u8_t)~bitmap_bits[slot->len / 8 & 7]) {
+      DEBUGF(IP_REASS_DEBUG, ("ip_reass: last fragment seen, bitmap %d didn't contain %x (%x)\n",
+			      slot->len / (8 * 8), ~bitmap_bits[slot->len / 8 & 7],
+			      slot->bitmap[slot->len / (8 * 8)]));
+      goto nullreturn;
+    }
 
-      /* Pretend to be a "normal" (i.e., not fragmented) IP packet
-	 from now on. */
-      IPH_OFFSET_SET(iphdr, 0);
-      IPH_CHKSUM_SET(iphdr, 0);
+    /* Pretend to be a "normal" (i.e., not fragmented) IP packet
+       from now on, with the length of the whole thing. */
+    IPH_LEN_SET(iphdr, htons(IP_HLEN + slot->len));
+    IPH_OFFSET_SET(iphdr, 0);
+    IPH_CHKSUM_SET(iphdr, 0);
 #if CHECKSUM_GEN_IP || CHECKSUM_CHECK_IP /* FIXME: correct? */
-      IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
+    IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
 #endif
-      
-      /* If we have come this far, we have a full packet in the
-	 buffer, so we allocate a pbuf and copy the packet into it. We
-	 also reset the timer. */
-      ip_reasstmr = 0;
-      pbuf_free(p);
-      p = pbuf_alloc(PBUF_LINK, ip_reasslen, PBUF_POOL);
-      if(p != NULL) {
-	i = 0;
-	for(q = p; q != NULL; q = q->next) {
-	  /* Copy enough bytes to fill this pbuf in the chain. The
-	     avaliable data in the pbuf is given by the q->len
-	     variable. */
-	  DEBUGF(IP_REASS_DEBUG, ("ip_reass: memcpy from %p (%d) to %p, %d bytes\n",
-				  &ip_reassbuf[i], i, q->payload, q->len > ip_reasslen - i? ip_reasslen - i: q->len));
-	  memcpy(q->payload, &ip_reassbuf[i],
-		q->len > ip_reasslen - i? ip_reasslen - i: q->len);
-	  i += q->len;
-	}
-      }
-      DEBUGF(IP_REASS_DEBUG, ("ip_reass: p %p\n", p));
-      return p;
+    
+    /* If we have come this far, we have a full packet in the
+       buffer, so we allocate a pbuf and copy the packet into it. It
+       is all in one piece, so the layers above can treat it as a
+       flat buffer like any other packet. The slot is free again. */
+    slot->age = 0;
+    pbuf_free(p);
+    p = pbuf_alloc(PBUF_RAW, IP_HLEN + slot->len, PBUF_RAM);
+    if(p != NULL) {
+      memcpy(p->payload, slot->buf, IP_HLEN + slot->len);
     }
+    DEBUGF(IP_REASS_DEBUG, ("ip_reass: p %p\n", p));
+    return p;
   }
 
  nullreturn:
@@ -563,6 +596,91 @@ ip_input(struct pbuf *p, struct netif *inp) {
   return ERR_OK;
 }
 
+#ifndef IP_FRAG
+#define IP_FRAG 0
+#endif
+#ifndef IP_FRAG_MTU
+#define IP_FRAG_MTU 1500
+#endif
+
+#if IP_FRAG
+/*-----------------------------------------------------------------------------------*/
+/* ip_frag:
+ *
+ * Sends an IP packet that is too big for the network as fragments,
+ * each a copy of the header and as much of the data as will fit (a
+ * multiple of 8 bytes, except for the last). The packet itself is
+ * left alone, like ip_output_if does.
+ */
+/*-----------------------------------------------------------------------------------*/
+static err_t
+ip_frag(struct pbuf *p, struct netif *netif, struct ip_addr *dest)
+{
+  struct pbuf *rambuf, *q;
+  struct ip_hdr *iphdr, *original;
+  u16_t hlen, left, nfb, ofo, cpy, skip, n, chunk;
+  err_t err;
+
+  original = p->payload;
+  hlen = IPH_HL(original) * 4;
+  left = p->tot_len - hlen;
+  nfb = (IP_FRAG_MTU - hlen) & ~7;
+  err = ERR_OK;
+
+  for(ofo = 0; left > 0 && err == ERR_OK; ofo += cpy, left -= cpy) {
+    cpy = left > nfb ? nfb : left;
+
+    rambuf = pbuf_alloc(PBUF_IP, cpy, PBUF_RAM);
+    if(rambuf == NULL) {
+      DEBUGF(IP_DEBUG, ("ip_frag: out of memory for fragment at %d\n", ofo));
+#ifdef IP_STATS
+      ++stats.ip.memerr;
+#endif /* IP_STATS */
+      return ERR_MEM;
+    }
+
+    /* Copy this fragment's data out of the (possibly chained)
+       packet. */
+    skip = hlen + ofo;
+    n = 0;
+    for(q = p; q != NULL && n < cpy; q = q->next) {
+      if(skip >= q->len) {
+	skip -= q->len;
+	continue;
+      }
+      chunk = q->len - skip > cpy - n ? cpy - n : q->len - skip;
+      memcpy((u8_t *)rambuf->payload + n, (u8_t *)q->payload + skip, chunk);
+      n += chunk;
+      skip = 0;
+    }
+
+    if(pbuf_header(rambuf, hlen)) {
+      DEBUGF(IP_DEBUG, ("ip_frag: not enough room for IP header in pbuf\n"));
+#ifdef IP_STATS
+      ++stats.ip.err;
+#endif /* IP_STATS */
+      pbuf_free(rambuf);
+      return ERR_BUF;
+    }
+
+    iphdr = rambuf->payload;
+    memcpy(iphdr, original, hlen);
+    IPH_LEN_SET(iphdr, htons(hlen + cpy));
+    IPH_OFFSET_SET(iphdr, htons((ofo / 8) | (left > cpy ? IP_MF : 0)));
+    IPH_CHKSUM_SET(iphdr, 0);
+#if CHECKSUM_GEN_IP
+    IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, hlen));
+#endif
+
+    DEBUGF(IP_DEBUG, ("ip_frag: fragment %d:%d of %d\n",
+		      ofo, ofo + cpy, p->tot_len - hlen));
+    err = netif->output(netif, rambuf, dest);
+    pbuf_free(rambuf);
+  }
+
+  return err;
+}
+#endif /* IP_FRAG */
 /*-----------------------------------------------------------------------------------*/
 /* ip_output_if:
  *
@@ -629,6 +747,12 @@ ip_output_if(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
 #endif /* IP_DEBUG */
 
 
+#if IP_FRAG
+  if(p->tot_len > IP_FRAG_MTU) {
+    return ip_frag(p, netif, dest);
+  }
+#endif /* IP_FRAG */
+
   return netif->output(netif, p, dest);  
 }
 /*-----------------------------------------------------------------------------------*/
@@ -43,7 +43,7 @@
 
 /* MEM_SIZE: the size of the heap memory. If the application will send
 a lot of data that needs to be copied, this should be set high. */
-#define MEM_SIZE                65536
+#define MEM_SIZE                262144
 
 /* MEMP_NUM_PBUF: the number of memp struct pbufs. If the application
    sends a lot of data out of ROM (or other static memory), this
@@ -109,14 +109,14 @@ a lot of data that needs to be copied, this should be set high. */
 #define TCP_MSS                 1460
 
 /* TCP sender buffer space (bytes). */
-#define TCP_SND_BUF             8192
+#define TCP_SND_BUF             16384
 
 /* TCP sender buffer space (pbufs). This must be at least = 2 *
    TCP_SND_BUF/TCP_MSS for things to work. */
 #define TCP_SND_QUEUELEN        4 * TCP_SND_BUF/TCP_MSS
 
 /* TCP receive window. */
-#define TCP_WND                 (8 * TCP_MSS) /* < 65535 */
+#define TCP_WND                 (16 * TCP_MSS) /* < 65535 */
 
 /* Maximum number of retransmissions of data segments. */
 #define TCP_MAXRTX              12
@@ -142,6 +142,18 @@ a lot of data that needs to be copied, this should be set high. */
    defined to 0, all packets with IP options are dropped. */
 #define IP_OPTIONS              1
 
+/* Define IP_REASSEMBLY to 1 to put fragmented packets back together,
+   IP_REASS_BUFSIZE bytes at most and IP_REASS_SLOTS of them at once.
+   NFS over UDP needs this for replies bigger than the MTU. */
+#define IP_REASSEMBLY           1
+#define IP_REASS_BUFSIZE        9216
+#define IP_REASS_SLOTS          4
+
+/* Define IP_FRAG to 1 to split packets bigger than IP_FRAG_MTU (the
+   most an Ethernet frame carries) in to fragments on the way out. */
+#define IP_FRAG                 1
+#define IP_FRAG_MTU             1500
+
 /* ---------- ICMP options ---------- */
 #define ICMP_TTL                255
 
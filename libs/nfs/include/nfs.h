@@ -6,8 +6,23 @@
 
 #include <nfs/rpc.h>
 
+/* Transports the NFS calls can go over, the port mapper and mount calls
+ * always going over UDP */
+#define NFS_OVER_UDP 0
+#define NFS_OVER_TCP 1
+
+/* Most data in an NFS (version 2) read or write */
+#define NFS_MAXDATA 8192
+
+/* Most data in a read or write over UDP, where the IP layer fragments
+ * anything bigger than a packet (4096 would be a page a call) */
+#define NFS_UDP_MAXDATA 8192
+
 /* to initialise the lot */
-int nfs_init(struct ip_addr server);
+int nfs_init(struct ip_addr server, int transport);
+
+/* Most bytes one nfs_read or nfs_write can move over the transport used */
+int nfs_transfer_size(void);
 
 /* mount functions */
 unsigned int mnt_get_export_list(void);
@@ -41,6 +56,20 @@ int nfs_readdir(struct cookie *pfh, int cookie, int size,
 		void (*func) (uintptr_t , int, int, struct nfs_filename *, int),
 		uintptr_t token);
 
+/* Retransmission statistics, times in microseconds */
+struct rpc_stats {
+	unsigned calls;       /* calls sent */
+	unsigned retransmits; /* calls sent again after timing out */
+	unsigned deferred;    /* timeouts not resent, too many being already */
+	unsigned duplicates;  /* replies to calls already answered */
+	unsigned connects;    /* TCP connections made for calls */
+	unsigned rto;         /* timeout for calls sent now */
+	unsigned srtt;        /* smoothed round trip time */
+	unsigned rttvar;      /* and how much it varies */
+};
+
+void rpc_get_stats(struct rpc_stats *stats);
+
 // Async functions callback based
 extern void
 nfs_getattr_cb(void * callback, uintptr_t token, struct pbuf *pbuf);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include <nfs/nfs.h>
+#include <sos/globals.h>
 #include "transport.h"
 
 //#define DEBUG_NFS 0
@@ -15,6 +16,7 @@
 
 static int nfs_port = 0;
 static int mount_port = 0;
+static int nfs_transport = NFS_OVER_UDP;
 
 static int check_errors(struct pbuf *pbuf);
 
@@ -129,7 +131,7 @@ mnt_mount(char *dir, struct cookie *pfh)
 
 /* this should be called once at beginning to setup everything */
 int
-nfs_init(struct ip_addr server)
+nfs_init(struct ip_addr server, int transport)
 {
 	mapping_t map;
 
@@ -155,7 +157,7 @@ nfs_init(struct ip_addr server)
 	/* make and RPC to get nfs info */
 	map.prog = NFS_NUMBER;
 	map.vers = NFS_VERSION;
-	map.prot = IPPROTO_UDP;
+	map.prot = (transport == NFS_OVER_TCP) ? IPPROTO_TCP : IPPROTO_UDP;
 
 	if(map_getport(&map) == 0) {
 		debug( "nfs port number is %d\n", map.port );
@@ -169,9 +171,39 @@ nfs_init(struct ip_addr server)
 		return 1;
 	}
 
+	if (transport == NFS_OVER_TCP) {
+		if (nfs_port == 0 || init_stream(server, nfs_port) != 0) {
+			printf("!!! Can't use NFS over TCP\n");
+			return 1;
+		}
+	}
+
+	nfs_transport = transport;
 	return 0;
 }
 
+int
+nfs_transfer_size(void)
+{
+	if (nfs_transport == NFS_OVER_TCP) {
+		return NFS_MAXDATA;
+	} else {
+		return NFS_UDP_MAXDATA;
+	}
+}
+
+/* Send an NFS call over whichever transport is being used */
+static int
+nfs_send(struct pbuf *pbuf, void (*func)(void *, uintptr_t, struct pbuf *),
+	void *callback, uintptr_t token)
+{
+	if (nfs_transport == NFS_OVER_TCP) {
+		return rpc_send_stream(pbuf, func, callback, token);
+	} else {
+		return rpc_send(pbuf, nfs_port, func, callback, token);
+	}
+}
+
 /******************************************
  * Async functions
  ******************************************/
@@ -217,7 +249,7 @@ nfs_getattr(struct cookie *fh,
     addtobuf(pbuf, (char*) fh, sizeof(struct cookie));
     
     /* send it! */
-    return rpc_send(pbuf, nfs_port, nfs_getattr_cb, func, token);
+    return nfs_send(pbuf, nfs_getattr_cb, func, token);
 }
 
 void
@@ -268,7 +300,7 @@ nfs_lookup(struct cookie *cwd, char *name,
     addstring(pbuf, name);
     
     /* send it! */
-    return rpc_send(pbuf, nfs_port, nfs_lookup_cb, func, token);
+    return nfs_send(pbuf, nfs_lookup_cb, func, token);
 }
 
 void
@@ -324,7 +356,7 @@ nfs_read(struct cookie *fh, int pos, int count,
     /* add them to the buffer */
     addtobuf(pbuf, (char*) &args, sizeof(args));
     
-    return rpc_send(pbuf, nfs_port, nfs_read_cb, func, token);
+    return nfs_send(pbuf, nfs_read_cb, func, token);
 }
 
 void
@@ -363,7 +395,8 @@ nfs_write(struct cookie *fh, int offset, int count, void *data,
     writeargs_t args;
     
     /* now the user data struct is setup, do some call stuff! */
-    pbuf = initbuf(NFS_NUMBER, NFS_VERSION, NFSPROC_WRITE);
+    pbuf = initbuf_size(NFS_NUMBER, NFS_VERSION, NFSPROC_WRITE,
+	    NFS_HEADER + ((count > IO_MAX_BUFFER) ? count : IO_MAX_BUFFER));
 
     /* copy in the fhandle */
     memcpy(&args.file, (char*) fh, sizeof(struct cookie));
@@ -378,7 +411,7 @@ nfs_write(struct cookie *fh, int offset, int count, void *data,
     /* put the data in */
     adddata(pbuf, data, count);
 
-    return rpc_send(pbuf, nfs_port, nfs_write_cb, func, token);
+    return nfs_send(pbuf, nfs_write_cb, func, token);
 }
 
 void
@@ -431,7 +464,7 @@ nfs_create(struct cookie *fh, char *name, sattr_t *sat,
     
     addtobuf(pbuf, (char*) sat, sizeof(sattr_t));
 
-    return rpc_send(pbuf, nfs_port, nfs_create_cb, func, token);
+    return nfs_send(pbuf, nfs_create_cb, func, token);
 }
 
 void
@@ -471,7 +504,7 @@ nfs_remove(struct cookie *cwd, char *name,
     addstring(pbuf, name);
     
     /* send it! */
-    return rpc_send(pbuf, nfs_port, nfs_remove_cb, func, token);
+    return nfs_send(pbuf, nfs_remove_cb, func, token);
 }
 
 
@@ -592,7 +625,7 @@ nfs_readdir(struct cookie *pfh, int cookie, int size,
     addtobuf(pbuf, (char*) &args, sizeof(args));
 
     /* make the call! */
-    return rpc_send(pbuf, nfs_port, nfs_readdir_cb, func, token);
+    return nfs_send(pbuf, nfs_readdir_cb, func, token);
 }
 
 /********************************************
@@ -8,6 +8,10 @@
 
 #include <l4/types.h>
 #include <l4/ipc.h>
+#include <clock/clock.h>
+
+#include <lwip/inet.h>
+#include <lwip/tcp.h>
 
 #include "nfs/nfs.h"
 #include "nfs/rpc.h"
@@ -18,7 +22,7 @@
 
 #define verbose 1
 
-// Needs to be called every 100ms by somebody
+// Needs to be called often (every RTO_MIN at most) by somebody
 extern void nfs_timeout(void);
 
 /************************************************************
@@ -31,6 +35,9 @@ extern void nfs_timeout(void);
 #define debug(x...)
 #endif
 
+/* Drop every so many packets sent, to see retransmission at work */
+//#define DROP_EVERY 16
+
 #define NFS_LOCAL_PORT 200
 #define NFS_MACHINE_NAME "boggo"
 #define UDP_SIZE NFS_BUFSIZ
@@ -46,14 +53,101 @@ struct rpc_queue
 	struct pbuf *pbuf;
 	xid_t xid;
 	int port;
-	int timeout;
-	struct rpc_queue *next;
+	timestamp_t sent;            /* when it was first sent */
+	timestamp_t deadline;        /* when to resend it */
+	uint32_t rto;                /* how long it waits, backed off */
+	int sends;                   /* times it has been sent */
+	int stream;                  /* sent over the stream rather than UDP */
+	int written;                 /* bytes of it given to TCP, with the mark */
+	struct rpc_queue *out_next;  /* next to be written to the stream */
+	struct rpc_queue *hash_next; /* next in the xid's bucket */
+	struct rpc_queue *next;      /* next later deadline */
+	struct rpc_queue *prev;      /* next earlier deadline */
 	void (*func) (void *, uintptr_t, struct pbuf *);
 	void *callback;
 	uintptr_t arg;
 };
 
-struct rpc_queue *queue = NULL;
+/* Calls waiting on replies, by xid.  Xids are handed out in order so the
+   ones waiting at once are spread evenly over the buckets */
+#define XID_BUCKETS 64
+#define XID_BUCKET(xid) ((xid) % XID_BUCKETS)
+static struct rpc_queue *xid_table[XID_BUCKETS];
+
+/* The same calls in order of when they are to be resent */
+static struct rpc_queue *queue = NULL;
+static struct rpc_queue *queue_last = NULL;
+
+/************************************************************
+ *  Retransmission defines
+ ***********************************************************/
+
+/* Bounds on the retransmit timeout, and what it starts at before any round
+   trips have been measured (all in microseconds) */
+#define RTO_MIN (40 * 1000)
+#define RTO_MAX (5 * 1000 * 1000)
+#define RTO_INIT (600 * 1000)
+
+/* Most calls that can have been resent and still be unanswered.  Further
+   calls timing out wait their timeout again rather than add to the load */
+#define RESEND_MAX 4
+
+/* What is known about the server, there only being the one.  Round trips
+   are measured Jacobson's way, only from calls sent once (Karn's) */
+struct rpc_server
+{
+	int samples;     /* round trips measured */
+	uint32_t srtt;   /* smoothed round trip time */
+	uint32_t rttvar; /* and how much it varies */
+	uint32_t rto;    /* timeout for calls sent now */
+	int resent;      /* calls resent and not yet answered */
+	struct rpc_stats stats;
+};
+
+static struct rpc_server server = { 0, 0, 0, RTO_INIT, 0, { 0 } };
+
+/************************************************************
+ *  Stream (TCP) defines
+ ***********************************************************/
+
+/* Records are sent as one fragment, with this bit set in the mark before
+   it (RFC 1831 record marking) */
+#define LAST_FRAGMENT 0x80000000
+#define MARK_SIZE 4
+
+/* Largest record taken from the server, anything bigger must be garbage
+   and loses the connection */
+#define STREAM_RECORD_MAX (32 * 1024)
+
+/* Privileged ports the connection is made from, a different one each time
+   so as not to wait for the last to leave TIME_WAIT */
+#define STREAM_LOCAL_PORT 600
+#define STREAM_LOCAL_PORTS 100
+
+/* The one connection to the server, for NFS calls when asked for */
+struct rpc_stream
+{
+	struct tcp_pcb *pcb;        /* NULL while there is no connection */
+	struct ip_addr server;
+	int port;                   /* 0 if the stream isn't being used */
+	int connected;
+	int broken;                 /* got garbage, so drop it when we can */
+	struct rpc_queue *out;      /* calls to write, oldest first */
+	struct rpc_queue *out_last;
+	u32_t mark;                 /* mark of the fragment being read */
+	int mark_got;               /* bytes of it read so far */
+	int frag_left;              /* bytes of the fragment still to come */
+	struct pbuf *record;        /* record being read */
+	int record_got;             /* bytes of it read so far */
+	timestamp_t tcp_tmr;        /* when the TCP timers last ran */
+	timestamp_t retry;          /* no connecting again before this */
+	timestamp_t backoff;        /* wait after the last connect, 0 once up */
+};
+
+static struct rpc_stream stream;
+
+static void stream_push(void);
+static void stream_timeout(timestamp_t now);
 
 /************************************************************
  *  XID Code 
@@ -197,6 +291,13 @@ clearbuf(struct pbuf *pbuf)
 /* for synchronous calls */
 	struct pbuf *
 initbuf(int prognum, int vernum, int procnum)
+{
+	return initbuf_size(prognum, vernum, procnum, UDP_SIZE);
+}
+
+/* for calls with more in them than fits in a UDP packet */
+	struct pbuf *
+initbuf_size(int prognum, int vernum, int procnum, int size)
 {
 	xid_t txid = get_xid();
 	int calltype = MSG_CALL;
@@ -206,7 +307,7 @@ initbuf(int prognum, int vernum, int procnum)
 	int tval;
 	struct pbuf *pbuf;
 
-	pbuf = pbuf_alloc(PBUF_TRANSPORT, UDP_SIZE, PBUF_RAM);
+	pbuf = pbuf_alloc(PBUF_TRANSPORT, size, PBUF_RAM);
 	assert(pbuf != NULL);
 
 	pbuf->arg[0] = pbuf->payload;
@@ -347,62 +448,136 @@ rpc_call(struct pbuf *pbuf, int port)
  *  Queue function                                             *
  ***************************************************************/
 
+/* Put an item in the timer queue, after everything due no later.  Items
+   nearly always go on the end, so look from there */
+	static void
+timer_insert(struct rpc_queue *q_item)
+{
+	struct rpc_queue *tmp;
+
+	for (tmp = queue_last; tmp != NULL && tmp->deadline > q_item->deadline;
+			tmp = tmp->prev)
+		;
+
+	q_item->prev = tmp;
+	if (tmp == NULL) {
+		q_item->next = queue;
+		queue = q_item;
+	} else {
+		q_item->next = tmp->next;
+		tmp->next = q_item;
+	}
+
+	if (q_item->next == NULL) {
+		queue_last = q_item;
+	} else {
+		q_item->next->prev = q_item;
+	}
+}
+
+/* Take an item out of the timer queue */
 	static void
+timer_remove(struct rpc_queue *q_item)
+{
+	if (q_item->prev == NULL) {
+		queue = q_item->next;
+	} else {
+		q_item->prev->next = q_item->next;
+	}
+
+	if (q_item->next == NULL) {
+		queue_last = q_item->prev;
+	} else {
+		q_item->next->prev = q_item->prev;
+	}
+}
+
+	static struct rpc_queue *
 add_to_queue(struct pbuf *pbuf, int port, 
 		void (*func)(void *, uintptr_t, struct pbuf *),
-		void *callback, uintptr_t arg)
+		void *callback, uintptr_t arg, int over_stream)
 {
 	/* Need a lock here */
 	struct rpc_queue *q_item;
-	struct rpc_queue *tmp;
 	q_item = malloc(sizeof(struct rpc_queue));
 	assert(q_item != NULL);
 
-	q_item->next = NULL;
 	q_item->pbuf = pbuf;
 	q_item->xid = extract_xid(pbuf->payload);
-	q_item->timeout = 0;
+	q_item->sent = time_stamp();
+	q_item->rto = server.rto;
+	q_item->deadline = q_item->sent + q_item->rto;
+	q_item->sends = 1;
+	q_item->stream = over_stream;
+	q_item->written = 0;
+	q_item->out_next = NULL;
 	q_item->port = port;
 	q_item->func = func;
 	q_item->arg = arg;
 	q_item->callback = callback;
 
-	if (queue == NULL) {
-		/* Add at start of the linked list */
-		queue = q_item;
-	} else {
-		/* Add to end of the linked list */
-		for(tmp = queue; tmp->next != NULL; tmp = tmp->next)
-			;
-		tmp->next = q_item;
+	q_item->hash_next = xid_table[XID_BUCKET(q_item->xid)];
+	xid_table[XID_BUCKET(q_item->xid)] = q_item;
+
+	/* TCP does the resending for the stream */
+	if (!over_stream) {
+		timer_insert(q_item);
 	}
+
+	return q_item;
 }
 
 /* Remove item from the queue -- doesn't free the memory */
 	static struct rpc_queue *
 get_from_queue(xid_t xid)
 {
-	struct rpc_queue *tmp, *last = NULL;
+	struct rpc_queue **link = &xid_table[XID_BUCKET(xid)];
+	struct rpc_queue *tmp;
 
-	for (tmp = queue; tmp != NULL && tmp->xid != xid; tmp = tmp->next) {
-		last = tmp;
+	for (; *link != NULL && (*link)->xid != xid; link = &(*link)->hash_next)
 		;
-	}
-	if (tmp == NULL) {
+
+	if (*link == NULL) {
 		return NULL;
-	} else if (last == NULL) {
-		queue = tmp->next;
-	} else {
-		last->next = tmp->next;
+	}
+
+	tmp = *link;
+	*link = tmp->hash_next;
+	if (!tmp->stream) {
+		timer_remove(tmp);
 	}
 
 	return tmp;
 }
 
-/* Called when we receive a packet */
+/* Fold a round trip in to the server's estimate and work out the timeout
+   from it, as in RFC 2988 */
 	static void
-my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
-		struct ip_addr *addr, u16_t port)
+rtt_sample(timestamp_t rtt)
+{
+	uint32_t r = (rtt > RTO_MAX) ? RTO_MAX : (uint32_t) rtt;
+	uint32_t err;
+
+	if (server.samples++ == 0) {
+		server.srtt = r;
+		server.rttvar = r / 2;
+	} else {
+		err = (server.srtt > r) ? server.srtt - r : r - server.srtt;
+		server.rttvar = (3 * server.rttvar + err) / 4;
+		server.srtt = (7 * server.srtt + r) / 8;
+	}
+
+	server.rto = server.srtt + 4 * server.rttvar;
+	if (server.rto < RTO_MIN) {
+		server.rto = RTO_MIN;
+	} else if (server.rto > RTO_MAX) {
+		server.rto = RTO_MAX;
+	}
+}
+
+/* Called when we receive a reply, over either transport.  Frees it */
+	static void
+rpc_reply(struct pbuf *p)
 {
 	xid_t xid;
 	struct rpc_queue *q_item;
@@ -413,8 +588,21 @@ my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
 
 	debug("Recieved a reply for xid: %u (%d) %p\n", 
 			xid, p->len, q_item);
-	if (q_item == NULL)
+	if (q_item == NULL) {
+		/* Already answered, so one of ours was sent again needlessly */
+		server.stats.duplicates++;
+		pbuf_free(p);
 		return;
+	}
+
+	if (q_item->stream) {
+		/* round trips there include waiting behind other calls */
+	} else if (q_item->sends == 1) {
+		rtt_sample(time_stamp() - q_item->sent);
+	} else {
+		server.resent--;
+	}
+
 	if (q_item->func != NULL) {
 		p->arg[0] = p->payload;
 		q_item->func(q_item->callback, q_item->arg, p);
@@ -426,6 +614,14 @@ my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
 	free(q_item);
 }
 
+/* Called when we receive a packet */
+	static void
+my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
+		struct ip_addr *addr, u16_t port)
+{
+	rpc_reply(p);
+}
+
 /* Send a packet to a specific port. It would be nice if 
 	this was support by Lwip */
 	static err_t
@@ -453,18 +649,69 @@ udp_send_to(struct udp_pcb *pcb, int port, struct pbuf *pbuf)
 
 struct udp_pcb *udp_cnx;
 
-/* Called every 100ms. Items in the queue are resent every 500ms */
+/* Send a call, unless pretending the network lost it */
+	static void
+rpc_transmit(struct rpc_queue *q_item)
+{
+#ifdef DROP_EVERY
+	static int count = 0;
+	if (++count % DROP_EVERY == 0) {
+		debug("Dropping xid %u\n", q_item->xid);
+		return;
+	}
+#endif
+
+	udp_send_to(udp_cnx, q_item->port, q_item->pbuf);
+}
+
+/* Called every so often.  Only the items in the queue that have timed out
+   are looked at, and are resent with their timeout doubled, which (Karn)
+   is kept for new calls until a round trip can be measured again.  Once
+   RESEND_MAX calls are out resent, more just wait another timeout.
+   Must be called from the thread that feeds lwIP its packets, since
+   neither lwIP nor the queues here can take two threads at once */
 	void
 nfs_timeout(void)
 {
 	struct rpc_queue *q_item;
+	timestamp_t now = time_stamp();
 
-	for (q_item = queue; q_item != NULL; q_item = q_item->next) {
-		if (q_item->timeout++ > 5) {
-			udp_send_to(udp_cnx, q_item->port, q_item->pbuf);
-			q_item->timeout = 0;
+	while ((q_item = queue) != NULL && q_item->deadline <= now) {
+		timer_remove(q_item);
+
+		if (q_item->sends > 1 || server.resent < RESEND_MAX) {
+			if (q_item->sends++ == 1) {
+				server.resent++;
+			}
+
+			q_item->rto = (q_item->rto < RTO_MAX / 2) ? 2 * q_item->rto : RTO_MAX;
+			if (q_item->rto > server.rto) {
+				server.rto = q_item->rto;
+			}
+
+			server.stats.retransmits++;
+			rpc_transmit(q_item);
+		} else {
+			server.stats.deferred++;
 		}
+
+		q_item->deadline = now + q_item->rto;
+		timer_insert(q_item);
 	}
+
+	if (stream.port != 0) {
+		stream_timeout(now);
+	}
+}
+
+/* Get the retransmission statistics */
+	void
+rpc_get_stats(struct rpc_stats *stats)
+{
+	*stats = server.stats;
+	stats->rto = server.rto;
+	stats->srtt = server.srtt;
+	stats->rttvar = server.rttvar;
 }
 
 static uint32_t time_of_day = 0;
@@ -514,13 +761,330 @@ rpc_send(struct pbuf *pbuf, int port,
 		void (*func)(void *, uintptr_t, struct pbuf *), 
 		void *callback, uintptr_t arg)
 {
+	struct rpc_queue *q_item;
+
 	pbuf->len =
 		pbuf->tot_len = (char *) pbuf->arg[0] - (char *) pbuf->payload;
 
 	/* Add to a queue */
-	add_to_queue(pbuf, port, func, callback, arg);
+	q_item = add_to_queue(pbuf, port, func, callback, arg, 0);
+
+	server.stats.calls++;
+	rpc_transmit(q_item);
+	return 0;
+}
+
+/***************************************************************
+ *  Stream code - RPC over a TCP connection                    *
+ ***************************************************************/
+
+/* Put a call on the end of those to write to the stream */
+	static void
+stream_queue(struct rpc_queue *q_item)
+{
+	q_item->written = 0;
+	q_item->out_next = NULL;
+
+	if (stream.out_last == NULL) {
+		stream.out = q_item;
+	} else {
+		stream.out_last->out_next = q_item;
+	}
+	stream.out_last = q_item;
+}
+
+/* Give TCP as much of the waiting calls as it has room for, each after its
+   record mark.  More goes as what has been sent is acknowledged */
+	static void
+stream_push(void)
+{
+	struct rpc_queue *q_item;
+	u32_t mark;
+	int len, n;
+
+	while (stream.connected && (q_item = stream.out) != NULL) {
+		len = q_item->pbuf->len;
+
+		if (q_item->written == 0) {
+			mark = htonl(LAST_FRAGMENT | len);
+			if (tcp_sndbuf(stream.pcb) < MARK_SIZE ||
+					tcp_write(stream.pcb, &mark, MARK_SIZE, 1) != ERR_OK) {
+				break;
+			}
+			q_item->written = MARK_SIZE;
+		}
+
+		n = MARK_SIZE + len - q_item->written;
+		if (n > tcp_sndbuf(stream.pcb)) {
+			n = tcp_sndbuf(stream.pcb);
+		}
+
+		if (n == 0 || tcp_write(stream.pcb, (char *) q_item->pbuf->payload +
+					q_item->written - MARK_SIZE, n, 1) != ERR_OK) {
+			break;
+		}
+
+		q_item->written += n;
+		if (q_item->written < MARK_SIZE + len) {
+			break;
+		}
+
+		stream.out = q_item->out_next;
+		if (stream.out == NULL) {
+			stream.out_last = NULL;
+		}
+	}
+
+	if (stream.connected) {
+		tcp_output(stream.pcb);
+	}
+}
+
+/* Forget the connection (lwIP having let go of it), and queue every call
+   still waiting on a reply to be sent again over the next one */
+	static void
+stream_reset(void)
+{
+	struct rpc_queue *q_item;
+
+	stream.pcb = NULL;
+	stream.connected = 0;
+	stream.broken = 0;
+	stream.mark_got = 0;
+	stream.frag_left = 0;
+	stream.record_got = 0;
+
+	if (stream.record != NULL) {
+		pbuf_free(stream.record);
+		stream.record = NULL;
+	}
+
+	stream.out = NULL;
+	stream.out_last = NULL;
+
+	for (int i = 0; i < XID_BUCKETS; i++) {
+		for (q_item = xid_table[i]; q_item != NULL; q_item = q_item->hash_next) {
+			if (q_item->stream) {
+				q_item->sends++;
+				server.stats.retransmits++;
+				stream_queue(q_item);
+			}
+		}
+	}
+}
+
+/* Give up on the connection after the server sent garbage.  Not from
+   inside a TCP callback, since lwIP carries on using the pcb after them */
+	static void
+stream_drop(void)
+{
+	dprintf(0, "!!! rpc stream: dropping connection\n");
+	tcp_err(stream.pcb, NULL);
+	tcp_abort(stream.pcb);
+	stream_reset();
+}
+
+/* A fragment mark has been read, so make room in the record for it */
+	static int
+stream_fragment(void)
+{
+	struct pbuf *record;
+	int size;
+
+	stream.mark = ntohl(stream.mark);
+	size = stream.mark & ~LAST_FRAGMENT;
+
+	if (stream.record_got + size > STREAM_RECORD_MAX) {
+		dprintf(0, "!!! rpc stream: record too big (%d)\n", stream.record_got + size);
+		return -1;
+	}
+
+	record = pbuf_alloc(PBUF_RAW, stream.record_got + size, PBUF_RAM);
+	if (record == NULL) {
+		dprintf(0, "!!! rpc stream: no memory for record (%d)\n", size);
+		return -1;
+	}
+
+	/* Only records of more than one fragment have anything to keep */
+	if (stream.record != NULL) {
+		memcpy(record->payload, stream.record->payload, stream.record_got);
+		pbuf_free(stream.record);
+	}
+
+	stream.record = record;
+	stream.frag_left = size;
+	return 0;
+}
+
+/* Take in bytes from the stream, handing on each record as it completes */
+	static int
+stream_take(char *data, int len)
+{
+	struct pbuf *record;
+	int n;
+
+	while (len > 0) {
+		if (stream.mark_got < MARK_SIZE) {
+			n = min(MARK_SIZE - stream.mark_got, len);
+			memcpy((char *) &stream.mark + stream.mark_got, data, n);
+			stream.mark_got += n;
+
+			if (stream.mark_got == MARK_SIZE && stream_fragment() != 0) {
+				return -1;
+			}
+		} else {
+			n = min(stream.frag_left, len);
+			memcpy((char *) stream.record->payload + stream.record_got, data, n);
+			stream.record_got += n;
+			stream.frag_left -= n;
+		}
+
+		data += n;
+		len -= n;
+
+		if (stream.mark_got == MARK_SIZE && stream.frag_left == 0) {
+			stream.mark_got = 0;
+
+			if (stream.mark & LAST_FRAGMENT) {
+				record = stream.record;
+				stream.record = NULL;
+				stream.record_got = 0;
+				rpc_reply(record);
+			}
+		}
+	}
+
+	return 0;
+}
+
+	static err_t
+stream_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+	struct pbuf *q;
+
+	if (p == NULL) {
+		/* closed by the server */
+		debug("Stream closed by the server\n");
+		tcp_err(pcb, NULL);
+		tcp_close(pcb);
+		stream_reset();
+		return ERR_OK;
+	}
+
+	tcp_recved(pcb, p->tot_len);
+
+	for (q = p; q != NULL && !stream.broken; q = q->next) {
+		if (stream_take(q->payload, q->len) != 0) {
+			stream.broken = 1;
+		}
+	}
+
+	pbuf_free(p);
+	return ERR_OK;
+}
+
+	static err_t
+stream_sent(void *arg, struct tcp_pcb *pcb, u16_t len)
+{
+	stream_push();
+	return ERR_OK;
+}
+
+	static void
+stream_err(void *arg, err_t err)
+{
+	/* lwIP has freed the pcb already */
+	dprintf(0, "!!! rpc stream: connection lost (%d)\n", err);
+	stream_reset();
+}
+
+	static err_t
+stream_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+	debug("Stream connected\n");
+	stream.connected = 1;
+	stream.backoff = 0;
+	stream_push();
+	return ERR_OK;
+}
+
+/* Start connecting to the server, with the calls going once it is up.
+   Until a connection comes up, each attempt waits twice as long as the
+   last before the next (so a server refusing them isn't hammered) */
+	static void
+stream_connect(timestamp_t now)
+{
+	int port = STREAM_LOCAL_PORT + (server.stats.connects % STREAM_LOCAL_PORTS);
+
+	stream.backoff = (stream.backoff == 0) ? RTO_INIT : min(2 * stream.backoff, RTO_MAX);
+	stream.retry = now + stream.backoff;
+
+	stream.pcb = tcp_new();
+	if (stream.pcb == NULL) {
+		dprintf(0, "!!! rpc stream: no memory for connection\n");
+		return;
+	}
+
+	server.stats.connects++;
+	tcp_recv(stream.pcb, stream_recv);
+	tcp_sent(stream.pcb, stream_sent);
+	tcp_err(stream.pcb, stream_err);
+	tcp_bind(stream.pcb, IP_ADDR_ANY, port);
+	tcp_connect(stream.pcb, &stream.server, stream.port, stream_connected);
+}
+
+/* Run the TCP timers, and connect again if the connection has gone and
+   there are calls waiting on it */
+	static void
+stream_timeout(timestamp_t now)
+{
+	if (now - stream.tcp_tmr >= TCP_TMR_INTERVAL * 1000) {
+		stream.tcp_tmr = now;
+		tcp_tmr();
+	}
+
+	if (stream.broken) {
+		stream_drop();
+	}
+
+	if (stream.pcb == NULL && stream.out != NULL && now >= stream.retry) {
+		stream_connect(now);
+	}
+}
+
+	int
+init_stream(struct ip_addr server, int port)
+{
+	memset(&stream, 0, sizeof(stream));
+	stream.server = server;
+	stream.port = port;
+	stream.tcp_tmr = time_stamp();
+
+	stream_connect(stream.tcp_tmr);
+	return (stream.pcb == NULL) ? -1 : 0;
+}
+
+	int
+rpc_send_stream(struct pbuf *pbuf,
+		void (*func)(void *, uintptr_t, struct pbuf *), 
+		void *callback, uintptr_t arg)
+{
+	struct rpc_queue *q_item;
+
+	pbuf->len =
+		pbuf->tot_len = (char *) pbuf->arg[0] - (char *) pbuf->payload;
+
+	q_item = add_to_queue(pbuf, stream.port, func, callback, arg, 1);
+
+	server.stats.calls++;
+	stream_queue(q_item);
+
+	if (stream.pcb != NULL) {
+		stream_push();
+	} else if (time_stamp() >= stream.retry) {
+		stream_connect(time_stamp());
+	}
 
-	udp_send_to(udp_cnx, port, pbuf);
 	return 0;
 }
 
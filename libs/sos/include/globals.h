@@ -25,4 +25,7 @@
 /* Max buffer size for write and read */
 #define IO_MAX_BUFFER (NFS_BUFSIZ - NFS_HEADER)
 
+/* Size of the buffer each thread passes system call data to SOS through */
+#define SYSCALL_BUFSIZ (4096 * 4)
+
 #endif // libs/sos/globals.h
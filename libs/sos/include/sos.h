@@ -44,6 +44,13 @@ typedef enum {
         SOS_MEMLOC,
         SOS_MMAP,
         SOS_SHARE_VM,
+        SOS_PAGER_STATUS,
+        SOS_MUNMAP,
+        SOS_BUFFER,
+        SOS_SWAP_STATUS,
+        SOS_MEMLIMIT,
+        SOS_VM_STATUS,
+        SOS_NFS_STATUS,
 		  SOS_NULL, // Ensure this stays at the end, its a place holder for max SOS syscall
         L4_PAGEFAULT = ((L4_Word_t) -2),
         L4_INTERRUPT = ((L4_Word_t) -1),
@@ -93,6 +100,12 @@ typedef struct {
 
 typedef int fildes_t;
 
+/* One of the buffers in a readv/writev */
+typedef struct {
+        void   *iov_base;
+        size_t  iov_len;
+} iovec_t;
+
 /* The FD to which printf() will ultimately write() */
 extern fildes_t stdout_fd;
 extern fildes_t stderr_fd;
@@ -128,6 +141,11 @@ typedef enum {
 typedef struct {
         pid_t              pid;
         unsigned           size;  // in pages
+        unsigned           rss_limit; // most pages it can have resident
+        unsigned           wss;   // estimated working set in pages
+        unsigned           swap;  // swap slots in use, in pages
+        unsigned           faults; // page faults taken
+        unsigned           majflt; // of those, faults that had to read a page in
         unsigned           stime; // start time in msec since booting
         unsigned           ctime; // CPU time accumulated in msec
         char               command[MAX_FILE_NAME]; // Name of executable
@@ -136,6 +154,92 @@ typedef struct {
 		  process_ipcfilt_t  ipc_accept; // type of ipc process accept (blocking or non blocking).
 } process_t;
 
+/* Pager status, including the page cleaner */
+typedef struct {
+        int       frames_free;     // user frames free
+        int       frames_total;    // user frames in total
+        int       high_watermark;  // cleaner keeps at least this many frames free
+        int       low_watermark;   // below this it cleans without waiting to be idle
+        unsigned  cleaner_runs;    // times the cleaner has been given work
+        unsigned  cleaner_writes;  // pages the cleaner wrote out to make room
+        unsigned  cleaner_drops;   // clean pages the cleaner evicted without I/O
+        unsigned  fault_evictions; // pages a fault had to evict itself
+        unsigned  swapout_clusters; // writes to swap, each of one or more pages
+        unsigned  swapout_pages;   // pages in those writes
+        unsigned  readahead_pages; // pages read ahead of a fault
+        unsigned  readahead_hits;  // of those, pages that were then used
+        unsigned  readahead_wasted; // of those, pages evicted without being used
+        unsigned  large_maps;      // large pages mapped in one go
+        unsigned  large_allocs;    // large pages allocated contiguous to start with
+        unsigned  large_moves;     // large pages copied in to contiguous frames
+        unsigned  large_breaks;    // large pages unmapped back in to small pages
+        int       cache_pages;     // file pages in the page cache
+        int       cache_idle;      // of those, pages kept with nobody mapping them
+        unsigned  cache_hits;      // file pages mapped from the cache without I/O
+        unsigned  cache_stale;     // cached files found to have changed
+} pager_stat_t;
+
+/* Swap status, including the compressed tier in front of the swap file */
+typedef struct {
+        int       frames;          // frames set aside for compressed pages
+        int       pages;           // pages kept compressed
+        int       bytes_used;      // compressed size of those pages
+        unsigned  stores;          // pages compressed instead of written out
+        unsigned  rejects;         // pages that didn't compress well enough
+        unsigned  full;            // pages that didn't fit
+        unsigned  evictions;       // compressed pages written out to make room
+        uint64_t  original_bytes;  // size of the pages stored
+        uint64_t  compressed_bytes; // and what they compressed to
+        unsigned  hits;            // swapins from compressed pages
+        unsigned  misses;          // swapins from the swap file
+        uint64_t  hit_us;          // total swapin latency of the hits
+        uint64_t  miss_us;         // total swapin latency of the misses
+} swap_stat_t;
+
+/* Page faults, by the slowest thing they had to wait for */
+typedef enum {
+        FAULT_RESIDENT,  // in memory already, only needed mapping
+        FAULT_REFBIT,    // unmapped by the clock to sample the reference bit
+        FAULT_ZERO,      // first touch of a page, zero filled
+        FAULT_SWAPIN,    // read in from swap
+        FAULT_FILE,      // read in from the executable or a mapped file
+        FAULT_SWAPOUT,   // something had to be swapped out first
+        FAULT_COPY,      // copyin/copyout going through the pager for a page
+        FAULT_CLASSES,
+} fault_class_t;
+
+/* Latency histograms are log2 microseconds: hist[i] counts latencies from
+ * 2^(i-1) up to 2^i us, hist[0] those under 1 us, the last everything over */
+#define FAULT_BUCKETS 24
+
+typedef struct {
+        unsigned  count;
+        unsigned  max_us;
+        uint64_t  total_us;
+        unsigned  hist[FAULT_BUCKETS];
+} fault_stat_t;
+
+/* Page fault statistics, kept by the pager all the time */
+typedef struct {
+        fault_stat_t faults[FAULT_CLASSES];
+        unsigned     copy_pages; // pages crossed by copyin/copyout
+} vm_stat_t;
+
+/* NFS status, of the requests queued and the RPCs under them */
+typedef struct {
+        int       requests;        // requests queued, including those sent
+        int       in_flight;       // of those, requests at the server
+        unsigned  calls;           // RPCs sent
+        unsigned  retransmits;     // RPCs sent again after timing out
+        unsigned  deferred;        // timeouts not resent, too many being already
+        unsigned  duplicates;      // replies to RPCs already answered
+        unsigned  connects;        // TCP connections made for RPCs (0 over UDP)
+        int       transfer;        // most bytes moved by one read or write RPC
+        unsigned  rto_us;          // retransmit timeout for RPCs sent now
+        unsigned  srtt_us;         // smoothed round trip time
+        unsigned  rttvar_us;       // and how much it varies
+} nfs_stat_t;
+
 /* Get a string representation of a syscall */
 char *syscall_show(syscall_t syscall);
 
@@ -178,6 +282,13 @@ void copyin(void *data, size_t size, int append);
  */
 void copyout(void *data, size_t size, int append);
 
+/* Choose whether copyin and copyout go through the buffer SOS has mapped in
+ * to the process (the default, when there is one) or ask the pager to do the
+ * copying.  Mostly useful for measuring the difference.
+ * Returns the previous setting.
+ */
+int syscall_buffer(int use);
+
 /* Open file and return file descriptor, -1 if unsuccessful 
  * (too many open files, console already open for reading).
  * A new file should be created if 'path' does not already exist.
@@ -220,6 +331,14 @@ void closeNonblocking(fildes_t file);
  */
 int read(fildes_t file, char *buf, size_t nbyte);
 
+/* Read from an open file in to each of the "iovcnt" buffers in "iov" in
+ * turn.  Any amount can be asked for, SOS is asked for a syscall buffer
+ * (SYSCALL_BUFSIZ) at a time and splits that up for the file system.
+ * Stops early at the end of the file, or once the console has given some input.
+ * Returns the number of bytes read, or an error as for read.
+ */
+int readv(fildes_t file, const iovec_t *iov, int iovcnt);
+
 /* A nonblocking version of read which assumes a copyout call will later
  * be made.  Use with caution.
  */
@@ -231,6 +350,12 @@ void readNonblocking(fildes_t file, size_t nbyte);
  */
 int write(fildes_t file, const char *buf, size_t nbyte);
 
+/* Write each of the "iovcnt" buffers in "iov" to an open file, the other
+ * way around to readv.
+ * Returns the number of bytes written, or an error as for write.
+ */
+int writev(fildes_t file, const iovec_t *iov, int iovcnt);
+
 /* A nonblocking version of write which assumes a copyin call has already
  * been made.  Use with caution.
  */
@@ -326,6 +451,12 @@ int process_status(process_t *processes, unsigned max);
  */
 pid_t process_wait(pid_t pid);
 
+/* Limit process "pid" to "pages" resident pages, after which its own pages
+ * are swapped out to make room for more. A limit of 0 leaves it as it is.
+ * Returns the previous limit, or -1 if there is no such process.
+ */
+int memlimit(pid_t pid, unsigned pages);
+
 /* Returns time in microseconds since booting.
  */
 uint64_t uptime(void);
@@ -343,6 +474,18 @@ int swapuse(void);
 /* Get the total number of physical frames in use */
 int physuse(void);
 
+/* Get the status of the pager through "stat" */
+int pager_status(pager_stat_t *stat);
+
+/* Get the status of swapping through "stat" */
+int swap_status(swap_stat_t *stat);
+
+/* Get the page fault statistics through "stat" */
+int vm_status(vm_stat_t *stat);
+
+/* Get the status of NFS through "stat" */
+int nfs_status(nfs_stat_t *stat);
+
 /* Look up the process' page table for a given virtual address */
 L4_Word_t memloc(L4_Word_t addr);
 
@@ -368,13 +511,25 @@ L4_ThreadId_t vpager(void);
  *      descriptor, in order to support lazy loading of the mapping.  Easily.
  *    * offset, the offset in to the file.  Must be a multiple of pagesize.
  *
- * Also note that any extra room in the page is zeroed.  And that writing is
- * not yet supported (only reading).
+ * Also note that any extra room in the page is zeroed.  Pages are read from
+ * the file as they are first touched.  Writes to a writable mapping go back
+ * to the file when the page is evicted, unmapped or the process exits, but
+ * only within the size the file had when it was mapped (it is never
+ * extended).  So a writable mapping fails if it goes on past the page the
+ * file ends in.  Read-only mappings of the same file share their pages.
  *
  * Returns the address in the caller's address space, or NULL on failure.
  */
 void *mmap(void *addr, size_t size, fmode_t rights, char *path, off_t offset);
 
+/*
+ * Remove a mapping made with mmap, writing any changes back to the file
+ * before returning.  addr and size must be those of the whole mapping.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int munmap(void *addr, size_t size);
+
 /* Make VM region ["adr","adr"+"size") sharable by other processes.
  * If "writable" is non-zero, other processes may have write access to the
  * shared region. Both, "adr" and "size" must be divisible by the page size.
@@ -6,6 +6,7 @@
 #include <l4/message.h>
 #include <l4/types.h>
 
+#include <sos/globals.h>
 #include <sos/sos.h>
 #include <sos/ipc.h>
 
@@ -47,6 +48,13 @@ char *syscall_show(syscall_t syscall) {
 		case SOS_MEMLOC: return "SOS_MEMLOC";
 		case SOS_MMAP: return "SOS_MMAP";
 		case SOS_SHARE_VM: return "SOS_SHARE_VM";
+		case SOS_PAGER_STATUS: return "SOS_PAGER_STATUS";
+		case SOS_MUNMAP: return "SOS_MUNMAP";
+		case SOS_BUFFER: return "SOS_BUFFER";
+		case SOS_SWAP_STATUS: return "SOS_SWAP_STATUS";
+		case SOS_MEMLIMIT: return "SOS_MEMLIMIT";
+		case SOS_VM_STATUS: return "SOS_VM_STATUS";
+		case SOS_NFS_STATUS: return "SOS_NFS_STATUS";
 		case L4_PAGEFAULT: return "L4_PAGEFAULT";
 		case L4_INTERRUPT: return "L4_INTERRUPT";
 		case L4_EXCEPTION: return "L4_EXCEPTION";
@@ -99,14 +107,65 @@ int moremem(uintptr_t *base, unsigned int nb) {
 	}
 }
 
+// The syscall buffer SOS has mapped in, and where the last copy ended
+static char *buffer = NULL;
+static int bufferChecked = 0;
+static int bufferUse = 1;
+static size_t bufferPos = 0;
+
+static char *syscallBuffer(void) {
+	if (!bufferChecked) {
+		buffer = (char*) ipc_send_simple_0(vpager(), SOS_BUFFER, YES_REPLY);
+		bufferChecked = 1;
+	}
+
+	return bufferUse ? buffer : NULL;
+}
+
+static size_t bufferCopyStart(size_t size, int append) {
+	// Same rules as the pager: appending carries on from where the last
+	// copy (in or out) ended, and nothing goes past the end
+	if (!append) {
+		bufferPos = 0;
+	}
+
+	if (bufferPos + size > SYSCALL_BUFSIZ) {
+		size = SYSCALL_BUFSIZ - bufferPos;
+	}
+
+	return size;
+}
+
+int syscall_buffer(int use) {
+	int prev = bufferUse;
+	bufferUse = use;
+	return prev;
+}
+
 void copyin(void *data, size_t size, int append) {
-	ipc_send_simple_3(vpager(), SOS_COPYIN, YES_REPLY, (L4_Word_t) data,
-			(L4_Word_t) size, (L4_Word_t) append);
+	char *buf = syscallBuffer();
+
+	if (buf == NULL) {
+		ipc_send_simple_3(vpager(), SOS_COPYIN, YES_REPLY, (L4_Word_t) data,
+				(L4_Word_t) size, (L4_Word_t) append);
+	} else {
+		size = bufferCopyStart(size, append);
+		memcpy(buf + bufferPos, data, size);
+		bufferPos += size;
+	}
 }
 
 void copyout(void *data, size_t size, int append) {
-	ipc_send_simple_3(vpager(), SOS_COPYOUT, YES_REPLY, (L4_Word_t) data,
-			(L4_Word_t) size, (L4_Word_t) append);
+	char *buf = syscallBuffer();
+
+	if (buf == NULL) {
+		ipc_send_simple_3(vpager(), SOS_COPYOUT, YES_REPLY, (L4_Word_t) data,
+				(L4_Word_t) size, (L4_Word_t) append);
+	} else {
+		size = bufferCopyStart(size, append);
+		memcpy(data, buf + bufferPos, size);
+		bufferPos += size;
+	}
 }
 
 fildes_t open(const char *path, fmode_t mode) {
@@ -146,15 +205,61 @@ void closeNonblocking(fildes_t file) {
 }
 
 int read(fildes_t file, char *buf, size_t nbyte) {
+	iovec_t iov = { buf, nbyte };
+	return readv(file, &iov, 1);
+}
+
+static size_t iovLeft(const iovec_t *iov, int iovcnt, int i, size_t done) {
+	// How much is left to go in the vector from iov[i] + done, up to what
+	// fits in the syscall buffer
+	size_t left = 0;
+
+	for (; (i < iovcnt) && (left < SYSCALL_BUFSIZ); i++) {
+		left += iov[i].iov_len - done;
+		done = 0;
+	}
+
+	return (left < SYSCALL_BUFSIZ) ? left : SYSCALL_BUFSIZ;
+}
+
+static size_t iovPart(const iovec_t *iov, int i, size_t done, size_t size) {
+	// How much of size goes in to iov[i] from done
+	return (size < iov[i].iov_len - done) ? size : iov[i].iov_len - done;
+}
+
+int readv(fildes_t file, const iovec_t *iov, int iovcnt) {
+	int i = 0, total = 0, rval, append;
+	size_t done = 0, nbyte, size, left;
+
 	// flush stdout
 	flush(stdout_fd);
 
-	int rval = ipc_send_simple_2(L4_rootserver, SOS_READ, YES_REPLY,
-			(L4_Word_t) file, (L4_Word_t) nbyte);
+	do {
+		nbyte = iovLeft(iov, iovcnt, i, done);
+		rval = ipc_send_simple_2(L4_rootserver, SOS_READ, YES_REPLY,
+				(L4_Word_t) file, (L4_Word_t) nbyte);
 
-	copyout(buf, nbyte, 0);
+		if (rval < 0) {
+			return (total > 0) ? total : rval;
+		}
 
-	return rval;
+		// Scatter what came back
+		total += rval;
+
+		for (append = 0, left = rval; left > 0; append = 1) {
+			size = iovPart(iov, i, done, left);
+			copyout((char*) iov[i].iov_base + done, size, append);
+			left -= size;
+			done += size;
+
+			if (done == iov[i].iov_len) {
+				i++;
+				done = 0;
+			}
+		}
+	} while ((i < iovcnt) && (nbyte > 0) && ((size_t) rval == nbyte));
+
+	return total;
 }
 
 void readNonblocking(fildes_t file, size_t nbyte) {
@@ -163,10 +268,41 @@ void readNonblocking(fildes_t file, size_t nbyte) {
 }
 
 int write(fildes_t file, const char *buf, size_t nbyte) {
-	copyin((void*) buf, nbyte, 0);
+	iovec_t iov = { (void*) buf, nbyte };
+	return writev(file, &iov, 1);
+}
 
-	return ipc_send_simple_2(L4_rootserver, SOS_WRITE, YES_REPLY,
-			(L4_Word_t) file, (L4_Word_t) nbyte);
+int writev(fildes_t file, const iovec_t *iov, int iovcnt) {
+	int i = 0, total = 0, rval, append;
+	size_t done = 0, nbyte, size, left;
+
+	do {
+		// Gather as much as fits in the buffer
+		nbyte = iovLeft(iov, iovcnt, i, done);
+
+		for (append = 0, size = 0; size < nbyte; append = 1) {
+			left = iovPart(iov, i, done, nbyte - size);
+			copyin((char*) iov[i].iov_base + done, left, append);
+			size += left;
+			done += left;
+
+			if (done == iov[i].iov_len) {
+				i++;
+				done = 0;
+			}
+		}
+
+		rval = ipc_send_simple_2(L4_rootserver, SOS_WRITE, YES_REPLY,
+				(L4_Word_t) file, (L4_Word_t) nbyte);
+
+		if (rval < 0) {
+			return (total > 0) ? total : rval;
+		}
+
+		total += rval;
+	} while ((i < iovcnt) && (nbyte > 0) && ((size_t) rval == nbyte));
+
+	return total;
 }
 
 void writeNonblocking(fildes_t file, size_t nbyte) {
@@ -334,6 +470,15 @@ pid_t process_wait(pid_t pid) {
 			(L4_Word_t) pid);
 }
 
+/*
+ * Limit the resident pages of process "pid", returning the previous limit
+ * or -1 if there is no such process.
+ */
+int memlimit(pid_t pid, unsigned pages) {
+	return ipc_send_simple_2(vpager(), SOS_MEMLIMIT, YES_REPLY,
+			(L4_Word_t) pid, (L4_Word_t) pages);
+}
+
 /* Returns time in microseconds since booting. */
 uint64_t uptime(void) {
 	L4_Word_t rtime[2];
@@ -364,6 +509,30 @@ int physuse(void) {
 	return ipc_send_simple_0(vpager(), SOS_PHYSUSE, YES_REPLY);
 }
 
+int pager_status(pager_stat_t *stat) {
+	int rval = ipc_send_simple_0(vpager(), SOS_PAGER_STATUS, YES_REPLY);
+	copyout(stat, sizeof(pager_stat_t), 0);
+	return rval;
+}
+
+int swap_status(swap_stat_t *stat) {
+	int rval = ipc_send_simple_0(vpager(), SOS_SWAP_STATUS, YES_REPLY);
+	copyout(stat, sizeof(swap_stat_t), 0);
+	return rval;
+}
+
+int vm_status(vm_stat_t *stat) {
+	int rval = ipc_send_simple_0(vpager(), SOS_VM_STATUS, YES_REPLY);
+	copyout(stat, sizeof(vm_stat_t), 0);
+	return rval;
+}
+
+int nfs_status(nfs_stat_t *stat) {
+	int rval = ipc_send_simple_0(L4_rootserver, SOS_NFS_STATUS, YES_REPLY);
+	copyout(stat, sizeof(nfs_stat_t), 0);
+	return rval;
+}
+
 L4_Word_t memloc(L4_Word_t addr) {
 	return ipc_send_simple_0(vpager(), SOS_MEMLOC, YES_REPLY);
 }
@@ -374,9 +543,26 @@ L4_ThreadId_t vpager(void) {
 }
 
 void *mmap(void *addr, size_t size, fmode_t rights, char *path, off_t offset) {
+	stat_t st;
+	size_t filesize;
+
+	// The pager only pages the file in, so check it is there and allows
+	// what the mapping wants here
+	if ((stat(path, &st) < 0) || (st.st_type != ST_FILE) ||
+			(rights & ~st.st_fmode)) {
+		return NULL;
+	}
+
+	filesize = (offset < st.st_size) ? st.st_size - offset : 0;
+
 	copyin(path, strlen(path) + 1, 0);
-	return (void*) ipc_send_simple_4(vpager(), SOS_MMAP, YES_REPLY,
-			(L4_Word_t) addr, size, rights, offset);
+	return (void*) ipc_send_simple(vpager(), SOS_MMAP, YES_REPLY, 5,
+			(L4_Word_t) addr, size, rights, offset, filesize);
+}
+
+int munmap(void *addr, size_t size) {
+	return ipc_send_simple_2(vpager(), SOS_MUNMAP, YES_REPLY,
+			(L4_Word_t) addr, size);
 }
 
 /* 
@@ -392,7 +578,7 @@ void *mmap(void *addr, size_t size, fmode_t rights, char *path, off_t offset) {
  * Returns 0 if successful, -1 otherwise (invalid address or size).
  */
 int share_vm(void *adr, size_t size, int writable) {
-	printf("share_vm: system call not implemented.\n");
-	return -1;
+	return ipc_send_simple_3(vpager(), SOS_SHARE_VM, YES_REPLY,
+			(L4_Word_t) adr, size, writable);
 }
 
@@ -67,6 +67,7 @@ console_init(VNode sflist) {
 		console->writers = 0;
 		console->Max_Readers = Console_Files[i].Max_Readers;
 		console->Max_Writers = Console_Files[i].Max_Writers;
+		console->io_size = IO_MAX_BUFFER;
 
 		// setup system calls
 		console->open = console_open;
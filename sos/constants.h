@@ -15,19 +15,47 @@
 #define PAGEWORDS ((PAGESIZE) / (sizeof(L4_Word_t)))
 #define ONE_MEG (1 * 1024 * 1024)
 
+// Large pages, which the pager maps aligned runs of frames as where it can
+#define LARGE_PAGESIZE (16 * PAGESIZE)
+#define LARGE_PAGEALIGN (~((LARGE_PAGESIZE) - 1))
+#define LARGE_PAGEFRAMES ((LARGE_PAGESIZE) / (PAGESIZE))
+
 #define ADDRESS_ALL ((L4_Word_t) (-1))
 #define ADDRESS_NONE ((L4_Word_t) (-2))
 
 #define VIRTUAL_PAGER_PRIORITY 250
 
+// Number of swap I/Os the pager keeps in flight at once
+#define PAGER_IO_DEPTH 4
+
+// Most pages the pager reads ahead or writes out together in one I/O
+#define PAGER_CLUSTER 8
+
+// Frames of the user's share kept for compressing pages in to rather than
+// writing them to the swap file (0 to always write them)
+#define PAGER_ZSWAP_FRAMES 64
+
+// Executables the pager keeps open after starting processes from them, and
+// for how long (in microseconds) after the last one
+#define PAGER_SPAWN_FILES 4
+#define PAGER_SPAWN_YOUNG 2000000
+
+// Most NFS requests nfsfs has at the server at once
+#define NFSFS_WINDOW 8
+
 #define CONSOLE_BUF_SIZ 128
-#define COPY_BUFSIZ (PAGESIZE * 4)
+#define COPY_BUFSIZ SYSCALL_BUFSIZ
 #define MAX_ADDRSPACES 256
 #define MAX_THREADS 256
 #define PROCESS_MAX_FILES 16
 #define PROCESS_STDFDS_RESERVE 3
+
+// Most pages a process has resident before its own pages are swapped out
+// to make room for more, unless changed with memlimit
+#define PROCESS_RSS_LIMIT 512
 #define PROCESS_MAX_FDS (PROCESS_MAX_FILES + PROCESS_STDFDS_RESERVE)
 
 #define SWAPFILE_FN ".swap"
+#define SWAPFILE_MAX_SIZE (512 * ONE_MEG)
 
 #endif // constants.h
@@ -5,19 +5,64 @@
 #include "libsos.h"
 #include "frames.h"
 #include "l4.h"
+#include "process.h"
 
 #define verbose 1
 
 #define NULLFRAME ((L4_Word_t) (0))
 
+// The FRAME_* flags live in the low bits of the (page aligned) vaddr
+#define FLAGS_MASK (~PAGEALIGN)
+
+// Set for frames on the free list, which isn't one of the FRAME_* flags
+// since it is only of interest in here
+#define FRAME_FREE (1 << 11)
+
+// Free frames are in a doubly linked list, through their first two words,
+// so that runs of them can be taken out of the middle
+#define FREE_NEXT(frame) (((L4_Word_t*) (frame))[0])
+#define FREE_PREV(frame) (((L4_Word_t*) (frame))[1])
+
+// Frame table, one entry for every frame that can be allocated
+typedef struct {
+	pid_t pid;         // owner of the page being backed, or NIL_PID
+	L4_Word_t vaddr;   // page being backed, with the flags in the low bits
+	L4_Word_t backing; // clean copy of the page on disk, or ADDRESS_NONE
+	int refs;          // processes the page is mapped in to
+} FrameEntry;
+
+static FrameEntry *frameTable;
+static L4_Word_t firstFrame;
+static int clockHand;
+static int sweeps;
+
 static int totalFrames;
 static L4_Word_t firstFree;
 static int totalInUse;
+static int runHint; // where the last run was found
+
+static void frameEntryClear(FrameEntry *fe) {
+	fe->pid = NIL_PID;
+	fe->vaddr = 0;
+	fe->backing = ADDRESS_NONE;
+	fe->refs = 0;
+}
+
+static FrameEntry *frameLookup(L4_Word_t frame) {
+	if (frame < firstFrame) {
+		return NULL;
+	} else if (((frame - firstFrame) / PAGESIZE) >= totalFrames) {
+		return NULL;
+	} else {
+		return &frameTable[(frame - firstFrame) / PAGESIZE];
+	}
+}
 
 void frame_init(L4_Word_t low, L4_Word_t frame) {
 	L4_Word_t page, high;
 	L4_Fpage_t fpage;
 	L4_PhysDesc_t ppage;
+	int tableFrames;
 	totalFrames = 0;
 
 	// Make the high address page aligned (grr).
@@ -32,18 +77,49 @@ void frame_init(L4_Word_t low, L4_Word_t frame) {
 		L4_MapFpage(L4_rootspace, fpage, ppage);
 	}
 
+	// The frame table itself takes the first few frames.
+	tableFrames = (((high - low) / PAGESIZE) * sizeof(FrameEntry)
+			+ PAGESIZE - 1) / PAGESIZE;
+	frameTable = (FrameEntry*) low;
+	firstFrame = low + tableFrames * PAGESIZE;
+	clockHand = 0;
+	sweeps = 0;
+
+	dprintf(1, "*** frame_init: frame table is %d frames at %p\n",
+			tableFrames, frameTable);
+
 	// Make everything free.
 	dprintf(1, "*** frame_init: trying to initialise linked list.\n");
-	for (page = low; page < high - PAGESIZE; page += PAGESIZE) {
-		*((L4_Word_t*) page) = page + PAGESIZE;
+	for (page = firstFrame; page < high; page += PAGESIZE) {
+		FREE_NEXT(page) = page + PAGESIZE;
+		FREE_PREV(page) = page - PAGESIZE;
+		frameEntryClear(&frameTable[totalFrames]);
+		frameTable[totalFrames].vaddr = FRAME_FREE;
 		totalFrames++;
 	}
 
 	dprintf(1, "*** frame_init: trying to set bounds of linked list.\n");
-	firstFree = low;
-	*((L4_Word_t*) (high - PAGESIZE)) = NULLFRAME;
+	firstFree = firstFrame;
+	FREE_PREV(firstFrame) = NULLFRAME;
+	FREE_NEXT(high - PAGESIZE) = NULLFRAME;
 
 	totalInUse = 0;
+	runHint = 0;
+}
+
+static void freeListRemove(L4_Word_t frame) {
+	L4_Word_t next = FREE_NEXT(frame);
+	L4_Word_t prev = FREE_PREV(frame);
+
+	if (prev == NULLFRAME) {
+		firstFree = next;
+	} else {
+		FREE_NEXT(prev) = next;
+	}
+
+	if (next != NULLFRAME) {
+		FREE_PREV(next) = prev;
+	}
 }
 
 L4_Word_t frame_alloc(alloc_codes_t reason) {
@@ -52,7 +128,8 @@ L4_Word_t frame_alloc(alloc_codes_t reason) {
 	alloc = firstFree;
 
 	if (alloc != NULLFRAME) {
-		firstFree = *((L4_Word_t*) firstFree);
+		freeListRemove(alloc);
+		frameEntryClear(frameLookup(alloc));
 		totalInUse++;
 	} else {
 		// There is no free memory.
@@ -62,13 +139,165 @@ L4_Word_t frame_alloc(alloc_codes_t reason) {
 	return alloc;
 }
 
+static int runFree(int first, int count) {
+	for (int i = first; i < first + count; i++) {
+		if (!(frameTable[i].vaddr & FRAME_FREE)) return 0;
+	}
+
+	return 1;
+}
+
+L4_Word_t frame_alloc_run(alloc_codes_t reason, int count) {
+	L4_Word_t size = count * PAGESIZE;
+	int first, start, runs;
+	L4_Word_t alloc;
+
+	assert((count & (count - 1)) == 0);
+
+	// Runs start at frames aligned to their size, so only every count
+	// frames (from the first aligned one) need looking at, starting from
+	// where the last run was found since the ones before are likely used
+	start = (((firstFrame + size - 1) & ~(size - 1)) - firstFrame) / PAGESIZE;
+	runs = (totalFrames - start) / count;
+
+	if (runs <= 0) {
+		return NULLFRAME;
+	}
+
+	for (int i = 0; i < runs; i++) {
+		first = start + ((runHint + i) % runs) * count;
+
+		if (runFree(first, count)) {
+			runHint = (runHint + i) % runs;
+			alloc = firstFrame + first * PAGESIZE;
+
+			for (int j = 0; j < count; j++) {
+				freeListRemove(alloc + j * PAGESIZE);
+				frameEntryClear(&frameTable[first + j]);
+			}
+
+			totalInUse += count;
+			dprintf(2, "frames: allocated %d frames for %d: %p\n",
+					count, reason, alloc);
+			return alloc;
+		}
+	}
+
+	return NULLFRAME;
+}
+
 void frame_free(L4_Word_t frame) {
-	*((L4_Word_t*) frame) = firstFree;
+	FrameEntry *fe = frameLookup(frame);
+
+	frameEntryClear(fe);
+	fe->vaddr = FRAME_FREE;
+
+	FREE_NEXT(frame) = firstFree;
+	FREE_PREV(frame) = NULLFRAME;
+
+	if (firstFree != NULLFRAME) {
+		FREE_PREV(firstFree) = frame;
+	}
+
 	firstFree = frame;
 	totalInUse--;
 	dprintf(2, "frames: free'd frame: %p\n", frame);
 }
 
+L4_Word_t frame_nextswap(pid_t pid) {
+	FrameEntry *fe;
+	L4_Word_t page;
+
+	// Go at most once around the clock looking for a user page that
+	// isn't pinned
+	for (int i = 0; i < totalFrames; i++) {
+		fe = &frameTable[clockHand];
+		page = firstFrame + clockHand * PAGESIZE;
+		clockHand = (clockHand + 1) % totalFrames;
+
+		if (clockHand == 0) {
+			sweeps++;
+		}
+
+		if ((fe->pid != NIL_PID) && !(fe->vaddr & FRAME_PINNED) &&
+				((pid == NIL_PID) || (fe->pid == pid))) {
+			return page;
+		}
+	}
+
+	return NULLFRAME;
+}
+
+int frame_sweeps(void) {
+	return sweeps;
+}
+
+void frame_set_owner(L4_Word_t frame, pid_t pid, L4_Word_t vaddr) {
+	FrameEntry *fe = frameLookup(frame);
+	assert(fe != NULL);
+	assert((vaddr & FLAGS_MASK) == 0);
+
+	fe->pid = pid;
+	fe->vaddr = vaddr | (fe->vaddr & FLAGS_MASK);
+}
+
+pid_t frame_get_pid(L4_Word_t frame) {
+	FrameEntry *fe = frameLookup(frame);
+	return (fe == NULL) ? NIL_PID : fe->pid;
+}
+
+L4_Word_t frame_get_vaddr(L4_Word_t frame) {
+	FrameEntry *fe = frameLookup(frame);
+
+	if ((fe == NULL) || (fe->pid == NIL_PID)) {
+		return ADDRESS_NONE;
+	} else {
+		return fe->vaddr & ~FLAGS_MASK;
+	}
+}
+
+L4_Word_t frame_get_backing(L4_Word_t frame) {
+	FrameEntry *fe = frameLookup(frame);
+	return (fe == NULL) ? ADDRESS_NONE : fe->backing;
+}
+
+void frame_set_backing(L4_Word_t frame, L4_Word_t backing) {
+	FrameEntry *fe = frameLookup(frame);
+	assert(fe != NULL);
+	fe->backing = backing;
+}
+
+int frame_get_refs(L4_Word_t frame) {
+	FrameEntry *fe = frameLookup(frame);
+	return (fe == NULL) ? 0 : fe->refs;
+}
+
+void frame_set_refs(L4_Word_t frame, int refs) {
+	FrameEntry *fe = frameLookup(frame);
+	assert(fe != NULL);
+	assert(refs >= 0);
+	fe->refs = refs;
+}
+
+int frame_get_flags(L4_Word_t frame) {
+	FrameEntry *fe = frameLookup(frame);
+	return (fe == NULL) ? 0 : (fe->vaddr & FLAGS_MASK);
+}
+
+void frame_set_flags(L4_Word_t frame, int flags) {
+	FrameEntry *fe = frameLookup(frame);
+	assert(fe != NULL);
+	assert((flags & ~FLAGS_MASK) == 0);
+	fe->vaddr |= flags;
+}
+
+void frame_clear_flags(L4_Word_t frame, int flags) {
+	FrameEntry *fe = frameLookup(frame);
+	assert(fe != NULL);
+	assert((flags & ~FLAGS_MASK) == 0);
+	fe->vaddr &= ~flags;
+}
+
 int frames_allocated(void) {
 	return totalInUse;
 }
@@ -1,6 +1,8 @@
 #ifndef _SOS_FRAMES_H_
 #define _SOS_FRAMES_H_
 
+#include <sos/sos.h>
+
 #include "l4.h"
 
 // Reasons for allocing a frame, used to hel find memory leaks
@@ -15,14 +17,53 @@ typedef enum {
 	FA_PAGERALLOC,
 } alloc_codes_t;
 
+// State kept for each frame in the frame table
+#define FRAME_REF    (1 << 0) // referenced since the clock hand last passed
+#define FRAME_DIRTY  (1 << 1) // differs from the copy on disk (if any)
+#define FRAME_PINNED (1 << 2) // in use by the pager, can't be swapped out
+#define FRAME_PREFETCHED (1 << 3) // read ahead and not used yet
+#define FRAME_LARGE  (1 << 4) // mapped as part of a large page
+
 // Initialise the frame table
 void frame_init(L4_Word_t low, L4_Word_t frame);
 
 // Allocate a frame
 L4_Word_t frame_alloc(alloc_codes_t reason);
 
-// Get the next frame to swap out
-L4_Word_t frame_nextswap(void);
+// Allocate count (a power of 2) physically contiguous frames, aligned to
+// their total size, returning the first or 0 if there is no such run free.
+// They are freed one at a time as usual
+L4_Word_t frame_alloc_run(alloc_codes_t reason, int count);
+
+// Advance the clock hand to the next frame which could be swapped out
+// (only those of pid, unless it is NIL_PID), returning it, or 0 if there
+// are none
+L4_Word_t frame_nextswap(pid_t pid);
+
+// Number of times the clock hand has gone all the way around
+int frame_sweeps(void);
+
+// Record which user page a frame is backing, making it a swap candidate
+void frame_set_owner(L4_Word_t frame, pid_t pid, L4_Word_t vaddr);
+
+// Reverse lookup of the pid and page a frame is backing (NIL_PID and
+// ADDRESS_NONE if it isn't backing a user page)
+pid_t frame_get_pid(L4_Word_t frame);
+L4_Word_t frame_get_vaddr(L4_Word_t frame);
+
+// The clean copy of a frame on disk, or ADDRESS_NONE
+L4_Word_t frame_get_backing(L4_Word_t frame);
+void frame_set_backing(L4_Word_t frame, L4_Word_t backing);
+
+// How many processes share the page a frame is backing (1 unless it has
+// been shared with share_vm)
+int frame_get_refs(L4_Word_t frame);
+void frame_set_refs(L4_Word_t frame, int refs);
+
+// Query and modify the FRAME_* state of a frame
+int frame_get_flags(L4_Word_t frame);
+void frame_set_flags(L4_Word_t frame, int flags);
+void frame_clear_flags(L4_Word_t frame, int flags);
 
 // Free a frame
 void frame_free(L4_Word_t frame);
@@ -14,6 +14,7 @@
 
 #include <lwip/mem.h>
 #include <lwip/memp.h>
+#include <lwip/tcp.h>
 #include <lwip/udp.h>
 #include <lwip/pbuf.h>
 #include <lwip/netif/etharp.h>
@@ -35,6 +36,17 @@ static struct serial *serial = NULL;
  * Watch out for possible swap file collisions with your partner! :)
  */
 
+/*
+ * What NFS calls go over.  TCP keeps a connection to the server and moves
+ * up to NFS_MAXDATA a call, while UDP only moves what fits in a packet.
+ * Build with NFS_TCP set in the environment to use TCP.
+ */
+#ifdef NFS_TCP
+#define NFS_TRANSPORT NFS_OVER_TCP
+#else
+#define NFS_TRANSPORT NFS_OVER_UDP
+#endif
+
 // Internal APIs, just direct publish from ixp_osal
 extern uint32_t ixOsalOemInit(void);
 extern void ixOsalOSServicesFinaliseInit(void);
@@ -58,6 +70,7 @@ void network_init(void) {
 	pbuf_init();
 	netif_init();
 	udp_init();
+	tcp_init();
 	etharp_init();
 
 	/* Setup the network interface */
@@ -89,7 +102,7 @@ void network_init(void) {
 	ixOsalOSServicesFinaliseInit();
 
 	/* Initialise NFS */
-	int r = nfs_init(gw); assert(!r);
+	int r = nfs_init(gw, NFS_TRANSPORT); assert(!r);
 
 	mnt_get_export_list();	// Print out the exports on this server
 
@@ -1,11 +1,11 @@
 #include <string.h>
 #include <nfs/nfs.h>
+#include <sos/ipc.h>
 
 #include "nfsfs.h"
 
 #include "constants.h"
 #include "libsos.h"
-#include "list.h"
 #include "network.h"
 #include "process.h"
 #include "syscall.h"
@@ -16,18 +16,26 @@
 extern void nfs_timeout(void);
 
 #define MS_TO_US 1000
-#define NFSFS_TIMEOUT_MS (100 * MS_TO_US)
+#define NFSFS_TIMEOUT_MS (20 * MS_TO_US)
 
+/* Only wakes the main thread up to run the timeouts, since that is the
+ * thread doing all the other networking */
 static
 void
 nfsfs_timeout_thread(void) {
 	while (1) {
 		sos_usleep(NFSFS_TIMEOUT_MS);
-		nfs_timeout();
+		ipc_send_simple_0(L4_rootserver, PSOS_NFS_TIMEOUT, SOS_IPC_CALL);
 		dprintf(4, "*** nfs_timeout_thread: timout event!\n");
 	}
 }
 
+/* Run the NFS timeouts (from the main thread) */
+void
+nfsfs_timeout(void) {
+	nfs_timeout();
+}
+
 
 /******** NFS FS ********/
 #define NULL_TOKEN ((uintptr_t) (-1))
@@ -71,6 +79,10 @@ struct NFS_BaseRequest_t {
 	uintptr_t token;
 	VNode vnode;
 	pid_t pid;
+	int running; /* sent to the server and waiting on the reply */
+	NFS_BaseRequest *next;      /* next newest in NfsRequests */
+	NFS_BaseRequest *previous;  /* next oldest in NfsRequests */
+	NFS_BaseRequest *hash_next; /* next in the token's bucket */
 };
 
 typedef struct {
@@ -121,8 +133,19 @@ typedef struct {
 	const char *path;
 } NFS_RemoveRequest;
 
-/* Queue of request for callbacks */
-static List *NfsRequests;
+/* Queue of request for callbacks, oldest first */
+static NFS_BaseRequest *NfsRequests;
+static NFS_BaseRequest *NfsRequestsLast;
+
+/* Number of requests in NfsRequests, and of those that are running */
+static int queued;
+static int in_flight;
+
+/* Requests by token, for matching up replies.  Tokens are handed out in
+ * order, so the ones in use at once are spread evenly over the buckets. */
+#define REQUEST_BUCKETS 64
+#define REQUEST_BUCKET(token) ((token) % REQUEST_BUCKETS)
+static NFS_BaseRequest *request_table[REQUEST_BUCKETS];
 
 /* NFS Base directory */
 static struct cookie nfs_mnt;
@@ -145,7 +168,14 @@ nfsfs_init(void) {
 	/* redefine just to limit our linkage to one place */
 	nfs_mnt = mnt_point;
 
-	NfsRequests = list_empty();
+	NfsRequests = NULL;
+	NfsRequestsLast = NULL;
+	queued = 0;
+	in_flight = 0;
+
+	for (int i = 0; i < REQUEST_BUCKETS; i++) {
+		request_table[i] = NULL;
+	}
 	
 	/* Run the nfs time out thread */
 	process_run_rootthread("nfs_timeout", nfsfs_timeout_thread, YES_TIMESTAMP, 0);
@@ -161,36 +191,23 @@ newtoken(void) {
 	return ((tok++) % (NULL_TOKEN - 1));
 }
 
-/* NfsRequest list search function, searching on a token */
-static
-int
-search_requests(void *node, void *key) {
-	NFS_BaseRequest *brq = (NFS_BaseRequest *) node;
-	uintptr_t token = *((uintptr_t *) key);
-	dprintf(2, "search_requests: %d, %d\n", brq->token, token);
-	if (brq->token == token) {
-		return 1;
-	} else {
-		return 0;
-	}
-}
-
 /* Return a NFS request struct with the token specified */
 static
 NFS_BaseRequest*
 get_request(uintptr_t token) {
-	if (list_null(NfsRequests)) {
-		dprintf(0, "!!! get_request: List is NULL\n");
-		return NULL;
+	NFS_BaseRequest *brq = request_table[REQUEST_BUCKET(token)];
+
+	while (brq != NULL && brq->token != token) {
+		brq = brq->hash_next;
 	}
-	return (NFS_BaseRequest *) list_find(NfsRequests, search_requests, &token);
+
+	return brq;
 }
 
-/* Run a request if its at the start of the queue */
+/* Run a request, sending it to the server */
 static
 int
 run_request(NFS_BaseRequest *rq) {
-	/* At head of queue, so run it */
 	switch (rq->rt) {
 		case RT_LOOKUP:
 			rq_lookup_run((NFS_LookupRequest *) rq);
@@ -218,34 +235,117 @@ run_request(NFS_BaseRequest *rq) {
 	return 1;
 }
 
-/* check if the specified request is at the start of the list and should run */
+/* The part of a file a read or write request covers, returning 0 for other
+ * requests */
 static
 int
-check_request(NFS_BaseRequest *rq) {
-	if (list_null(NfsRequests)) {
-		dprintf(0, "!!! nfsfs: check_request NfsRequest list is null !!!\n");
-		return run_request(rq);
+request_range(NFS_BaseRequest *rq, L4_Word_t *start, L4_Word_t *end) {
+	switch (rq->rt) {
+		case RT_READ:
+			*start = ((NFS_ReadRequest *) rq)->pos;
+			*end = *start + ((NFS_ReadRequest *) rq)->nbyte;
+			return 1;
+		case RT_WRITE:
+			*start = ((NFS_WriteRequest *) rq)->offset;
+			*end = *start + ((NFS_WriteRequest *) rq)->nbyte;
+			return 1;
+		default:
+			return 0;
 	}
+}
 
-	/* Check at head of queue */
-	NFS_BaseRequest *brq = (NFS_BaseRequest *) list_peek(NfsRequests);
-	if (brq != rq) {
-		return 0;
+/* The name a request looks up, creates or removes, or NULL if it doesn't (or
+ * for getdirent, which looks at all of them) */
+static
+const char *
+request_name(NFS_BaseRequest *rq) {
+	switch (rq->rt) {
+		case RT_LOOKUP:
+			return rq->vnode->path;
+		case RT_STAT:
+			return ((NFS_StatRequest *) rq)->path;
+		case RT_REMOVE:
+			return ((NFS_RemoveRequest *) rq)->path;
+		default:
+			return NULL;
 	}
+}
 
-	return run_request((NFS_BaseRequest *) list_peek(NfsRequests));
+/* Check if a request changes the names in the directory */
+static
+int
+request_renames(NFS_BaseRequest *rq) {
+	return (rq->rt == RT_REMOVE) ||
+		((rq->rt == RT_LOOKUP) && (((NFS_LookupRequest *) rq)->mode & FM_WRITE));
 }
 
-/* Run request at head of queue */
+/* Check if request rq has to wait for the earlier request before to finish.
+ * Only what would see a different result if they were swapped around is kept
+ * in order: overlapping transfers on the same file where one is a write, and
+ * anything about a name with a create or remove of it (getdirent going with
+ * any name).  Everything else can be at the server at once.
+ */
 static
 int
-run_head_request(void) {
-	if (list_null(NfsRequests)) {
+request_follows(NFS_BaseRequest *rq, NFS_BaseRequest *before) {
+	L4_Word_t start, end, bstart, bend;
+
+	if (request_range(rq, &start, &end)) {
+		if (before->vnode != rq->vnode) {
+			return 0;
+		} else if (!request_range(before, &bstart, &bend)) {
+			return 0;
+		} else if ((rq->rt == RT_READ) && (before->rt == RT_READ)) {
+			return 0;
+		} else {
+			return (start < bend) && (bstart < end);
+		}
+	}
+
+	if (!request_renames(rq) && !request_renames(before)) {
 		return 0;
+	} else if ((rq->rt == RT_DIR && request_renames(before)) ||
+			(before->rt == RT_DIR && request_renames(rq))) {
+		return 1;
+	} else if (request_name(rq) == NULL || request_name(before) == NULL) {
+		return 0;
+	} else {
+		return strncmp(request_name(rq), request_name(before), MAX_FILE_NAME) == 0;
 	}
-	return run_request((NFS_BaseRequest *) list_peek(NfsRequests));
 }
 
+/* Check if anything before a request in the queue has to finish first */
+static
+int
+request_blocked(NFS_BaseRequest *rq) {
+	for (NFS_BaseRequest *brq = NfsRequests; brq != rq; brq = brq->next) {
+		if (request_follows(rq, brq)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Run whichever waiting requests can go now, oldest first */
+static
+void
+run_requests(void) {
+	NFS_BaseRequest *rq = NfsRequests;
+
+	for (; rq != NULL && in_flight < NFSFS_WINDOW; rq = rq->next) {
+		if (rq->running) {
+			continue;
+		} else if (request_blocked(rq)) {
+			dprintf(2, "nfsfs: request %d waiting\n", rq->token);
+			continue;
+		}
+
+		rq->running = 1;
+		in_flight++;
+		run_request(rq);
+	}
+}
 
 /* Create a new NFS request of type specified */
 static
@@ -287,9 +387,22 @@ create_request(enum NfsRequestType rt, VNode vn, pid_t pid) {
 	rq->token = newtoken();
 	rq->vnode = vn;
 	rq->pid = pid;
+	rq->running = 0;
+
+	// add to end of queue
+	rq->next = NULL;
+	rq->previous = NfsRequestsLast;
+	if (NfsRequestsLast == NULL) {
+		NfsRequests = rq;
+	} else {
+		NfsRequestsLast->next = rq;
+	}
+	NfsRequestsLast = rq;
+	queued++;
 
-	// add to list
-	list_push(NfsRequests, rq);
+	// and to the token's bucket
+	rq->hash_next = request_table[REQUEST_BUCKET(rq->token)];
+	request_table[REQUEST_BUCKET(rq->token)] = rq;
 
 	return rq;
 }
@@ -298,8 +411,29 @@ create_request(enum NfsRequestType rt, VNode vn, pid_t pid) {
 static
 void
 remove_request(NFS_BaseRequest *rq) {
-	// remove from lists
-	list_delete_first(NfsRequests, search_requests, &(rq->token));
+	// remove from queue
+	if (rq->previous == NULL) {
+		NfsRequests = rq->next;
+	} else {
+		rq->previous->next = rq->next;
+	}
+	if (rq->next == NULL) {
+		NfsRequestsLast = rq->previous;
+	} else {
+		rq->next->previous = rq->previous;
+	}
+
+	// and from the token's bucket
+	NFS_BaseRequest **link = &request_table[REQUEST_BUCKET(rq->token)];
+	while (*link != rq) {
+		link = &((*link)->hash_next);
+	}
+	*link = rq->hash_next;
+
+	queued--;
+	if (rq->running) {
+		in_flight--;
+	}
 
 	// free memory
 	switch (rq->rt) {
@@ -325,8 +459,8 @@ remove_request(NFS_BaseRequest *rq) {
 			dprintf(0, "!!! nfsfs.c: remove_request: invalid request type %d\n", rq->rt);
 	}
 
-	// run next request in queue
-	run_head_request();
+	// run what was waiting on it, or for room
+	run_requests();
 }
 
 /* Copy the relavent entriees from attr to buf */
@@ -453,6 +587,7 @@ nfsfs_open(pid_t pid, VNode self, const char *path, fmode_t mode,
 	memcpy( (void *) self->path, (void *) path, MAX_FILE_NAME);
 	self->readers = 0;
 	self->writers = 0;
+	self->io_size = nfs_transfer_size();
 	self->vstat.st_type = ST_FILE;
 	self->next = NULL;
 	self->previous = NULL;
@@ -476,7 +611,7 @@ nfsfs_open(pid_t pid, VNode self, const char *path, fmode_t mode,
 	rq->mode = mode;
 	rq->open_done = open_done;
 	
-	check_request((NFS_BaseRequest *) rq);
+	run_requests();
 }
 
 /* Run the actual open/lookup request */
@@ -559,7 +694,7 @@ nfsfs_read(pid_t pid, VNode self, fildes_t file, L4_Word_t pos,
 	rq->nbyte = nbyte;
 	rq->read_done = read_done;
 
-	check_request((NFS_BaseRequest *) rq);
+	run_requests();
 }
 
 /* Run the actual read request */
@@ -618,7 +753,7 @@ nfsfs_write(pid_t pid, VNode self, fildes_t file, L4_Word_t offset,
 	rq->nbyte = nbyte;
 	rq->write_done = write_done;
 
-	check_request((NFS_BaseRequest *) rq);
+	run_requests();
 }
 
 /* Run the actual write request */
@@ -702,7 +837,7 @@ nfsfs_getdirent(pid_t pid, VNode self, int pos, char *name, size_t nbyte) {
 	rq->nbyte = nbyte;
 	rq->cpos = 0;
 
-	check_request((NFS_BaseRequest *) rq);
+	run_requests();
 }
 
 /* Run a getdirent request */
@@ -761,7 +896,7 @@ nfsfs_stat(pid_t pid, VNode self, const char *path, stat_t *buf) {
 		NFS_StatRequest *rq = (NFS_StatRequest *) create_request(RT_STAT, self, pid);
 		rq->stat = buf;
 		rq->path = path;
-		check_request((NFS_BaseRequest *) rq);
+		run_requests();
 	}
 }
 
@@ -803,7 +938,7 @@ nfsfs_remove(pid_t pid, VNode self, const char *path) {
 		NFS_RemoveRequest *rq = (NFS_RemoveRequest *)
 			create_request(RT_REMOVE, self, pid);
 		rq->path = path;
-		check_request((NFS_BaseRequest *) rq);
+		run_requests();
 	}
 }
 
@@ -814,3 +949,24 @@ rq_rem_run(NFS_RemoveRequest *rq) {
 	nfs_remove(&nfs_mnt, (char *) rq->path, remove_cb, rq->p.token);
 }
 
+
+/* Get the status of NFS requests and the RPCs under them */
+int
+nfsfs_status(nfs_stat_t *dest) {
+	struct rpc_stats rs;
+	rpc_get_stats(&rs);
+
+	dest->requests = queued;
+	dest->in_flight = in_flight;
+	dest->calls = rs.calls;
+	dest->retransmits = rs.retransmits;
+	dest->deferred = rs.deferred;
+	dest->duplicates = rs.duplicates;
+	dest->connects = rs.connects;
+	dest->transfer = nfs_transfer_size();
+	dest->rto_us = rs.rto;
+	dest->srtt_us = rs.srtt;
+	dest->rttvar_us = rs.rttvar;
+
+	return 0;
+}
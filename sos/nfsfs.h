@@ -44,4 +44,10 @@ void nfsfs_stat(pid_t pid, VNode self, const char *path, stat_t *buf);
 /* Remove a file */
 void nfsfs_remove(pid_t pid, VNode self, const char *path);
 
+/* Resend timed out RPCs and run the network timers, from the main thread */
+void nfsfs_timeout(void);
+
+/* Get the status of NFS requests and the RPCs under them */
+int nfsfs_status(nfs_stat_t *dest);
+
 #endif // sos/nfsfs.h
@@ -1,4 +1,6 @@
+#include <clock/clock.h>
 #include <elf/elf.h>
+#include <sos/ipc.h>
 #include <sos/sos.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,19 +18,24 @@
 #include "region.h"
 #include "swapfile.h"
 #include "syscall.h"
+#include "zswap.h"
 
 #define verbose 1
 
 // Masks for page table entries
+// (the referenced and dirty bits are kept in the frame table)
 #define SWAP_MASK (1 << 0)
-#define REF_MASK  (1 << 1)
-#define ELF_MASK  (1 << 2)
+#define ZERO_MASK (1 << 1)
+#define FILE_MASK (1 << 2) // backed by the region's file (ELF or mmap)
+#define SHARED_MASK (1 << 3) // the real entry is in the SharedPage
 #define ADDRESS_MASK PAGEALIGN
 
-// The threshhold of free frames until the kernel starts to swap user pages
+// The threshhold of free frames until the cleaner starts to swap user pages
+// out in the background
 #define FRAME_SWAP_THRESHHOLD 128
 
-// The threshhold of free frames until the kernel starts killing processes
+// The threshhold of free frames until the cleaner stops waiting to be
+// scheduled and cleans as soon as there is a worker for it
 #define FRAME_DOOMSDAY_THRESHHOLD 8
 static int totalPages;
 
@@ -36,79 +43,209 @@ static int totalPages;
 #define FRAME_ALLOC_LIMIT 1024
 static int allocLimit;
 
-// Tracking allocated frames, including default swap file
-static List *alloced; // [(pid, word)]
-static List *swapped; // [(pid, word)]
+// Untouched heap and stack pages are mapped read-only to this frame
+static L4_Word_t zeroFrame;
 
-#define PR_OFFSET_UNDEFINED (-1)
 static Swapfile *defaultSwapfile;
 
+// Pages shared with share_vm, which are at the same address in every
+// process sharing them.  Their frames and swap slots are owned by
+// SHARED_PID rather than any one process, with the refcount in the frame
+// table being the number of sharers
+#define SHARED_PID ((pid_t) (-2))
+#define SHARED_BUCKETS 64
+
+typedef struct {
+	L4_Word_t vaddr; // page being shared
+	L4_Word_t entry; // where it is, as for an unshared page table entry
+	List *sharers;   // [(pid, writable)]
+} SharedPage;
+
+static List *shared[SHARED_BUCKETS]; // [SharedPage], hashed on vaddr
+
+// Pages of files mapped read-only, and of executables' text, shared by every
+// process mapping the same page of the same file.  Their frames are owned by
+// CACHE_PID, with the id of the file in place of the vaddr and the offset in
+// the file as the backing, and the refcount in the frame table being the
+// number of mappers.  Text stays cached with nobody mapping it (until it is
+// evicted) so that the next process running the same program finds it
+#define CACHE_PID ((pid_t) (-3))
+#define CACHE_BUCKETS 64
+
+typedef struct {
+	char path[MAX_FILE_NAME];
+	L4_Word_t id; // page aligned, to fit in the frame table
+	int refs;     // regions mapping the file
+	int pages;    // pages of it in the cache
+	int keep;     // whether pages stay with no mappers (only if stat is known)
+	int stale;    // the file has changed, so it can't be found by path
+	stat_t stat;  // attributes when first cached, to tell if it changes
+} CachedFile;
+
+typedef struct {
+	L4_Word_t file;   // id of the CachedFile
+	L4_Word_t offset; // page of the file
+	L4_Word_t frame;
+	List *mappers;    // [(pid, vaddr)]
+} CachedPage;
+
+static List *cachedFiles;           // [CachedFile]
+static L4_Word_t lastCachedFile;    // id of the last file to be cached
+static List *cached[CACHE_BUCKETS]; // [CachedPage], hashed on file and offset
+
+// Files mapped without an address go anywhere from here up to the top of
+// the stack (half way up the address space)
+#define MMAP_BASE 0x40000000
+#define MMAP_TOP ((((unsigned int) -1) >> 1) & PAGEALIGN)
+
 // Asynchronous pager requests
 typedef enum {
-	REQUEST_SWAPOUT,
-	REQUEST_SWAPIN,
-	REQUEST_ELFLOAD,
+	REQUEST_PAGER,
+	REQUEST_WRITEBACK,
 } rtype_t;
 
-static List *requests; // [(rtype_t, rdata)]
-static int requestActive;
+static List *requests; // [(rtype_t, rdata)], waiting to be started
 
 static void queueRequest(rtype_t rtype, void *request);
-static void dequeueRequest(void);
-static void startPagerRequest(void);
-static void startRequest(void);
-static void startSwapin(void);
-static void startSwapout(void);
+static void runRequests(void);
 
 // Demand paging
 typedef enum {
-	SWAPIN_OPEN,
-	SWAPIN_LSEEK,
-	SWAPIN_READ,
-	SWAPIN_CLOSE,
-	SWAPOUT_OPEN,
-	SWAPOUT_WRITE,
-	SWAPOUT_CLOSE
+	PR_SWAPIN,  // reading the page in to the pinned frame
+	PR_SWAPOUT, // writing out a victim to make room
+	PR_WRITEBACK, // writing an unmapped file's pages back to it
 } pr_stage_t;
 
+typedef enum {
+	IO_READ,
+	IO_WRITE,
+} pager_io_t;
+
+// A page of I/O
+typedef struct {
+	L4_Word_t vaddr;    // page it belongs to
+	L4_Word_t frame;    // frame to read in to or write out from
+	L4_Word_t diskAddr; // position in the file
+	int size;           // bytes to write (less than a page at the end of a file)
+	L4_Word_t evicted;  // slot to write to instead, or ADDRESS_NONE (see zswap.h)
+	int rval;
+} PagerIOPage;
+
+// I/O handed to a worker, all in the one file and for the one process.
+// The first page is the one the request is really for, the rest are
+// read-ahead or clustered with it
+typedef struct {
+	pager_io_t op;
+	Swapfile *sf;
+	pid_t pid;
+	int count;
+	int memory; // done without the worker, from or in to the compressed store
+	PagerIOPage pages[PAGER_CLUSTER];
+} PagerIO;
+
+typedef struct PagerWorker_t PagerWorker;
 typedef struct PagerRequest_t PagerRequest;
+
 struct PagerRequest_t {
 	pr_stage_t stage;
 	pid_t pid;
 	L4_Word_t addr;
-	L4_Word_t diskAddr;
-	Swapfile *sf;
 	int rights;
-	int offset;
-	int size;
-	void (*swapinFinish)(void);
+	L4_Word_t pinned;      // frame the page is read in to, or 0
+	L4_Word_t backing;     // where the page was read from, for the frame table
+	uint64_t started;      // when the swapin started
+	uint64_t faulted;      // when the fault (or step of a copy) was taken
+	fault_class_t fclass;  // slowest thing the fault has had to wait for
+	int swapped;           // had a frame swapped out for it, so can go over
+	                       // the process's limit
+	PagerWorker *worker;   // worker doing the I/O, NULL until started
+	PagerIO io;
+	Swapfile *file;        // file being written back to
+	List *writeback;       // [PagerIOPage], still to be written back
 	void (*callback)(PagerRequest *pr);
 };
 
-static L4_Word_t pinnedFrame;
+// I/O workers, each has one request in flight so there are at most
+// PAGER_IO_DEPTH swap I/Os outstanding
+#define PAGER_IO_PRIORITY 253
+
+struct PagerWorker_t {
+	L4_ThreadId_t tid;
+	PagerRequest *pr; // request it belongs to, NULL if free
+	int ready;        // waiting for a job
+};
+
+static PagerWorker workers[PAGER_IO_DEPTH];
+
+// Page cleaner, a thread below user processes in priority so that it only
+// gets to ask for cleaning to be done when there is nothing better to do
+#define PAGER_CLEANER_PRIORITY 50
+
+static L4_ThreadId_t cleaner;
+static int cleanerWaiting; // blocked waiting for the pager to give it work
+static int cleansActive;   // cleaning requests in flight
+static pager_stat_t stats; // only the counters are kept up to date
+static void pagerCleaner(void);
 
-// ELF loading
+// Working set estimation, from how many pages of each process the clock
+// hand finds referenced on its way around
+static int wsRefs[MAX_THREADS];
+static int wsSweep;
+
+// Swapins, whether from the compressed store or the file (the rest of the
+// swap status is kept by the store)
+static swap_stat_t swapStats;
+
+// Page fault counts and latencies
+static vm_stat_t vmStats;
+
+// ELF loading, which has a queue of its own so that starting processes
+// doesn't wait behind paging
 typedef enum {
-	ELFLOAD_OPEN,
 	ELFLOAD_CHECK_EXEC,
+	ELFLOAD_OPEN,
 	ELFLOAD_READ_HEADER,
-	ELFLOAD_CLOSE,
+	ELFLOAD_CLOSE, // closing executables that are no longer kept open
 } elfload_stage_t;
 
+// An executable processes have recently been started from, which the pager
+// keeps open along with its headers.  The processes' first pages in don't
+// have to open it again, and starting the same program again only has to
+// check that it hasn't changed
+typedef struct {
+	Swapfile *sf;  // shared by the segments of processes started from it
+	stat_t stat;   // attributes when opened
+	char *header;  // the first IO_MAX_BUFFER bytes, with the program headers
+	uint64_t used; // when a process was last started from it
+	int stale;     // changed or not used for a while, so to be closed
+} SpawnFile;
+
 typedef struct {
 	elfload_stage_t stage;
 	char path[MAX_FILE_NAME];  // path to executable
 	fildes_t fd; // file descriptor (when opened)
 	pid_t parent; // pid of the process that made the request
 	pid_t child; // pid of the process created
+	int rval; // what to reply with once the closing is done
+	stat_t stat; // attributes of the executable
+	SpawnFile *file; // the executable, once it is open
 	char *fdout; // Redirection files
 	char *fderr;
 	char *fdin;
 } ElfloadRequest;
 
+static ElfloadRequest *elfloadActive; // ELF loads are run one at a time
+static List *spawns;                  // [ElfloadRequest], waiting to be started
+static List *spawnFiles;              // [SpawnFile], most recently used first
+
 static L4_ThreadId_t virtualPager; // automatically L4_nilthread
 static void virtualPagerHandler(void);
 
+// Swap-in read-ahead, where the window grows while a process faults pages
+// in sequentially and shrinks when it doesn't or prefetched pages go unused
+static L4_Word_t lastSwapin[MAX_THREADS];
+static int readAhead[MAX_THREADS];
+
 // For copyin/copyout
 #define LO_HALF_MASK 0x0000ffff
 #define LO_HALF(word) ((word) & 0x0000ffff)
@@ -117,7 +254,18 @@ static void virtualPagerHandler(void);
 #define HI_SHIFT(word) ((word) << 16)
 
 static L4_Word_t copyInOutData[MAX_THREADS];
-static char copyInOutBuffer[MAX_THREADS * COPY_BUFSIZ];
+static char copyInOutBuffer[MAX_THREADS * COPY_BUFSIZ]
+	__attribute__((aligned(PAGESIZE)));
+
+// Where each process has its buffer mapped, 0 until it first touches it
+static L4_Word_t bufferMapped[MAX_THREADS];
+
+// The most pages a single copyin or copyout can span
+#define COPY_PAGES (COPY_BUFSIZ / PAGESIZE + 1)
+
+// Words copied at a time when both sides are aligned (a cache line)
+#define COPY_BURST 8
+
 static void copyIn(L4_ThreadId_t tid, void *src, size_t size, int append);
 static void copyOut(L4_ThreadId_t tid, void *dst, size_t size, int append);
 
@@ -175,52 +323,60 @@ static L4_Word_t* pagetableLookup(Pagetable *pt, L4_Word_t addr) {
 	return &level1->pages2[offset1]->pages[offset2];
 }
 
-static void pagetableFree(Process *p) {
-	assert(p != NULL);
-	Pagetable1 *pt1 = (Pagetable1*) process_get_pagetable(p);
-	assert(pt1 != NULL);
+static int findShared(void *contents, void *data) {
+	return ((SharedPage*) contents)->vaddr == (L4_Word_t) data;
+}
 
-	for (int i = 0; i < PAGEWORDS; i++) {
-		if (pt1->pages2[i] != NULL) {
-			frame_free((L4_Word_t) pt1->pages2[i]);
-		}
-	}
+static List *sharedBucket(L4_Word_t vaddr) {
+	return shared[(vaddr / PAGESIZE) % SHARED_BUCKETS];
+}
 
-	frame_free((L4_Word_t) pt1);
+static SharedPage *sharedLookup(L4_Word_t vaddr) {
+	return list_find(sharedBucket(vaddr), findShared, (void*) vaddr);
 }
 
-static void pagerFrameFree(Process *p, L4_Word_t frame) {
-	assert((frame & ~PAGEALIGN) == 0);
-	frame_free(frame);
-	allocLimit++;
+static SharedPage *sharedGet(Process *p, L4_Word_t addr) {
+	// The shared page a process has at addr, or NULL if it isn't shared
+	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), addr);
 
-	if (p != NULL) process_get_info(p)->size--;
+	if (*entry & SHARED_MASK) {
+		return sharedLookup(addr & PAGEALIGN);
+	} else {
+		return NULL;
+	}
 }
 
-static int framesFree(void *contents, void *data) {
-	Pair *curr = (Pair*) contents; // (pid, word)
-	Process *p = (Process*) data;  // (pid, word)
+static L4_Word_t *pageEntry(Process *p, L4_Word_t addr) {
+	// Where a page really is, which for a shared page is kept with the
+	// share rather than in the page table
+	SharedPage *sp = sharedGet(p, addr);
 
-	if ((pid_t) curr->fst == process_get_pid(p)) {
-		L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), curr->snd);
-		pagerFrameFree(p, *entry & ADDRESS_MASK);
-		free(curr);
-		return 1;
+	if (sp != NULL) {
+		return &sp->entry;
 	} else {
-		return 0;
+		return pagetableLookup(process_get_pagetable(p), addr);
 	}
 }
 
-static int isPageAligned(void *ptr) {
-	return (((L4_Word_t) ptr) & (PAGESIZE - 1)) == 0;
+static pid_t pageOwner(Process *p, L4_Word_t addr) {
+	// Who the frame or swap slot for a page is recorded against
+	return (sharedGet(p, addr) != NULL) ? SHARED_PID : process_get_pid(p);
 }
 
-static int mapPage(L4_SpaceId_t sid, L4_Word_t virt, L4_Word_t phys,
-		int rights) {
-	assert((virt & ~PAGEALIGN) == 0);
-	assert((phys & ~PAGEALIGN) == 0);
+static void pagerFrameFree(Process *p, L4_Word_t frame) {
+	assert((frame & ~PAGEALIGN) == 0);
+	frame_free(frame);
+	allocLimit++;
+
+	if (p != NULL) process_get_info(p)->size--;
+}
 
-	L4_Fpage_t fpage = L4_Fpage(virt, PAGESIZE);
+static int mapFpage(L4_SpaceId_t sid, L4_Word_t virt, L4_Word_t phys,
+		L4_Word_t size, int rights) {
+	assert((virt & (size - 1)) == 0);
+	assert((phys & (size - 1)) == 0);
+
+	L4_Fpage_t fpage = L4_Fpage(virt, size);
 	L4_Set_Rights(&fpage, rights);
 	L4_PhysDesc_t ppage = L4_PhysDesc(phys, DEFAULT_MEMORY);
 
@@ -229,29 +385,43 @@ static int mapPage(L4_SpaceId_t sid, L4_Word_t virt, L4_Word_t phys,
 	return result;
 }
 
-static int unmapPage(L4_SpaceId_t sid, L4_Word_t virt) {
-	assert((virt & ~PAGEALIGN) == 0);
+static int unmapFpage(L4_SpaceId_t sid, L4_Word_t virt, L4_Word_t size) {
+	assert((virt & (size - 1)) == 0);
 
-	L4_Fpage_t fpage = L4_Fpage(virt, PAGESIZE);
+	L4_Fpage_t fpage = L4_Fpage(virt, size);
 	int result = L4_UnmapFpage(sid, fpage);
 
 	if (!result) {
-		dprintf(0, "!!! unmapPage failed: ");
+		dprintf(0, "!!! unmapFpage failed: ");
 		sos_print_error(L4_ErrorCode());
 	}
 
 	return result;
 }
 
+static int mapPage(L4_SpaceId_t sid, L4_Word_t virt, L4_Word_t phys,
+		int rights) {
+	return mapFpage(sid, virt, phys, PAGESIZE, rights);
+}
+
+static int unmapPage(L4_SpaceId_t sid, L4_Word_t virt) {
+	return unmapFpage(sid, virt, PAGESIZE);
+}
+
 static void prepareDataIn(Process *p, L4_Word_t vaddr) {
 	// Prepare for some data from a user program to be fiddled with by
 	// the pager.  This involves flushing the user programs cache on this
 	// address, and invalidating our own cache.
 	assert((vaddr & ~PAGEALIGN) == 0);
 
-	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), vaddr);
+	L4_Word_t *entry = pageEntry(p, vaddr);
 	L4_Word_t frame = *entry & ADDRESS_MASK;
 
+	if (*entry & ZERO_MASK) {
+		// Nothing can have been written to it
+		return;
+	}
+
 	dprintf(3, "*** prepareDataIn: p=%d vaddr=%p frame=%p\n",
 			process_get_pid(p), (void*) vaddr, (void*) frame);
 
@@ -265,7 +435,7 @@ static void prepareDataOut(Process *p, L4_Word_t vaddr) {
 	// invalidating the user's cache on the address.
 	assert((vaddr & ~PAGEALIGN) == 0);
 
-	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), vaddr);
+	L4_Word_t *entry = pageEntry(p, vaddr);
 	L4_Word_t frame = *entry & ADDRESS_MASK;
 
 	dprintf(3, "*** prepareDataOut: p=%d vaddr=%p frame=%p\n",
@@ -276,229 +446,265 @@ static void prepareDataOut(Process *p, L4_Word_t vaddr) {
 				process_get_sid(p), vaddr, vaddr + PAGESIZE));
 }
 
-static Pair *deleteAllocList(void) {
-	dprintf(1, "*** deleteAllocList\n");
-
-	assert(!list_null(alloced));
-
-	Process *p;
-	Pair *found = NULL; // (pid, word)
-	L4_Word_t *entry;
-
-	// Second-chance algorithm
-	for (;;) {
-		found = (Pair*) list_unshift(alloced);
+static void largeBreak(Process *p, L4_Word_t base) {
+	// Unmap a large page, so its pages are mapped one at a time as they
+	// are faulted on (until the whole lot can be mapped together again)
+	L4_Word_t *entry, frame;
 
-		p = process_lookup(found->fst);
-		assert(p != NULL);
-		entry = pagetableLookup(process_get_pagetable(p), found->snd);
+	dprintf(2, "*** largeBreak: p=%d base=%p\n", process_get_pid(p), (void*) base);
+	unmapFpage(process_get_sid(p), base, LARGE_PAGESIZE);
+	stats.large_breaks++;
 
-		dprintf(3, "*** deleteAllocList: p=%d page=%p frame=%p\n",
-				process_get_pid(p), (void*) found->snd, 
-				(void*) (*entry & ADDRESS_MASK));
+	for (L4_Word_t vaddr = base; vaddr < base + LARGE_PAGESIZE;
+			vaddr += PAGESIZE) {
+		entry = pagetableLookup(process_get_pagetable(p), vaddr);
+		frame = *entry & ADDRESS_MASK;
 
-		if ((*entry & REF_MASK) == 0) {
-			// Not been referenced, this is the frame to swap
-			break;
-		} else {
-			// Been referenced: clear refbit, unmap to give it a chance
-			// of being reset again, and move to back
-			*entry &= ~REF_MASK;
-			unmapPage(process_get_sid(p), found->snd);
-			list_push(alloced, found);
+		// (cached frames can be part of another process's large page too,
+		// so they keep the flag and are only ever unmapped too much)
+		if (!(*entry & (SWAP_MASK | SHARED_MASK)) && (frame != 0) &&
+				(frame_get_pid(frame) != CACHE_PID)) {
+			frame_clear_flags(frame, FRAME_LARGE);
 		}
 	}
-
-	return found;
 }
 
-static L4_Word_t pagerFrameAlloc(Process *p, L4_Word_t page) {
-	L4_Word_t frame;
-
-	assert(allocLimit >= 0);
+static void pageUnmap(Process *p, L4_Word_t vaddr) {
+	// Unmap one of the process's own pages, which if it was mapped as part
+	// of a large page means the whole large page
+	L4_Word_t entry = *pagetableLookup(process_get_pagetable(p), vaddr);
+	L4_Word_t frame = entry & ADDRESS_MASK;
 
-	if (allocLimit == 0) {
-		dprintf(1, "*** pagerFrameAlloc: allocLimit reached\n");
-		frame = 0;
+	if (!(entry & (SWAP_MASK | SHARED_MASK)) && (frame != 0) &&
+			(frame_get_flags(frame) & FRAME_LARGE)) {
+		largeBreak(p, vaddr & LARGE_PAGEALIGN);
 	} else {
-		frame = frame_alloc(FA_PAGERALLOC);
-		dprintf(1, "*** pagerFrameAlloc: allocated frame %p\n", frame);
-		list_push(alloced, pair_alloc(process_get_pid(p), page));
-
-		process_get_info(p)->size++;
-		allocLimit--;
+		unmapPage(process_get_sid(p), vaddr);
 	}
-
-	return frame;
 }
 
-static rtype_t requestsPeekType(void) {
-	return (rtype_t) ((Pair*) list_peek(requests))->fst;
+static void sharerUnmap(void *contents, void *data) {
+	Process *p = process_lookup(((Pair*) contents)->fst); // (pid, writable)
+	L4_Word_t vaddr = (L4_Word_t) data;
+
+	if (p != NULL) {
+		unmapPage(process_get_sid(p), vaddr);
+		please(CACHE_FLUSH_RANGE(process_get_sid(p), vaddr, vaddr + PAGESIZE));
+	}
 }
 
-static void *requestsPeek(void) {
-	return (void*) ((Pair*) list_peek(requests))->snd;
+static void sharedUnmap(SharedPage *sp) {
+	// Unmap the page from everybody sharing it, so they all fault on it
+	// next time
+	list_iterate(sp->sharers, sharerUnmap, (void*) sp->vaddr);
 }
 
-static void *requestsUnshift(void) {
-	Pair *pair = (Pair*) list_unshift(requests);
-	void *data = (void*) pair->snd;
-	pair_free(pair);
-	return data;
+static int findSharer(void *contents, void *data) {
+	return ((Pair*) contents)->fst == (L4_Word_t) data; // (pid, writable)
 }
 
-void pager_init(void) {
-	// Set up lists
-	totalPages = FRAME_ALLOC_LIMIT;
-	//totalPages = frames_free();
-	allocLimit = totalPages;
-	alloced = list_empty();
-	swapped = list_empty();
-	requests = list_empty();
+static int findReadonlySharer(void *contents, void *data) {
+	Pair *curr = (Pair*) contents; // (pid, writable)
+	return (curr->fst != (L4_Word_t) data) && !curr->snd;
+}
 
-	// The default swapfile (.swap)
-	defaultSwapfile = swapfile_init(SWAPFILE_FN);
+static int sharedCanWrite(SharedPage *sp, pid_t pid) {
+	// Only if every other process sharing it lets others write
+	return list_find(sp->sharers, findReadonlySharer, (void*) (L4_Word_t) pid)
+		== NULL;
+}
 
-	// Start the real pager process
-	Process *p = process_run_rootthread("pager", virtualPagerHandler,
-		YES_TIMESTAMP, 254);
-	process_set_ipcfilt(p, PS_IPC_BLOCKING);
+static void *countSharer(void *contents, void *data) {
+	return (void*) (((L4_Word_t) data) + 1);
+}
 
-	// Wait until it has actually started
-	while (!pager_is_active()) L4_Yield();
+static int sharedCount(SharedPage *sp) {
+	return (int) (L4_Word_t) list_reduce(sp->sharers, countSharer, (void*) 0);
 }
 
-static int findHeap(void *contents, void *data) {
-	return (region_get_type((Region*) contents) == REGION_HEAP);
+static int findCachedFile(void *contents, void *data) {
+	CachedFile *cf = (CachedFile*) contents;
+	return !cf->stale && (strncmp(cf->path, (char*) data, MAX_FILE_NAME) == 0);
 }
 
-static int heapGrow(uintptr_t *base, unsigned int nb) {
-	dprintf(2, "*** heapGrow(%p, %lx)\n", base, nb);
+static int findCachedFileId(void *contents, void *data) {
+	return ((CachedFile*) contents)->id == (L4_Word_t) data;
+}
 
-	// Find the current heap section.
-	Process *p = process_lookup(L4_SpaceNo(L4_SenderSpace()));
-	Region *heap = list_find(process_get_regions(p), findHeap, NULL);
-	assert(heap != NULL);
+static CachedFile *cachedFileLookup(L4_Word_t id) {
+	CachedFile *cf = list_find(cachedFiles, findCachedFileId, (void*) id);
+	assert(cf != NULL);
+	return cf;
+}
 
-	// Top of heap is the (new) start of the free region, this is
-	// what morecore/malloc expect.
-	*base = region_get_base(heap) + region_get_size(heap);
+static void cachedFileDrop(CachedFile *cf) {
+	// Forget the file once nothing maps it and none of it is cached
+	if ((cf->refs == 0) && (cf->pages == 0)) {
+		dprintf(2, "*** cachedFileDrop: %s (%p)\n", cf->path, (void*) cf->id);
+		list_delete_first(cachedFiles, findCachedFileId, (void*) cf->id);
+		free(cf);
+	}
+}
 
-	// Move the heap region so SOS knows about it.
-	region_set_size(heap, nb + region_get_size(heap));
+static List *cacheBucket(L4_Word_t file, L4_Word_t offset) {
+	return cached[((file + offset) / PAGESIZE) % CACHE_BUCKETS];
+}
 
-	// Have the option of returning 0 to signify no more memory.
-	return 1;
+static int findCached(void *contents, void *data) {
+	CachedPage *cp = (CachedPage*) contents;
+	Pair *args = (Pair*) data; // (file, offset)
+	return (cp->file == args->fst) && (cp->offset == args->snd);
 }
 
-static int memoryUsage(void) {
-	return totalPages - allocLimit;
+static CachedPage *cacheLookup(L4_Word_t file, L4_Word_t offset) {
+	Pair args = PAIR(file, offset);
+	return list_find(cacheBucket(file, offset), findCached, &args);
 }
 
-static int findRegion(void *contents, void *data) {
-	Region *r = (Region*) contents;
-	L4_Word_t addr = (L4_Word_t) data;
+static CachedPage *cacheInsert(L4_Word_t file, L4_Word_t offset,
+		L4_Word_t frame) {
+	CachedPage *cp = (CachedPage*) malloc(sizeof(CachedPage));
 
-	return ((addr >= region_get_base(r)) &&
-			(addr < region_get_base(r) + region_get_size(r)));
-}
+	cp->file = file;
+	cp->offset = offset;
+	cp->frame = frame;
+	cp->mappers = list_empty();
 
-static int findPaRegion(void *contents, void *data) {
-	// Like findRegion, but only at pagealigned granularity
-	Region *r = (Region*) contents;
-	L4_Word_t addr = (L4_Word_t) data;
+	frame_set_owner(frame, CACHE_PID, file);
+	frame_set_backing(frame, offset);
+	frame_set_refs(frame, 0);
 
-	return ((addr >= (region_get_base(r) & PAGEALIGN)) &&
-			(region_get_size(r), PAGESIZE));
-}
+	cachedFileLookup(file)->pages++;
+	stats.cache_pages++;
+	stats.cache_idle++;
 
-static void panic(void) {
-	assert(! "DON'T PANIC");
+	list_push(cacheBucket(file, offset), cp);
+	return cp;
 }
 
-static PagerRequest *allocPagerRequest(pid_t pid, L4_Word_t addr, int rights,
-		Swapfile *sf, void (*callback)(PagerRequest *pr)) {
-	PagerRequest *newPr = (PagerRequest*) malloc(sizeof(PagerRequest));
+static void cacheAttach(CachedPage *cp, Process *p, L4_Word_t vaddr) {
+	// The process's page table entry refers to the cached frame from now on
+	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), vaddr);
 
-	newPr->pid = pid;
-	newPr->addr = addr;
-	newPr->rights = rights;
-	newPr->offset = PR_OFFSET_UNDEFINED;
-	newPr->sf = sf;
-	newPr->swapinFinish = panic;
-	newPr->callback = callback;
+	if (list_null(cp->mappers)) {
+		stats.cache_idle--;
+	}
 
-	return newPr;
+	list_push(cp->mappers, pair_alloc(process_get_pid(p), vaddr));
+	frame_set_refs(cp->frame, frame_get_refs(cp->frame) + 1);
+	*entry = FILE_MASK | cp->frame;
 }
 
-static char* setFdStrn(pid_t parent, fildes_t fd) {
-	if (fd == VFS_NIL_FILE || fd < 0 || fd >= PROCESS_MAX_FDS) {
-		return NULL;
-	}
+static int pairFree(void *contents, void *data) {
+	pair_free((Pair*) contents);
+	return 1;
+}
 
-	Process *p = process_lookup(parent);
-	if (p == NULL) {
-		return NULL;
-	}
+static void cacheRelease(CachedPage *cp) {
+	// Give up the frame of a page on its way out of the cache, along with
+	// the file if that was the last of it
+	CachedFile *cf = cachedFileLookup(cp->file);
 
-	VFile *vf = get_vfile(parent, fd, 0);
-	if (vf == NULL || vf->vnode == NULL) {
-		return NULL;
+	dprintf(2, "*** cacheRelease: %p in file %p\n",
+			(void*) cp->offset, (void*) cp->file);
+
+	if (list_null(cp->mappers)) {
+		stats.cache_idle--;
 	}
 
-	char *new = (char *) malloc(sizeof(char) * MAX_FILE_NAME);
-	strncpy(new, vf->vnode->path, MAX_FILE_NAME);
+	list_delete(cp->mappers, pairFree, NULL);
+	list_destroy(cp->mappers);
+	pagerFrameFree(NULL, cp->frame);
+	stats.cache_pages--;
 
-	dprintf(2, "setFdStrn: %s\n", new);
-	return new;
+	cf->pages--;
+	cachedFileDrop(cf);
 }
 
-static ElfloadRequest *allocElfloadRequest(char *path, pid_t caller,
-		fildes_t fdout, fildes_t fderr, fildes_t fdin) {
-	ElfloadRequest *er = (ElfloadRequest *) malloc(sizeof(ElfloadRequest));
+static void cacheFree(CachedPage *cp) {
+	Pair args = PAIR(cp->file, cp->offset);
 
-	if (er != NULL) {
-		er->stage = 0;
-		strncpy(er->path, path, MAX_FILE_NAME);
-		er->fd = VFS_NIL_FILE;
-		er->parent = caller;
+	cacheRelease(cp);
+	list_delete_first(cacheBucket(args.fst, args.snd), findCached, &args);
+	free(cp);
+}
 
-		dprintf(2, "allocElfloadRequest: %d, %d, %d\n", fdout, fderr, fdin);
-		er->fdout = setFdStrn(caller, fdout);
-		er->fderr = setFdStrn(caller, fderr);
-		er->fdin = setFdStrn(caller, fdin);
-	}
+static int idleFree(void *contents, void *data) {
+	// Free the page if it is of the given file and nobody maps it
+	CachedPage *cp = (CachedPage*) contents;
 
-	return er;
+	if ((cp->file == (L4_Word_t) data) && list_null(cp->mappers)) {
+		cacheRelease(cp);
+		free(cp);
+		return 1;
+	} else {
+		return 0;
+	}
 }
 
-static void pagerContinue(PagerRequest *pr) {
-	dprintf(3, "*** pagerContinue: replying to %d\n", pr->pid);
+static void cachedFileStale(CachedFile *cf) {
+	// The file has changed, so what is cached of it is only good for the
+	// processes that already map it (which keep it until they unmap it)
+	L4_Word_t id = cf->id;
 
-	L4_ThreadId_t replyTo = process_get_tid(process_lookup(pr->pid));
-	free(pr);
-	syscall_reply_v(replyTo, 0);
+	dprintf(1, "*** cachedFileStale: %s (%p) has changed\n",
+			cf->path, (void*) id);
+
+	cf->stale = 1;
+	cf->keep = 0;
+	stats.cache_stale++;
+
+	// (which can free cf)
+	for (int i = 0; i < CACHE_BUCKETS; i++) {
+		list_delete(cached[i], idleFree, (void*) id);
+	}
 }
 
-static L4_Word_t pagerSwapslotAlloc(Process *p) {
-	L4_Word_t diskAddr = swapslot_alloc(defaultSwapfile);
+static L4_Word_t cachedFileRef(char *path, stat_t *stat) {
+	// Returns the id of the file to cache its pages under.  Pages are only
+	// kept after the last mapper goes if the file's attributes are known,
+	// which is how it is told whether they are still up to date next time
+	CachedFile *cf = list_find(cachedFiles, findCachedFile, path);
+
+	if ((cf != NULL) && (stat != NULL) && (!cf->keep ||
+				(cf->stat.st_size != stat->st_size) ||
+				(cf->stat.st2_ctime != stat->st2_ctime))) {
+		cachedFileStale(cf);
+		cf = NULL;
+	}
 
-	if (diskAddr == ADDRESS_NONE) {
-		dprintf(0, "!!! pagerSwapslotAlloc: none available\n");
-		return ADDRESS_NONE;
-	} else {
-		list_push(swapped, pair_alloc(process_get_pid(p), diskAddr));
-		return diskAddr;
+	if (cf == NULL) {
+		cf = (CachedFile*) malloc(sizeof(CachedFile));
+		strncpy(cf->path, path, MAX_FILE_NAME);
+		lastCachedFile += PAGESIZE;
+		cf->id = lastCachedFile;
+		cf->refs = 0;
+		cf->pages = 0;
+		cf->keep = (stat != NULL);
+		cf->stale = 0;
+
+		if (stat != NULL) {
+			cf->stat = *stat;
+		}
+
+		list_push(cachedFiles, cf);
 	}
+
+	cf->refs++;
+	return cf->id;
+}
+
+static void cachedFileUnref(L4_Word_t id) {
+	CachedFile *cf = cachedFileLookup(id);
+	cf->refs--;
+	cachedFileDrop(cf);
 }
 
-static int pagerSwapslotFree(void *contents, void *data) {
-	Pair *curr = (Pair*) contents; // (pid, word)
-	Pair *args = (Pair*) data;     // (pid, word)
+static int mapperFree(void *contents, void *data) {
+	Pair *curr = (Pair*) contents; // (pid, vaddr)
+	Pair *args = (Pair*) data;     // (pid, vaddr)
 
-	if ((curr->fst == args->fst) &&
-			((curr->snd == args->snd) || (curr->snd == ADDRESS_ALL))) {
-		swapslot_free(defaultSwapfile, curr->snd);
+	if ((curr->fst == args->fst) && (curr->snd == args->snd)) {
 		pair_free(curr);
 		return 1;
 	} else {
@@ -506,541 +712,2725 @@ static int pagerSwapslotFree(void *contents, void *data) {
 	}
 }
 
-static void regionsFree(void *contents, void *data) {
-	region_free((Region*) contents);
+static void cacheDetach(L4_Word_t frame, pid_t pid, L4_Word_t vaddr) {
+	// A process no longer maps the page.  The last one to go frees it,
+	// unless the file's pages are being kept for next time
+	CachedPage *cp = cacheLookup(frame_get_vaddr(frame), frame_get_backing(frame));
+	Pair args = PAIR(pid, vaddr);
+	assert(cp != NULL);
+
+	list_delete_first(cp->mappers, mapperFree, &args);
+
+	if (!list_null(cp->mappers)) {
+		frame_set_refs(frame, frame_get_refs(frame) - 1);
+	} else if (cachedFileLookup(cp->file)->keep) {
+		frame_set_refs(frame, 0);
+		stats.cache_idle++;
+	} else {
+		cacheFree(cp);
+	}
 }
 
-static int processDelete(L4_Word_t pid) {
-	Process *p;
-	Pair args; // (pid, word)
+static void mapperUnmap(void *contents, void *data) {
+	Pair *curr = (Pair*) contents; // (pid, vaddr)
+	CachedPage *cp = (CachedPage*) data;
+	Process *p = process_lookup(curr->fst);
 
-	p = process_lookup(pid);
+	if (p == NULL) return;
 
-	if (p == NULL) {
-		// Already killed?
-		return 1;
-	}
-	
-	if (process_kill(p) != 0) {
-		// Invalid process
-		return (-1);
-	}
-	
-	// change the state
-	process_set_state(p, PS_STATE_ZOMBIE);
+	pageUnmap(p, curr->snd);
 
-	// flush and close open files
-	process_close_files(p);
-	process_remove(p);
+	if (cp != NULL) {
+		// Evicted, so the next fault reads it from the file again
+		*pagetableLookup(process_get_pagetable(p), curr->snd) =
+			SWAP_MASK | FILE_MASK | cp->offset;
+	}
+}
 
-	// Free all resources
-	args = PAIR(process_get_pid(p), ADDRESS_ALL);
-	list_delete(alloced, framesFree, p);
-	list_delete(swapped, pagerSwapslotFree, &args);
-	pagetableFree(p);
-	list_iterate(process_get_regions(p), regionsFree, NULL);
-	list_destroy(process_get_regions(p));
+static void mapperMove(void *contents, void *data) {
+	// Point a mapper of a cached page at the frame it has been moved to
+	Pair *curr = (Pair*) contents; // (pid, vaddr)
+	Process *p = process_lookup(curr->fst);
+	L4_Word_t *entry;
 
-	// Wake all waiting processes
-	process_wake_all(process_get_pid(p));
+	if (p == NULL) return;
 
-	// And done
-	free(p);
+	entry = pagetableLookup(process_get_pagetable(p), curr->snd);
+	pageUnmap(p, curr->snd);
+	*entry = (*entry & ~ADDRESS_MASK) | (L4_Word_t) data;
+}
 
-	return 0;
+static int belowLimit(Process *p) {
+	// Whether p can have another frame without giving up one of its own
+	process_t *info = process_get_info(p);
+	return info->size < info->rss_limit;
 }
 
-static void printRequests(void *contents, void *data) {
-	Pair *pair = (Pair*) contents;
-	rtype_t type = (rtype_t) pair->fst;
-	PagerRequest *pr;
-	ElfloadRequest *er;
+static void workingSetUpdate(void) {
+	// The clock hand has been all the way around, so the pages each
+	// process referenced on the way are its working set
+	process_t *info;
+
+	for (int i = 0; i < MAX_THREADS; i++) {
+		if ((info = process_get_info(process_lookup(i))) != NULL) {
+			info->wss = (info->wss + wsRefs[i] + 1) / 2;
+		}
+
+		wsRefs[i] = 0;
+	}
+}
+
+static int inWorkingSet(L4_Word_t frame) {
+	// Whether the frame's process has no more pages than it needs
+	pid_t pid = frame_get_pid(frame);
+	process_t *info;
+
+	if ((pid == SHARED_PID) || (pid == CACHE_PID)) {
+		return 0;
+	}
+
+	info = process_get_info(process_lookup(pid));
+	return (info != NULL) && (info->size <= info->wss);
+}
+
+static L4_Word_t chooseVictim(pid_t pid) {
+	// Only one of pid's own frames, unless it is NIL_PID
+	dprintf(1, "*** chooseVictim: pid=%d\n", pid);
+
+	Process *p;
+	L4_Word_t frame;
+	int passed = 0;
+
+	// Second-chance (clock) algorithm over the frame table, which the first
+	// time around also passes over the pages of processes that are within
+	// their working set
+	for (;;) {
+		frame = frame_nextswap(pid);
+
+		if (frame_sweeps() != wsSweep) {
+			wsSweep = frame_sweeps();
+			workingSetUpdate();
+		}
+
+		if ((frame == 0) && (pid != NIL_PID)) {
+			// Nothing of its own that can go, so anything
+			pid = NIL_PID;
+			continue;
+		}
+
+		assert(frame != 0);
+
+		dprintf(3, "*** chooseVictim: p=%d page=%p frame=%p\n",
+				frame_get_pid(frame), (void*) frame_get_vaddr(frame),
+				(void*) frame);
+
+		if ((frame_get_flags(frame) & FRAME_REF) == 0) {
+			if ((pid == NIL_PID) && (passed < frames_total()) &&
+					inWorkingSet(frame)) {
+				passed++;
+				continue;
+			}
+
+			// Not been referenced, this is the frame to swap
+			break;
+		} else {
+			// Been referenced: clear refbit and unmap to give it a chance
+			// of being reset again
+			frame_clear_flags(frame, FRAME_REF);
+
+			if (frame_get_pid(frame) == SHARED_PID) {
+				sharedUnmap(sharedLookup(frame_get_vaddr(frame)));
+			} else if (frame_get_pid(frame) == CACHE_PID) {
+				list_iterate(cacheLookup(frame_get_vaddr(frame),
+							frame_get_backing(frame))->mappers, mapperUnmap, NULL);
+			} else {
+				p = process_lookup(frame_get_pid(frame));
+				assert(p != NULL);
+				pageUnmap(p, frame_get_vaddr(frame));
+				wsRefs[frame_get_pid(frame)]++;
+			}
+		}
+	}
+
+	return frame;
+}
+
+static L4_Word_t pagerFrameAlloc(Process *p, L4_Word_t page, L4_Word_t backing) {
+	// A NULL process means the frame is for a shared or cached page
+	L4_Word_t frame;
+
+	assert(allocLimit >= 0);
+
+	if (allocLimit == 0) {
+		dprintf(1, "*** pagerFrameAlloc: allocLimit reached\n");
+		frame = 0;
+	} else {
+		frame = frame_alloc(FA_PAGERALLOC);
+		dprintf(1, "*** pagerFrameAlloc: allocated frame %p\n", frame);
+
+		frame_set_owner(frame, (p == NULL) ? SHARED_PID : process_get_pid(p),
+				page);
+		frame_set_backing(frame, backing);
+		frame_set_refs(frame, 1);
+
+		if (p != NULL) process_get_info(p)->size++;
+		allocLimit--;
+	}
+
+	return frame;
+}
+
+void pager_init(void) {
+	// Set up lists
+	totalPages = FRAME_ALLOC_LIMIT;
+	//totalPages = frames_free();
+	allocLimit = totalPages;
+	requests = list_empty();
+
+	for (int i = 0; i < SHARED_BUCKETS; i++) {
+		shared[i] = list_empty();
+	}
+
+	cachedFiles = list_empty();
+	spawns = list_empty();
+	spawnFiles = list_empty();
+	for (int i = 0; i < CACHE_BUCKETS; i++) {
+		cached[i] = list_empty();
+	}
+
+	// The zero frame, which (being read-only) never needs touching again
+	zeroFrame = frame_alloc(FA_PAGERALLOC);
+	memset((char*) zeroFrame, 0x00, PAGESIZE);
+	please(CACHE_FLUSH_RANGE(L4_rootspace, zeroFrame, zeroFrame + PAGESIZE));
+
+	// The default swapfile (.swap), and the compressed store in front of it
+	// which takes its frames from the user's share
+	defaultSwapfile = swapfile_init(SWAPFILE_FN);
+	zswap_init(PAGER_ZSWAP_FRAMES);
+	totalPages -= PAGER_ZSWAP_FRAMES;
+	allocLimit -= PAGER_ZSWAP_FRAMES;
+
+	// Start the real pager process
+	Process *p = process_run_rootthread("pager", virtualPagerHandler,
+		YES_TIMESTAMP, 254);
+	process_set_ipcfilt(p, PS_IPC_BLOCKING);
+
+	// Wait until it has actually started
+	while (!pager_is_active()) L4_Yield();
+
+	// Then the cleaner, which needs the pager running to talk to
+	process_run_rootthread("pager_clean", pagerCleaner,
+			YES_TIMESTAMP, PAGER_CLEANER_PRIORITY);
+}
+
+static int findHeap(void *contents, void *data) {
+	return (region_get_type((Region*) contents) == REGION_HEAP);
+}
+
+static int heapGrow(uintptr_t *base, unsigned int nb) {
+	dprintf(2, "*** heapGrow(%p, %lx)\n", base, nb);
+
+	// Find the current heap section.
+	Process *p = process_lookup(L4_SpaceNo(L4_SenderSpace()));
+	Region *heap = list_find(process_get_regions(p), findHeap, NULL);
+	assert(heap != NULL);
+
+	// Top of heap is the (new) start of the free region, this is
+	// what morecore/malloc expect.
+	*base = region_get_base(heap) + region_get_size(heap);
+
+	// Anything big enough starts on a large page, so it can be mapped as
+	// them (malloc doesn't mind the gap)
+	if (nb >= LARGE_PAGESIZE) {
+		*base = round_up(*base, LARGE_PAGESIZE);
+	}
+
+	// Move the heap region so SOS knows about it.
+	region_set_size(heap, *base + nb - region_get_base(heap));
+
+	// Have the option of returning 0 to signify no more memory.
+	return 1;
+}
+
+static int memoryUsage(void) {
+	return totalPages - allocLimit;
+}
+
+static int pagerStatus(pager_stat_t *dest) {
+	*dest = stats;
+	dest->frames_free = allocLimit;
+	dest->frames_total = totalPages;
+	dest->high_watermark = FRAME_SWAP_THRESHHOLD;
+	dest->low_watermark = FRAME_DOOMSDAY_THRESHHOLD;
+	return 0;
+}
+
+static int memLimit(pid_t pid, unsigned pages) {
+	Process *p;
+	int old;
+
+	if ((pid < 0) || (pid >= MAX_ADDRSPACES)) {
+		return (-1);
+	}
+
+	p = process_lookup(pid);
+
+	if (p == NULL) {
+		return (-1);
+	}
+
+	// Lowering it below what is resident takes effect as the process
+	// faults, on its own pages
+	old = process_get_info(p)->rss_limit;
+	if (pages > 0) process_get_info(p)->rss_limit = pages;
+
+	return old;
+}
+
+static int vmStatus(vm_stat_t *dest) {
+	*dest = vmStats;
+	return 0;
+}
+
+static int swapStatus(swap_stat_t *dest) {
+	zswap_status(dest);
+	dest->hits = swapStats.hits;
+	dest->misses = swapStats.misses;
+	dest->hit_us = swapStats.hit_us;
+	dest->miss_us = swapStats.miss_us;
+	return 0;
+}
+
+static int findRegion(void *contents, void *data) {
+	Region *r = (Region*) contents;
+	L4_Word_t addr = (L4_Word_t) data;
+
+	return ((addr >= region_get_base(r)) &&
+			(addr < region_get_base(r) + region_get_size(r)));
+}
+
+static int findPaRegion(void *contents, void *data) {
+	// Like findRegion, but only at pagealigned granularity
+	Region *r = (Region*) contents;
+	L4_Word_t addr = (L4_Word_t) data;
+
+	return ((addr >= (region_get_base(r) & PAGEALIGN)) &&
+			(region_get_size(r), PAGESIZE));
+}
+
+static int findOverlap(void *contents, void *data) {
+	Region *r = (Region*) contents;
+	Pair *range = (Pair*) data; // (base, size)
+
+	return (region_get_base(r) < range->fst + range->snd) &&
+		(range->fst < region_get_base(r) + region_get_size(r));
+}
+
+static int writesBack(Region *r) {
+	// Pages written to in a writable mapping go back to the file
+	return (region_get_type(r) == REGION_MMAP) &&
+		(region_get_rights(r) & REGION_WRITE);
+}
+
+static int isCached(Region *r) {
+	// Pages of read-only mappings and text are shared through the page cache
+	return region_get_cache(r) != 0;
+}
+
+static int fileBytes(Region *r, L4_Word_t vaddr) {
+	// How much of a page of the region is actually in the file
+	L4_Word_t fileTop = region_get_base(r) + region_get_filesize(r);
+	return (vaddr >= fileTop) ? 0 : min(PAGESIZE, fileTop - vaddr);
+}
+
+static PagerRequest *allocPagerRequest(pid_t pid, L4_Word_t addr, int rights,
+		void (*callback)(PagerRequest *pr)) {
+	PagerRequest *newPr = (PagerRequest*) malloc(sizeof(PagerRequest));
+
+	newPr->pid = pid;
+	newPr->addr = addr;
+	newPr->rights = rights;
+	newPr->pinned = 0;
+	newPr->backing = ADDRESS_NONE;
+	newPr->swapped = 0;
+	newPr->faulted = time_stamp();
+	newPr->fclass = FAULT_RESIDENT;
+	newPr->worker = NULL;
+	newPr->file = NULL;
+	newPr->writeback = NULL;
+	newPr->callback = callback;
+
+	return newPr;
+}
+
+static char* setFdStrn(pid_t parent, fildes_t fd) {
+	if (fd == VFS_NIL_FILE || fd < 0 || fd >= PROCESS_MAX_FDS) {
+		return NULL;
+	}
+
+	Process *p = process_lookup(parent);
+	if (p == NULL) {
+		return NULL;
+	}
+
+	VFile *vf = get_vfile(parent, fd, 0);
+	if (vf == NULL || vf->vnode == NULL) {
+		return NULL;
+	}
+
+	char *new = (char *) malloc(sizeof(char) * MAX_FILE_NAME);
+	strncpy(new, vf->vnode->path, MAX_FILE_NAME);
+
+	dprintf(2, "setFdStrn: %s\n", new);
+	return new;
+}
+
+static ElfloadRequest *allocElfloadRequest(char *path, pid_t caller,
+		fildes_t fdout, fildes_t fderr, fildes_t fdin) {
+	ElfloadRequest *er = (ElfloadRequest *) malloc(sizeof(ElfloadRequest));
+
+	if (er != NULL) {
+		er->stage = ELFLOAD_CHECK_EXEC;
+		strncpy(er->path, path, MAX_FILE_NAME);
+		er->fd = VFS_NIL_FILE;
+		er->parent = caller;
+		er->rval = -1;
+		er->file = NULL;
+
+		dprintf(2, "allocElfloadRequest: %d, %d, %d\n", fdout, fderr, fdin);
+		er->fdout = setFdStrn(caller, fdout);
+		er->fderr = setFdStrn(caller, fderr);
+		er->fdin = setFdStrn(caller, fdin);
+	}
+
+	return er;
+}
+
+static void faultClass(PagerRequest *pr, fault_class_t fclass) {
+	if (fclass > pr->fclass) {
+		pr->fclass = fclass;
+	}
+}
+
+static void faultRecord(fault_class_t fclass, uint64_t faulted) {
+	fault_stat_t *fs = &vmStats.faults[fclass];
+	unsigned us = (unsigned) (time_stamp() - faulted);
+	int bucket = 0;
+
+	while (((us >> bucket) != 0) && (bucket < FAULT_BUCKETS - 1)) {
+		bucket++;
+	}
+
+	fs->count++;
+	fs->max_us = max(fs->max_us, us);
+	fs->total_us += us;
+	fs->hist[bucket]++;
+}
+
+static void pagerContinue(PagerRequest *pr) {
+	dprintf(3, "*** pagerContinue: replying to %d\n", pr->pid);
+	faultRecord(pr->fclass, pr->faulted);
+
+	L4_ThreadId_t replyTo = process_get_tid(process_lookup(pr->pid));
+	free(pr);
+	syscall_reply_v(replyTo, 0);
+}
+
+static void swapslotFree(L4_Word_t slot) {
+	// A slot still being written to from the compressed store is freed
+	// once that has finished, in zswapWritten
+	if (zswap_drop(slot)) {
+		swapslot_free(defaultSwapfile, slot);
+	}
+}
+
+static void swapCount(pid_t pid, int n) {
+	// Keep track of how many slots each process has written to
+	if ((pid >= 0) && (process_lookup(pid) != NULL)) {
+		process_get_info(process_lookup(pid))->swap += n;
+	}
+}
+
+static void swapslotRelease(pid_t owner, L4_Word_t slot) {
+	// The slot a page was written to is no longer wanted
+	swapCount(owner, -1);
+	swapslotFree(slot);
+}
+
+static void backingFree(pid_t owner, L4_Word_t *entry, L4_Word_t backing) {
+	// The page is about to be written to, so any copy on disk is stale
+	if (backing != ADDRESS_NONE && !(*entry & FILE_MASK)) {
+		swapslotRelease(owner, backing);
+	}
+
+	*entry &= ~FILE_MASK;
+}
+
+static int pageInFlight(pid_t pid, L4_Word_t vaddr);
+
+static void sharedAdopt(Process *p, SharedPage *sp, L4_Word_t *entry) {
+	// The first process to share a page gives its copy to the share (a slot
+	// still being written to is only counted once it has been)
+	L4_Word_t frame = *entry & ADDRESS_MASK;
+	pid_t pid = process_get_pid(p);
+
+	if (*entry & SWAP_MASK) {
+		if (!pageInFlight(pid, sp->vaddr)) swapCount(pid, -1);
+		sp->entry = SWAP_MASK | frame;
+	} else if (frame != 0) {
+		if (frame_get_backing(frame) != ADDRESS_NONE) {
+			swapCount(pid, -1);
+		}
+
+		frame_set_owner(frame, SHARED_PID, sp->vaddr);
+		process_get_info(p)->size--;
+		sp->entry = frame;
+	} else {
+		// Untouched (or only read as zeros)
+		sp->entry = 0;
+	}
+}
+
+static void sharedDiscard(Process *p, L4_Word_t vaddr, L4_Word_t *entry) {
+	// Joining a share, so the process's own copy of the page goes (a slot
+	// still being written to is freed once it has been, in finishSwapout)
+	L4_Word_t frame = *entry & ADDRESS_MASK;
+
+	if (*entry & SWAP_MASK) {
+		if (!pageInFlight(process_get_pid(p), vaddr)) {
+			swapslotRelease(process_get_pid(p), frame);
+		}
+	} else if (frame != 0) {
+		pageUnmap(p, vaddr);
+		backingFree(process_get_pid(p), entry, frame_get_backing(frame));
+		pagerFrameFree(p, frame);
+	}
+}
+
+static void sharedJoin(Process *p, L4_Word_t vaddr, int writable) {
+	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), vaddr);
+	SharedPage *sp = sharedLookup(vaddr);
+	pid_t pid = process_get_pid(p);
+	L4_Word_t frame;
+
+	if (!(*entry & SHARED_MASK)) {
+		// The page's frame stops being the process's own either way
+		pageUnmap(p, vaddr);
+	}
+
+	if (*entry & SHARED_MASK) {
+		// Already sharing it, only changing whether others can write
+		((Pair*) list_find(sp->sharers, findSharer, (void*) (L4_Word_t) pid))->snd =
+			writable;
+	} else if (sp == NULL) {
+		dprintf(2, "*** sharedJoin: %d sharing %p\n", pid, (void*) vaddr);
+		sp = (SharedPage*) malloc(sizeof(SharedPage));
+		sp->vaddr = vaddr;
+		sp->sharers = list_empty();
+		sharedAdopt(p, sp, entry);
+
+		list_push(sp->sharers, pair_alloc(pid, writable));
+		list_push(sharedBucket(vaddr), sp);
+	} else {
+		dprintf(2, "*** sharedJoin: %d joining %p\n", pid, (void*) vaddr);
+		sharedDiscard(p, vaddr, entry);
+		list_push(sp->sharers, pair_alloc(pid, writable));
+
+		frame = sp->entry & ADDRESS_MASK;
+		if (!(sp->entry & SWAP_MASK) && (frame != 0)) {
+			frame_set_refs(frame, frame_get_refs(frame) + 1);
+		}
+	}
+
+	*entry = SHARED_MASK;
+
+	// Who may write to it could have changed, which is sorted out as each
+	// sharer faults on it again
+	sharedUnmap(sp);
+}
+
+static int shareVm(Process *p, L4_Word_t base, L4_Word_t size, int writable) {
+	Region *r;
+	L4_Word_t vaddr;
+
+	dprintf(1, "*** shareVm: pid=%d base=%p size=%lx writable=%d\n",
+			process_get_pid(p), (void*) base, size, writable);
+
+	if ((base & ~PAGEALIGN) || (size & ~PAGEALIGN) || (size == 0) ||
+			(base + size < base)) {
+		return (-1);
+	}
+
+	// Check it all first so that nothing is shared unless it all can be.
+	// Pages the pager is in the middle of moving can't be either
+	for (vaddr = base; vaddr < base + size; vaddr += PAGESIZE) {
+		r = list_find(process_get_regions(p), findRegion, (void*) vaddr);
+
+		if ((r == NULL) || !region_can_share(r) ||
+				pageInFlight(process_get_pid(p), vaddr)) {
+			return (-1);
+		}
+	}
+
+	for (vaddr = base; vaddr < base + size; vaddr += PAGESIZE) {
+		sharedJoin(p, vaddr, writable);
+	}
+
+	return 0;
+}
+
+static void sharedFree(SharedPage *sp) {
+	L4_Word_t frame = sp->entry & ADDRESS_MASK;
+
+	dprintf(2, "*** sharedFree: %p\n", (void*) sp->vaddr);
+
+	// If it is being written out the slot and frame are freed when that
+	// finishes, since the share will be gone by then
+	if (sp->entry & SWAP_MASK) {
+		if (!pageInFlight(SHARED_PID, sp->vaddr)) {
+			swapslotFree(frame);
+		}
+	} else if (frame != 0) {
+		backingFree(SHARED_PID, &sp->entry, frame_get_backing(frame));
+		pagerFrameFree(NULL, frame);
+	}
+
+	list_destroy(sp->sharers);
+	free(sp);
+}
+
+static int sharerFree(void *contents, void *data) {
+	if (findSharer(contents, data)) {
+		pair_free((Pair*) contents);
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static int sharedLeave(void *contents, void *data) {
+	SharedPage *sp = (SharedPage*) contents;
+	Pair *args = (Pair*) data; // (pid, vaddr)
+	L4_Word_t frame = sp->entry & ADDRESS_MASK;
+
+	if (sp->vaddr != args->snd) {
+		return 0;
+	}
+
+	data = (void*) args->fst;
+
+	if (list_find(sp->sharers, findSharer, data) == NULL) {
+		return 0;
+	}
+
+	list_delete(sp->sharers, sharerFree, data);
+
+	if (list_null(sp->sharers)) {
+		// Last one out
+		sharedFree(sp);
+		return 1;
+	} else if (!(sp->entry & SWAP_MASK) && (frame != 0)) {
+		frame_set_refs(frame, frame_get_refs(frame) - 1);
+	}
+
+	return 0;
+}
+
+static void writebackDone(PagerRequest *pr) {
+	// Unmapping waits for the pages to be written back, exiting doesn't
+	Process *p = (pr->pid == NIL_PID) ? NULL : process_lookup(pr->pid);
+
+	if (p != NULL) {
+		syscall_reply(process_get_tid(p), 0);
+	}
+
+	free(pr);
+}
+
+static void queueWriteback(pid_t pid, Region *r, List *writeback) {
+	PagerRequest *pr = allocPagerRequest(pid, region_get_base(r), 0,
+			writebackDone);
+
+	// The region is about to go, but the file needs to stay until written
+	pr->file = region_get_file(r);
+	swapfile_ref(pr->file);
+	pr->writeback = writeback;
+
+	queueRequest(REQUEST_WRITEBACK, pr);
+}
+
+static void regionUnmap(Process *p, Region *r, List *writeback, int alive) {
+	// Take a mapping's pages away from the process, with those that need
+	// writing back to the file added to writeback rather than being freed
+	L4_Word_t *entry, frame, vaddr;
+	PagerIOPage *page;
+
+	for (vaddr = region_get_base(r) & PAGEALIGN;
+			vaddr < region_get_base(r) + region_get_size(r);
+			vaddr += PAGESIZE) {
+		entry = pagetableLookup(process_get_pagetable(p), vaddr);
+		frame = *entry & ADDRESS_MASK;
+
+		// Pages on disk or being written out are already in the file
+		if (!(*entry & SWAP_MASK) && (frame != 0)) {
+			if (alive) {
+				unmapPage(process_get_sid(p), vaddr);
+			}
+
+			if (frame_get_pid(frame) == CACHE_PID) {
+				cacheDetach(frame, process_get_pid(p), vaddr);
+			} else if ((frame_get_flags(frame) & FRAME_DIRTY) &&
+					(fileBytes(r, vaddr) > 0)) {
+				if (alive) {
+					prepareDataIn(p, vaddr);
+				} else {
+					please(CACHE_FLUSH_RANGE_INVALIDATE(L4_rootspace,
+								frame, frame + PAGESIZE));
+				}
+
+				page = (PagerIOPage*) malloc(sizeof(PagerIOPage));
+				page->vaddr = vaddr;
+				page->frame = frame;
+				page->diskAddr = frame_get_backing(frame);
+				page->size = fileBytes(r, vaddr);
+				list_push(writeback, page);
+
+				// Nobody's but the pager's until it has been written
+				frame_set_owner(frame, NIL_PID, 0);
+				process_get_info(p)->size--;
+			} else {
+				pagerFrameFree(p, frame);
+			}
+		}
+
+		*entry = 0;
+	}
+}
+
+static int mappingClose(Process *p, Region *r, int alive) {
+	// Returns whether any pages are being written back, which for a live
+	// process means it gets a reply once they have been
+	List *writeback = list_empty();
+
+	dprintf(1, "*** mappingClose: pid=%d base=%p\n",
+			process_get_pid(p), (void*) region_get_base(r));
+
+	regionUnmap(p, r, writeback, alive);
+
+	if (isCached(r)) {
+		cachedFileUnref(region_get_cache(r));
+	}
+
+	if (list_null(writeback)) {
+		list_destroy(writeback);
+		return 0;
+	} else {
+		queueWriteback(alive ? process_get_pid(p) : NIL_PID, r, writeback);
+		return 1;
+	}
+}
+
+static void mappingsClose(void *contents, void *data) {
+	Region *r = (Region*) contents;
+
+	// (cached text is let go of like a read-only mapping)
+	if ((region_get_type(r) == REGION_MMAP) || isCached(r)) {
+		mappingClose((Process*) data, r, 0);
+	}
+}
+
+static void regionsFree(void *contents, void *data) {
+	region_free((Region*) contents);
+}
+
+static void pagetableFree(Process *p) {
+	assert(p != NULL);
+	Pagetable1 *pt1 = (Pagetable1*) process_get_pagetable(p);
+	assert(pt1 != NULL);
+	pid_t pid = process_get_pid(p);
+	L4_Word_t entry, frame, vaddr;
+	Pair args; // (pid, vaddr)
+
+	for (int i = 0; i < PAGEWORDS; i++) {
+		if (pt1->pages2[i] == NULL) continue;
+
+		// Free what the process has on the way: frames that are really
+		// its own (the frame table knows, rather than them being mapped
+		// directly, cached, or in the middle of being swapped out), slots
+		// that aren't still being written to (those are freed once they
+		// have been), and its place in shares
+		for (int j = 0; j < PAGEWORDS; j++) {
+			entry = pt1->pages2[i]->pages[j];
+			frame = entry & ADDRESS_MASK;
+			vaddr = (i * PAGEWORDS + j) * PAGESIZE;
+
+			if (entry & SHARED_MASK) {
+				args = PAIR(pid, vaddr);
+				list_delete_first(sharedBucket(vaddr), sharedLeave, &args);
+			} else if (entry & SWAP_MASK) {
+				if (!(entry & FILE_MASK) && !pageInFlight(pid, vaddr)) {
+					swapslotRelease(pid, frame);
+				}
+			} else if ((frame != 0) && (frame_get_pid(frame) == pid)) {
+				backingFree(pid, &entry, frame_get_backing(frame));
+				pagerFrameFree(p, frame);
+			}
+		}
+
+		frame_free((L4_Word_t) pt1->pages2[i]);
+	}
+
+	frame_free((L4_Word_t) pt1);
+}
+
+static int processDelete(L4_Word_t pid) {
+	Process *p;
+
+	p = process_lookup(pid);
+
+	if (p == NULL) {
+		// Already killed?
+		return 1;
+	}
+	
+	if (process_kill(p) != 0) {
+		// Invalid process
+		return (-1);
+	}
+	
+	// change the state
+	process_set_state(p, PS_STATE_ZOMBIE);
+
+	// flush and close open files
+	process_close_files(p);
+	process_remove(p);
+
+	// Free all resources, going by what the process has rather than
+	// looking through everything there is
+	lastSwapin[process_get_pid(p)] = 0;
+	readAhead[process_get_pid(p)] = 0;
+	bufferMapped[process_get_pid(p)] = 0;
+
+	list_iterate(process_get_regions(p), mappingsClose, p);
+	pagetableFree(p);
+	list_iterate(process_get_regions(p), regionsFree, NULL);
+	list_destroy(process_get_regions(p));
+
+	// Wake all waiting processes
+	process_wake_all(process_get_pid(p));
+
+	// And done
+	free(p);
+
+	return 0;
+}
+
+static void printRequests(void *contents, void *data) {
+	Pair *pair = (Pair*) contents;
+	rtype_t type = (rtype_t) pair->fst;
+	PagerRequest *pr;
 
 	printf("rtype: %d, ", type);
 
-	switch (type) {
-		case REQUEST_SWAPOUT:
-		case REQUEST_SWAPIN:
-			pr = (PagerRequest*) pair->snd;
-			printf("stage=%d pid=%d addr=%p\n",
-					pr->stage, pr->pid, (void*) pr->addr);
-			break;
+	switch (type) {
+		case REQUEST_PAGER:
+		case REQUEST_WRITEBACK:
+			pr = (PagerRequest*) pair->snd;
+			printf("stage=%d pid=%d addr=%p\n",
+					pr->stage, pr->pid, (void*) pr->addr);
+			break;
+
+		default:
+			assert(!"default");
+	}
+}
+
+static int findBuffer(void *contents, void *data) {
+	return (region_get_type((Region*) contents) == REGION_BUFFER);
+}
+
+static L4_Word_t bufferBase(Process *p) {
+	Region *r = list_find(process_get_regions(p), findBuffer, NULL);
+	return (r == NULL) ? 0 : region_get_base(r);
+}
+
+static void bufferMap(Process *p, Region *r, L4_Word_t addr) {
+	// SOS is mapped directly, so the buffer is at the same address in
+	// physical memory.  It isn't in the frame table, so the page table
+	// entry is only there for copyIn/copyOut
+	L4_Word_t page = addr & PAGEALIGN;
+	L4_Word_t frame = (L4_Word_t) pager_buffer(process_get_tid(p)) +
+		(page - region_get_base(r));
+
+	dprintf(2, "*** bufferMap: pid=%d page=%p buffer=%p\n",
+			process_get_pid(p), (void*) page, (void*) frame);
+
+	*pagetableLookup(process_get_pagetable(p), page) = frame;
+	bufferMapped[process_get_pid(p)] = region_get_base(r);
+	mapPage(process_get_sid(p), page, frame, REGION_READ | REGION_WRITE);
+}
+
+static void cacheAround(Process *p, Region *r, L4_Word_t addr) {
+	// Map the cached pages following a page found in the cache as well,
+	// since a process starting up is likely to run through them next and
+	// there is nothing to read in to get them
+	L4_Word_t *entry, vaddr = addr & PAGEALIGN;
+	CachedPage *cp;
+
+	for (int i = 1; i < PAGER_CLUSTER; i++) {
+		vaddr += PAGESIZE;
+
+		if (vaddr >= region_get_base(r) + region_get_size(r)) {
+			break;
+		}
+
+		entry = pagetableLookup(process_get_pagetable(p), vaddr);
+
+		if (!(*entry & SWAP_MASK) || !(*entry & FILE_MASK) ||
+				pageInFlight(process_get_pid(p), vaddr) ||
+				((cp = cacheLookup(region_get_cache(r),
+					*entry & ADDRESS_MASK)) == NULL)) {
+			break;
+		}
+
+		cacheAttach(cp, p, vaddr);
+		frame_set_flags(cp->frame, FRAME_REF);
+		mapPage(process_get_sid(p), vaddr, cp->frame,
+				region_get_rights(r) & ~REGION_WRITE);
+		stats.cache_hits++;
+	}
+}
+
+static int isAnonymous(Region *r) {
+	return (region_get_type(r) == REGION_HEAP) ||
+		(region_get_type(r) == REGION_STACK);
+}
+
+static int largeEligible(Process *p, Region *r, L4_Word_t base) {
+	// Whether the large page at base can be one, which needs it to be all
+	// in the one region of the process's own or cached pages (so not the
+	// buffer, writable mappings, or pages mapped directly), and there to
+	// be frames to spare
+	if (((region_get_type(r) == REGION_MMAP) && !isCached(r)) ||
+			(region_get_type(r) == REGION_BUFFER) || region_map_directly(r)) {
+		return 0;
+	} else if ((base < region_get_base(r)) || (base + LARGE_PAGESIZE >
+				region_get_base(r) + region_get_size(r))) {
+		return 0;
+	} else {
+		return (allocLimit - LARGE_PAGEFRAMES >= FRAME_SWAP_THRESHHOLD);
+	}
+}
+
+static int largeMove(Process *p, L4_Word_t base) {
+	// Copy the pages of a large page in to contiguous frames
+	L4_Word_t *entry, frame, run, vaddr;
+	int flags;
+
+	if ((run = frame_alloc_run(FA_PAGERALLOC, LARGE_PAGEFRAMES)) == 0) {
+		return 0;
+	}
+
+	dprintf(2, "*** largeMove: p=%d base=%p to %p\n",
+			process_get_pid(p), (void*) base, (void*) run);
+
+	for (int i = 0; i < LARGE_PAGEFRAMES; i++) {
+		vaddr = base + i * PAGESIZE;
+		entry = pagetableLookup(process_get_pagetable(p), vaddr);
+		frame = *entry & ADDRESS_MASK;
+		flags = frame_get_flags(frame);
+
+		unmapPage(process_get_sid(p), vaddr);
+		prepareDataIn(p, vaddr);
+		memcpy((char*) run + i * PAGESIZE, (char*) frame, PAGESIZE);
+
+		frame_set_owner(run + i * PAGESIZE, process_get_pid(p), vaddr);
+		frame_set_backing(run + i * PAGESIZE, frame_get_backing(frame));
+		frame_set_refs(run + i * PAGESIZE, 1);
+		frame_set_flags(run + i * PAGESIZE, flags);
+
+		// Same number of frames as before, so not pagerFrameFree
+		*entry = (*entry & ~ADDRESS_MASK) | (run + i * PAGESIZE);
+		frame_free(frame);
+	}
+
+	please(CACHE_FLUSH_RANGE(L4_rootspace, run, run + LARGE_PAGESIZE));
+	stats.large_moves++;
+	return 1;
+}
+
+static int largeCacheMove(Process *p, L4_Word_t base) {
+	// As largeMove, but for cached pages, so every process mapping them
+	// is moved over to the new frames as well
+	L4_Word_t frame, run;
+	CachedPage *cp;
+
+	if ((run = frame_alloc_run(FA_PAGERALLOC, LARGE_PAGEFRAMES)) == 0) {
+		return 0;
+	}
+
+	dprintf(2, "*** largeCacheMove: p=%d base=%p to %p\n",
+			process_get_pid(p), (void*) base, (void*) run);
+
+	for (int i = 0; i < LARGE_PAGEFRAMES; i++) {
+		frame = *pagetableLookup(process_get_pagetable(p), base + i * PAGESIZE)
+			& ADDRESS_MASK;
+		cp = cacheLookup(frame_get_vaddr(frame), frame_get_backing(frame));
+		assert(cp != NULL);
+
+		// Never written to, so nothing of the mappers' to flush first
+		memcpy((char*) run + i * PAGESIZE, (char*) frame, PAGESIZE);
+
+		frame_set_owner(run + i * PAGESIZE, CACHE_PID, cp->file);
+		frame_set_backing(run + i * PAGESIZE, cp->offset);
+		frame_set_refs(run + i * PAGESIZE, frame_get_refs(frame));
+		frame_set_flags(run + i * PAGESIZE, frame_get_flags(frame));
+
+		cp->frame = run + i * PAGESIZE;
+		list_iterate(cp->mappers, mapperMove, (void*) cp->frame);
+		frame_free(frame);
+	}
+
+	please(CACHE_FLUSH_RANGE(L4_rootspace, run, run + LARGE_PAGESIZE));
+	stats.large_moves++;
+	return 1;
+}
+
+static CachedPage *largeCached(Process *p, Region *r, L4_Word_t vaddr) {
+	// The page of a cached region at vaddr if it is in the cache, whether
+	// the process has it yet or not
+	L4_Word_t entry = *pagetableLookup(process_get_pagetable(p), vaddr);
+	L4_Word_t frame = entry & ADDRESS_MASK;
+
+	if ((entry & SWAP_MASK) && (entry & FILE_MASK) &&
+			!pageInFlight(process_get_pid(p), vaddr)) {
+		return cacheLookup(region_get_cache(r), frame);
+	} else if (!(entry & SWAP_MASK) && (frame != 0) &&
+			(frame_get_pid(frame) == CACHE_PID)) {
+		return cacheLookup(region_get_cache(r), frame_get_backing(frame));
+	} else {
+		return NULL;
+	}
+}
+
+static int largeMap(Process *p, Region *r, L4_Word_t addr) {
+	// Map the large page addr is in, all at once, if all its pages are
+	// resident and would be mapped the same way.  If they aren't already
+	// in contiguous frames they are moved in to some.  Pages of cached
+	// regions only need to be in the cache, and are taken from it for
+	// the process here if they aren't yet
+	L4_Word_t base = addr & LARGE_PAGEALIGN;
+	L4_Word_t *entry, vaddr, frame, first = 0;
+	int rights = region_get_rights(r);
+	int contiguous = 1;
+	CachedPage *cp;
+
+	if (!largeEligible(p, r, base)) {
+		return 0;
+	}
+
+	for (int i = 0; i < LARGE_PAGEFRAMES; i++) {
+		entry = pagetableLookup(process_get_pagetable(p), base + i * PAGESIZE);
+		frame = *entry & ADDRESS_MASK;
+
+		if (isCached(r)) {
+			if ((cp = largeCached(p, r, base + i * PAGESIZE)) == NULL) {
+				return 0;
+			}
+
+			frame = cp->frame;
+		} else if ((*entry & (SWAP_MASK | ZERO_MASK | SHARED_MASK)) ||
+				(frame == 0) || (frame_get_pid(frame) != process_get_pid(p))) {
+			return 0;
+		}
+
+		if (frame_get_flags(frame) & (FRAME_PINNED | FRAME_PREFETCHED)) {
+			return 0;
+		}
+
+		// Clean pages are mapped read-only to catch the first write
+		if ((rights & REGION_WRITE) && !(frame_get_flags(frame) & FRAME_DIRTY)) {
+			return 0;
+		}
+
+		if (i == 0) {
+			first = frame;
+			contiguous = ((first & ~LARGE_PAGEALIGN) == 0);
+		} else if (frame != first + i * PAGESIZE) {
+			contiguous = 0;
+		}
+	}
+
+	if (isCached(r)) {
+		for (vaddr = base; vaddr < base + LARGE_PAGESIZE; vaddr += PAGESIZE) {
+			entry = pagetableLookup(process_get_pagetable(p), vaddr);
+
+			if (*entry & SWAP_MASK) {
+				cacheAttach(largeCached(p, r, vaddr), p, vaddr);
+				stats.cache_hits++;
+			}
+		}
+	}
+
+	if (!contiguous) {
+		if (isCached(r) ? !largeCacheMove(p, base) : !largeMove(p, base)) {
+			return 0;
+		}
+
+		first = *pagetableLookup(process_get_pagetable(p), base) & ADDRESS_MASK;
+	}
+
+	dprintf(2, "*** largeMap: p=%d base=%p frames=%p\n",
+			process_get_pid(p), (void*) base, (void*) first);
+
+	for (int i = 0; i < LARGE_PAGEFRAMES; i++) {
+		frame_set_flags(first + i * PAGESIZE, FRAME_REF | FRAME_LARGE);
+	}
+
+	// Out with any of the pages mapped on their own
+	unmapFpage(process_get_sid(p), base, LARGE_PAGESIZE);
+	mapFpage(process_get_sid(p), base, first, LARGE_PAGESIZE, rights);
+	stats.large_maps++;
+
+	return 1;
+}
+
+static int largeAlloc(Process *p, Region *r, L4_Word_t addr) {
+	// Start a large page off in contiguous frames, if none of its pages
+	// have been written to yet (nor need swapping in) and the process has
+	// room for all of them
+	L4_Word_t base = addr & LARGE_PAGEALIGN;
+	L4_Word_t *entry, run;
+	process_t *info = process_get_info(p);
+
+	if (!largeEligible(p, r, base) ||
+			(info->size + LARGE_PAGEFRAMES > info->rss_limit)) {
+		return 0;
+	}
+
+	for (int i = 0; i < LARGE_PAGEFRAMES; i++) {
+		entry = pagetableLookup(process_get_pagetable(p), base + i * PAGESIZE);
+
+		if ((*entry & ~ZERO_MASK) != 0) {
+			return 0;
+		}
+	}
+
+	if ((run = frame_alloc_run(FA_PAGERALLOC, LARGE_PAGEFRAMES)) == 0) {
+		return 0;
+	}
+
+	dprintf(2, "*** largeAlloc: p=%d base=%p frames=%p\n",
+			process_get_pid(p), (void*) base, (void*) run);
+
+	memset((char*) run, 0x00, LARGE_PAGESIZE);
+	please(CACHE_FLUSH_RANGE(L4_rootspace, run, run + LARGE_PAGESIZE));
+
+	for (int i = 0; i < LARGE_PAGEFRAMES; i++) {
+		frame_set_owner(run + i * PAGESIZE, process_get_pid(p),
+				base + i * PAGESIZE);
+		frame_set_backing(run + i * PAGESIZE, ADDRESS_NONE);
+		frame_set_refs(run + i * PAGESIZE, 1);
+		frame_set_flags(run + i * PAGESIZE, FRAME_DIRTY | FRAME_REF | FRAME_LARGE);
+
+		*pagetableLookup(process_get_pagetable(p), base + i * PAGESIZE) =
+			run + i * PAGESIZE;
+	}
+
+	info->size += LARGE_PAGEFRAMES;
+	allocLimit -= LARGE_PAGEFRAMES;
+
+	// Out with the zero frame where it was mapped
+	unmapFpage(process_get_sid(p), base, LARGE_PAGESIZE);
+	please(CACHE_FLUSH_RANGE_INVALIDATE(process_get_sid(p), base,
+				base + LARGE_PAGESIZE));
+	mapFpage(process_get_sid(p), base, run, LARGE_PAGESIZE, region_get_rights(r));
+
+	stats.large_allocs++;
+	stats.large_maps++;
+	return 1;
+}
+
+static int canAlloc(PagerRequest *pr, Process *p) {
+	// Whether there is a frame for the request without swapping something
+	// out first.  Shared and cached pages don't count towards the limit
+	Region *r;
+
+	if (allocLimit == 0) {
+		return 0;
+	} else if (pr->swapped || (sharedGet(p, pr->addr) != NULL)) {
+		return 1;
+	}
+
+	r = list_find(process_get_regions(p), findRegion, (void*) pr->addr);
+	return (r == NULL) || isCached(r) || belowLimit(p);
+}
+
+static int pagerAction(PagerRequest *pr) {
+	Process *p;
+	SharedPage *sp;
+	CachedPage *cp;
+	L4_Word_t frame, *entry;
+	pid_t owner;
+	int rights, zeroed = 0, around = 0;
+
+	dprintf(2, "*** pagerAction: fault on ss=%d, addr=%p rights=%d\n",
+			L4_SpaceNo(L4_SenderSpace()), pr->addr, pr->rights);
+
+	p = process_lookup(pr->pid);
+	if (p == NULL) {
+		// Process died
+		return 0;
+	}
+
+	// Find region it belongs in.
+	dprintf(3, "*** pagerAction: finding region\n");
+	Region *r = list_find(process_get_regions(p), findRegion, (void*) pr->addr);
+
+	if (r == NULL) {
+		printf("Segmentation fault (%d on %p)\n",
+				process_get_pid(p), (void*) pr->addr);
+		processDelete(process_get_pid(p));
+		return 0;
+	}
+
+	if ((region_get_rights(r) & pr->rights) == 0) {
+		printf("Permission fault (%d)\n", process_get_pid(p));
+		processDelete(process_get_pid(p));
+		return 0;
+	}
+
+	if (region_get_type(r) == REGION_BUFFER) {
+		bufferMap(p, r, pr->addr);
+		return 1;
+	}
+
+	// Place in, or retrieve from, page table.
+	dprintf(3, "*** pagerAction: finding entry\n");
+	sp = sharedGet(p, pr->addr);
+	entry = pageEntry(p, pr->addr);
+	owner = pageOwner(p, pr->addr);
+	frame = *entry & ADDRESS_MASK;
+
+	if ((sp != NULL) && (pr->rights & REGION_WRITE) &&
+			!sharedCanWrite(sp, process_get_pid(p))) {
+		printf("Permission fault (%d on shared %p)\n",
+				process_get_pid(p), (void*) pr->addr);
+		processDelete(process_get_pid(p));
+		return 0;
+	}
+
+	dprintf(3, "*** pagerAction: entry %p found at %p\n", (void*) *entry, entry);
+
+	if ((*entry & SWAP_MASK) && isCached(r) &&
+			((cp = cacheLookup(region_get_cache(r), frame)) != NULL)) {
+		// Another process has this page of the file in memory already
+		// (or had, and it has been kept)
+		dprintf(3, "*** pagerAction: page is cached\n");
+		cacheAttach(cp, p, pr->addr & PAGEALIGN);
+		frame = cp->frame;
+		around = 1;
+		stats.cache_hits++;
+	} else if (*entry & SWAP_MASK) {
+		// On disk, queue a swapin request
+		dprintf(2, "*** pagerAction: page is on disk (%p)\n", (void*) *entry);
+		process_get_info(p)->majflt++;
+		faultClass(pr, (*entry & FILE_MASK) ? FAULT_FILE : FAULT_SWAPIN);
+		queueRequest(REQUEST_PAGER, pr);
+		return 0;
+	} else if ((frame & ADDRESS_MASK) != 0) {
+		// Already appears in page table as a frame, just got unmapped
+		// (probably to update the refbit) or written to for the first time
+		dprintf(3, "*** pagerAction: got unmapped\n");
+
+		if (!(frame_get_flags(frame) & FRAME_REF)) {
+			faultClass(pr, FAULT_REFBIT);
+		}
+
+		if (frame_get_flags(frame) & FRAME_PREFETCHED) {
+			// Read ahead and now used, so it was worth it
+			frame_clear_flags(frame, FRAME_PREFETCHED);
+			stats.readahead_hits++;
+		}
+
+		// (pages of a writable mapping keep their place in the file)
+		if ((pr->rights & REGION_WRITE) && !region_map_directly(r) &&
+				!writesBack(r)) {
+			backingFree(owner, entry, frame_get_backing(frame));
+			frame_set_backing(frame, ADDRESS_NONE);
+		}
+	} else if (!(pr->rights & REGION_WRITE) && isAnonymous(r) &&
+			(pr->backing == ADDRESS_NONE) && (sp == NULL)) {
+		// Never been written to, so as far as reading goes it is the
+		// same as every other untouched page (except for shared pages,
+		// which would have to be unmapped everywhere on the first write)
+		dprintf(3, "*** pagerAction: mapping zero frame\n");
+		faultClass(pr, FAULT_ZERO);
+		*entry |= ZERO_MASK;
+		mapPage(process_get_sid(p), pr->addr & PAGEALIGN, zeroFrame,
+				region_get_rights(r) & ~REGION_WRITE);
+		return 1;
+	} else if (region_map_directly(r)) {
+		// Wants to be mapped directly (code/data probably).
+		dprintf(3, "*** pagerAction: mapping directly\n");
+		frame = pr->addr & PAGEALIGN;
+	} else if (isCached(r) && (pr->backing != ADDRESS_NONE) &&
+			((cp = cacheLookup(region_get_cache(r), pr->backing)) != NULL)) {
+		// Read in for another process while this one was reading it
+		dprintf(3, "*** pagerAction: page was cached meanwhile\n");
+		cacheAttach(cp, p, pr->addr & PAGEALIGN);
+		frame = cp->frame;
+		stats.cache_hits++;
+		pr->backing = ADDRESS_NONE;
+	} else {
+		// Didn't appear in frame table so we need to allocate a new one.
+		// However there are potentially no free frames, or none the
+		// process is allowed
+		dprintf(3, "*** pagerAction: allocating frame\n");
+
+		if ((sp == NULL) && !isCached(r) && !pr->swapped && !belowLimit(p)) {
+			dprintf(2, "*** pagerAction: %d at its limit\n", process_get_pid(p));
+			queueRequest(REQUEST_PAGER, pr);
+			return 0;
+		}
+
+		// Anything not read in just now starts out as zeros
+		faultClass(pr, FAULT_ZERO);
+
+		// Heap pages being written to for the first time can start out
+		// as a whole large page of zeros
+		if ((sp == NULL) && (pr->backing == ADDRESS_NONE) &&
+				(region_get_type(r) == REGION_HEAP) &&
+				largeAlloc(p, r, pr->addr)) {
+			return 1;
+		}
+
+		// Shared pages never use the zero frame, so start out zeroed here
+		zeroed = (*entry & ZERO_MASK) ||
+			((sp != NULL) && (pr->backing == ADDRESS_NONE));
+
+		if ((pr->rights & REGION_WRITE) && !writesBack(r)) {
+			backingFree(owner, entry, pr->backing);
+			pr->backing = ADDRESS_NONE;
+		}
+
+		frame = pagerFrameAlloc(((sp == NULL) && !isCached(r)) ? p : NULL,
+				pr->addr & PAGEALIGN, pr->backing);
+		assert((frame & ~ADDRESS_MASK) == 0); // no flags set
+
+		if (frame == 0) {
+			dprintf(2, "*** pagerAction: no free frames\n");
+			queueRequest(REQUEST_PAGER, pr);
+			return 0;
+		}
+
+		if (sp != NULL) {
+			frame_set_refs(frame, sharedCount(sp));
+		} else if (isCached(r)) {
+			cacheAttach(cacheInsert(region_get_cache(r), pr->backing, frame),
+					p, pr->addr & PAGEALIGN);
+		}
+
+		pr->backing = ADDRESS_NONE;
+
+		if (zeroed) {
+			// First write to a page that has been read as zeros
+			memset((char*) frame, 0x00, PAGESIZE);
+			*entry &= ~ZERO_MASK;
+		}
+	}
+
+	*entry = (*entry & ~ADDRESS_MASK) | frame;
+	rights = region_get_rights(r);
+
+	if (!region_map_directly(r)) {
+		frame_set_flags(frame, FRAME_REF);
+
+		// Nothing on disk to fall back on means it needs writing out anyway
+		if ((pr->rights & REGION_WRITE) ||
+				(frame_get_backing(frame) == ADDRESS_NONE)) {
+			frame_set_flags(frame, FRAME_DIRTY);
+		}
+
+		if (!(frame_get_flags(frame) & FRAME_DIRTY)) {
+			// Clean, map it read-only to catch the first write
+			rights &= ~REGION_WRITE;
+		}
+	}
+
+	if ((sp != NULL) && !sharedCanWrite(sp, process_get_pid(p))) {
+		rights &= ~REGION_WRITE;
+	}
+
+	if (zeroed) {
+		prepareDataOut(p, pr->addr & PAGEALIGN);
+	}
+
+	if ((sp == NULL) && !region_map_directly(r) && largeMap(p, r, pr->addr)) {
+		return 1;
+	}
+
+	dprintf(3, "*** pagerAction: mapping vaddr=%p pid=%d frame=%p rights=%d\n",
+			(void*) (pr->addr & PAGEALIGN), process_get_pid(p),
+			(void*) frame, rights);
+	mapPage(process_get_sid(p), pr->addr & PAGEALIGN, frame, rights);
+
+	// (only if the cached pages weren't all mapped as a large page)
+	if (around) {
+		cacheAround(p, r, pr->addr);
+	}
+
+	return 1;
+}
+
+static void pager(PagerRequest *pr) {
+	if (pagerAction(pr)) {
+		pr->callback(pr);
+
+		// This very rarely happens unless frames are being freed very quickly -
+		// for example, in a fork bomb
+		if (!list_null(requests)) {
+			runRequests();
+		}
+	} else {
+		dprintf(3, "*** pager: pagerAction stalled\n");
+	}
+}
+
+static void setRegionOnFile(Process *p, Region *r, L4_Word_t addr) {
+	assert((addr & ~PAGEALIGN) == 0);
+	L4_Word_t *entry;
+	L4_Word_t base = region_get_base(r);
+
+	for (int size = 0; size < region_get_size(r); size += PAGESIZE) {
+		entry = pagetableLookup(process_get_pagetable(p), base + size);
+		*entry = (addr + size) | SWAP_MASK | FILE_MASK;
+	}
+}
+
+static L4_Word_t mmapFind(Process *p, L4_Word_t size) {
+	// The first gap big enough for the mapping from MMAP_BASE up
+	Pair range = PAIR(MMAP_BASE, size); // (base, size)
+	Region *r;
+
+	while ((r = list_find(process_get_regions(p), findOverlap, &range)) != NULL) {
+		range.fst = round_up(region_get_base(r) + region_get_size(r), PAGESIZE);
+	}
+
+	return (range.fst + size > MMAP_TOP) ? 0 : range.fst;
+}
+
+static L4_Word_t mmapRegion(Process *p, L4_Word_t addr, L4_Word_t size,
+		int rights, L4_Word_t offset, L4_Word_t filesize, char *path) {
+	Region *r;
+	Pair range; // (base, size)
+
+	dprintf(1, "*** mmapRegion: pid=%d addr=%p size=%lx rights=%d %s at %lx\n",
+			process_get_pid(p), (void*) addr, size, rights, path, offset);
+
+	size = round_up(size, PAGESIZE);
+
+	if ((addr & ~PAGEALIGN) || (offset & ~PAGEALIGN) || (size == 0) ||
+			(rights == 0) ||
+			(rights & ~(REGION_READ | REGION_WRITE | REGION_EXECUTE))) {
+		return 0;
+	}
+
+	// Writes are only kept in the file, which is never extended, so a
+	// writable mapping can't have pages wholly past the end of it
+	if ((rights & REGION_WRITE) && (size > round_up(filesize, PAGESIZE))) {
+		return 0;
+	}
+
+	if (addr == 0) {
+		addr = mmapFind(p, size);
+	}
+
+	range = PAIR(addr, size);
+
+	if ((addr == 0) || (addr + size < addr) ||
+			(list_find(process_get_regions(p), findOverlap, &range) != NULL)) {
+		return 0;
+	}
+
+	// Paged in from the file on demand just like an ELF segment
+	r = region_alloc(REGION_MMAP, addr, size, rights, 0);
+	region_set_file(r, swapfile_init(path));
+	region_set_filesize(r, min(filesize, size));
+	process_add_region(p, r);
+	setRegionOnFile(p, r, offset);
+
+	if (!(rights & REGION_WRITE)) {
+		region_set_cache(r, cachedFileRef(path, NULL));
+	}
+
+	return addr;
+}
+
+static void munmapRegion(Process *p, L4_Word_t addr, L4_Word_t size) {
+	Region *r = list_find(process_get_regions(p), findRegion, (void*) addr);
+
+	dprintf(1, "*** munmapRegion: pid=%d addr=%p size=%lx\n",
+			process_get_pid(p), (void*) addr, size);
+
+	// Only whole mappings can be unmapped
+	if ((r == NULL) || (region_get_type(r) != REGION_MMAP) ||
+			(region_get_base(r) != addr) ||
+			(region_get_size(r) != round_up(size, PAGESIZE))) {
+		syscall_reply(process_get_tid(p), -1);
+		return;
+	}
+
+	list_delete_first(process_get_regions(p), findRegion, (void*) addr);
+
+	// If there is anything to write back the reply waits until it is done
+	if (!mappingClose(p, r, 1)) {
+		syscall_reply(process_get_tid(p), 0);
+	}
+
+	region_free(r);
+}
+
+static char *wordAlign(char *s) {
+	unsigned int x = (unsigned int) s;
+	x--;
+	x += sizeof(L4_Word_t) - (x % sizeof(L4_Word_t));
+	return (char*) x;
+}
+
+static void runSpawns(void);
+static int isPair(void *contents, void *data);
+
+static void finishElfload(int rval) {
+	assert(elfloadActive != NULL);
+	ElfloadRequest *er = elfloadActive;
+	L4_ThreadId_t replyTo = process_get_tid(process_lookup(er->parent));
+
+	free(er->fdout);
+	free(er->fderr);
+	free(er->fdin);
+	free(er);
+	syscall_reply(replyTo, rval);
+
+	elfloadActive = NULL;
+	runSpawns();
+}
+
+static int findSpawnFile(void *contents, void *data) {
+	SpawnFile *sf = (SpawnFile*) contents;
+	return !sf->stale && (strncmp(swapfile_get_path(sf->sf), (char*) data,
+				MAX_FILE_NAME) == 0);
+}
+
+static SpawnFile *spawnFileLookup(char *path, stat_t *stat) {
+	// The executable if it is still open and hasn't changed since
+	SpawnFile *sf = list_find(spawnFiles, findSpawnFile, path);
+
+	if ((sf != NULL) && ((sf->stat.st_size != stat->st_size) ||
+				(sf->stat.st2_ctime != stat->st2_ctime))) {
+		dprintf(1, "*** spawnFileLookup: %s has changed\n", path);
+		sf->stale = 1;
+		sf = NULL;
+	} else if (sf != NULL) {
+		list_delete_first(spawnFiles, isPair, sf);
+		list_shift(spawnFiles, sf);
+	}
+
+	return sf;
+}
+
+static SpawnFile *spawnFileAdd(ElfloadRequest *er, char *header) {
+	// Keep the newly opened executable open, and its headers
+	SpawnFile *sf = (SpawnFile*) malloc(sizeof(SpawnFile));
+
+	sf->sf = swapfile_init(er->path);
+	swapfile_set_fd(sf->sf, er->fd);
+	er->fd = VFS_NIL_FILE;
+
+	sf->stat = er->stat;
+	sf->header = (char*) malloc(IO_MAX_BUFFER);
+	memcpy(sf->header, header, IO_MAX_BUFFER);
+	sf->stale = 0;
+
+	list_shift(spawnFiles, sf);
+	return sf;
+}
+
+static void *spawnFileAge(void *contents, void *data) {
+	// Anything beyond the most recently used few, or not used for a while,
+	// is closed at the next chance
+	SpawnFile *sf = (SpawnFile*) contents;
+	int n = (int) (L4_Word_t) data;
+
+	if ((n >= PAGER_SPAWN_FILES) ||
+			(time_stamp() - sf->used > PAGER_SPAWN_YOUNG)) {
+		sf->stale = 1;
+	}
+
+	return (void*) (L4_Word_t) (sf->stale ? n : n + 1);
+}
+
+static int spawnFileClosable(void *contents, void *data) {
+	// Stale, and not being read from by a worker right now
+	SpawnFile *sf = (SpawnFile*) contents;
+
+	if (!sf->stale) {
+		return 0;
+	}
+
+	for (int i = 0; i < PAGER_IO_DEPTH; i++) {
+		if ((workers[i].pr != NULL) && !workers[i].ready &&
+				(workers[i].pr->io.sf == sf->sf)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void spawnClose(ElfloadRequest *er) {
+	// Close executables that aren't being kept open any more, one at a
+	// time (the reply to each comes back here), then finish
+	SpawnFile *sf;
+	fildes_t fd;
+
+	er->stage = ELFLOAD_CLOSE;
+
+	if (er->fd != VFS_NIL_FILE) {
+		// Failed after opening it
+		fd = er->fd;
+		er->fd = VFS_NIL_FILE;
+		closeNonblocking(fd);
+		return;
+	}
+
+	list_reduce(spawnFiles, spawnFileAge, (void*) 0);
+
+	if ((sf = list_find(spawnFiles, spawnFileClosable, NULL)) != NULL) {
+		dprintf(1, "*** spawnClose: closing %s\n", swapfile_get_path(sf->sf));
+		list_delete_first(spawnFiles, isPair, sf);
+
+		// Processes still running it open it for each page in again
+		fd = swapfile_take_fd(sf->sf);
+		swapfile_free(sf->sf);
+		free(sf->header);
+		free(sf);
+
+		closeNonblocking(fd);
+		return;
+	}
+
+	finishElfload(er->rval);
+}
+
+static void prefetchDone(PagerRequest *pr) {
+	free(pr);
+}
+
+static void spawnPrefetch(Process *p, L4_Word_t addr) {
+	// Fault in a page the process is about to need before it gets to run,
+	// so that it is in (or on its way in) by the time it does
+	Region *r = list_find(process_get_regions(p), findRegion, (void*) addr);
+	int rights;
+
+	if (r == NULL) {
+		return;
+	}
+
+	// Only ever read, so a write-only segment would look like a
+	// permission fault and take the process out before it starts
+	rights = region_get_rights(r) & ~REGION_WRITE;
+
+	if (rights != 0) {
+		dprintf(2, "*** spawnPrefetch: pid=%d addr=%p\n",
+				process_get_pid(p), (void*) addr);
+		pager(allocPagerRequest(process_get_pid(p), addr, rights,
+					prefetchDone));
+	}
+}
+
+static void spawnRun(ElfloadRequest *er, SpawnFile *sf) {
+	// Set up and start the process from the executable's headers
+	struct Elf32_Header *header = (struct Elf32_Header*) sf->header;
+	L4_Word_t data = 0;
+	Process *p;
+	Region *r;
+	int flags;
+
+	sf->used = time_stamp();
+	p = process_init(PS_TYPE_PROCESS);
+
+	for (int i = 0; i < elf32_getNumProgramHeaders(header); i++) {
+		flags = elf32_getProgramHeaderFlags(header, i);
+		r = region_alloc(
+				REGION_OTHER,
+				elf32_getProgramHeaderVaddr(header, i),
+				elf32_getProgramHeaderMemorySize(header, i),
+				flags, 0);
+
+		// All the segments are paged in through the one open file
+		swapfile_ref(sf->sf);
+		region_set_file(r, sf->sf);
+		region_set_filesize(r, elf32_getProgramHeaderFileSize(header, i));
+		process_add_region(p, r);
+		setRegionOnFile(p, r,
+				elf32_getProgramHeaderOffset(header, i) & PAGEALIGN);
+
+		// Text is the same for everybody running the program
+		if ((flags & REGION_EXECUTE) && !(flags & REGION_WRITE)) {
+			region_set_cache(r, cachedFileRef(er->path, &er->stat));
+		} else if ((flags & REGION_WRITE) && (data == 0)) {
+			data = region_get_base(r);
+		}
+	}
+
+	process_set_name(p, er->path);
+	process_get_info(p)->pid = er->child;
+	process_prepare2(p, er->fdout, er->fderr, er->fdin);
+	process_set_ip(p, (void*) elf32_getEntryPoint(header));
+
+	process_run(p, YES_TIMESTAMP);
+	assert(er->child == process_get_pid(p));
+	er->rval = er->child;
+
+	// The pager runs ahead of the new process, so the first text and data
+	// pages are on their way in together before it first faults
+	spawnPrefetch(p, elf32_getEntryPoint(header));
+
+	if (data != 0) {
+		spawnPrefetch(p, data);
+	}
+}
+
+static void continueElfload(int vfsRval) {
+	ElfloadRequest *er = elfloadActive;
+	char *buf;
+	stat_t *elfStat;
+
+	switch (er->stage) {
+		case ELFLOAD_CHECK_EXEC:
+			dprintf(2, "ELFLOAD_CHECK_EXEC\n");
+			buf = pager_buffer(sos_my_tid());
+			elfStat = (stat_t*) wordAlign(buf + strlen(buf) + 1);
+
+			if (vfsRval < 0) {
+				dprintf(1, "*** continueElfload: failed to stat\n");
+				finishElfload(-1);
+			} else if (!(elfStat->st_fmode & FM_EXEC)) {
+				dprintf(1, "*** continueElfload: not executable\n");
+				finishElfload(-1);
+			} else {
+				er->stat = *elfStat;
+
+				if ((er->file = spawnFileLookup(er->path, &er->stat)) != NULL) {
+					// Still open from last time, nothing more to read
+					dprintf(2, "*** continueElfload: %s already open\n", er->path);
+					spawnRun(er, er->file);
+					spawnClose(er);
+				} else {
+					strncpy(pager_buffer(sos_my_tid()), er->path, MAX_FILE_NAME);
+					openNonblocking(NULL, FM_READ);
+					er->stage = ELFLOAD_OPEN;
+				}
+			}
+
+			break;
+
+		case ELFLOAD_OPEN:
+			dprintf(2, "ELFLOAD_OPEN\n");
+			if (vfsRval < 0) {
+				dprintf(1, "*** continueElfload: failed to open\n");
+				finishElfload(-1);
+			} else {
+				er->fd = vfsRval;
+				readNonblocking(er->fd, IO_MAX_BUFFER);
+				er->stage = ELFLOAD_READ_HEADER;
+			}
+
+			break;
+
+		case ELFLOAD_READ_HEADER:
+			dprintf(2, "ELFLOAD_READ_HEADER\n");
+			buf = pager_buffer(sos_my_tid());
+
+			if ((vfsRval < 0) ||
+					(elf32_checkFile((struct Elf32_Header*) buf) != 0)) {
+				dprintf(1, "*** continueElfload: not an ELF file\n");
+			} else {
+				er->file = spawnFileAdd(er, buf);
+				spawnRun(er, er->file);
+			}
+
+			spawnClose(er);
+			break;
+
+		case ELFLOAD_CLOSE:
+			dprintf(2, "ELFLOAD_CLOSE\n");
+			spawnClose(er);
+			break;
+
+		default:
+			assert(!"continueElfload");
+	}
+}
+
+static void startElfload(ElfloadRequest *er) {
+	assert(elfloadActive == NULL);
+	elfloadActive = er;
+
+	// Check the file first, since if it is already open that's all
+	// there is to do, and let the continuation take over
+	copyInOutData[L4_ThreadNo(sos_my_tid())] = 0;
+	strncpy(pager_buffer(sos_my_tid()), er->path, MAX_FILE_NAME);
+	statNonblocking();
+}
+
+static void runSpawns(void) {
+	if ((elfloadActive == NULL) && !list_null(spawns)) {
+		startElfload((ElfloadRequest*) list_unshift(spawns));
+	}
+}
+
+static void queueSpawn(ElfloadRequest *er) {
+	dprintf(1, "*** queueSpawn: %s for %d\n", er->path, er->parent);
+	list_push(spawns, er);
+	runSpawns();
+}
+
+static PagerWorker *findIdleWorker(void) {
+	for (int i = 0; i < PAGER_IO_DEPTH; i++) {
+		if (workers[i].ready && workers[i].pr == NULL) {
+			return &workers[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int pageInFlight(pid_t pid, L4_Word_t vaddr) {
+	// A page being read or written can't be touched until that is done
+	for (int i = 0; i < PAGER_IO_DEPTH; i++) {
+		PagerRequest *curr = workers[i].pr;
+
+		if ((curr == NULL) || (workers[i].ready) || (curr->io.pid != pid)) {
+			continue;
+		}
+
+		for (int j = 0; j < curr->io.count; j++) {
+			if (curr->io.pages[j].vaddr == vaddr) return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int requestCanStart(void *contents, void *data) {
+	Pair *pair = (Pair*) contents; // (rtype_t, rdata)
+	PagerRequest *pr;
+	Process *p;
+
+	switch ((rtype_t) pair->fst) {
+		case REQUEST_PAGER:
+			pr = (PagerRequest*) pair->snd;
+			p = process_lookup(pr->pid);
+			return (findIdleWorker() != NULL) && ((p == NULL) ||
+					!pageInFlight(pageOwner(p, pr->addr), pr->addr & PAGEALIGN));
+
+		case REQUEST_WRITEBACK:
+			return findIdleWorker() != NULL;
+
+		default:
+			assert(!"default");
+			return 0;
+	}
+}
+
+static int isPair(void *contents, void *data) {
+	return contents == data;
+}
+
+static void startPagerRequest(PagerRequest *pr);
+static void startWriteback(PagerRequest *pr);
+
+static void runRequests(void) {
+	Pair *next; // (rtype_t, rdata)
+
+	// Start everything there is a free worker for, oldest first
+	while ((next = list_find(requests, requestCanStart, NULL)) != NULL) {
+		dprintf(1, "*** runRequests: starting %d\n", next->fst);
+		list_delete_first(requests, isPair, next);
+
+		switch ((rtype_t) next->fst) {
+			case REQUEST_PAGER:
+				startPagerRequest((PagerRequest*) next->snd);
+				break;
+
+			case REQUEST_WRITEBACK:
+				startWriteback((PagerRequest*) next->snd);
+				break;
+
+			default:
+				dprintf(0, "!!! runRequests: unrecognised request\n");
+		}
+
+		pair_free(next);
+	}
+
+	if (verbose > 1 && !list_null(requests)) {
+		dprintf(2, "*** runRequests: still waiting\n");
+		list_iterate(requests, printRequests, NULL);
+	}
+}
+
+static void queueRequest(rtype_t rtype, void *request) {
+	dprintf(1, "*** queueRequest\n");
+	list_push(requests, pair_alloc(rtype, (L4_Word_t) request));
+	runRequests();
+}
+
+static void prepareIO(PagerRequest *pr, pager_io_t op, Swapfile *sf, pid_t pid) {
+	pr->io.op = op;
+	pr->io.sf = sf;
+	pr->io.pid = pid;
+	pr->io.count = 0;
+	pr->io.memory = 0;
+}
+
+static void addIO(PagerRequest *pr, L4_Word_t vaddr, L4_Word_t frame,
+		L4_Word_t diskAddr, int size) {
+	assert(pr->io.count < PAGER_CLUSTER);
+	PagerIOPage *page = &pr->io.pages[pr->io.count++];
+
+	page->vaddr = vaddr;
+	page->frame = frame;
+	page->diskAddr = diskAddr;
+	page->size = size;
+	page->evicted = ADDRESS_NONE;
+	page->rval = 0;
+}
+
+static int zswapStore(PagerIO *io) {
+	// Keep pages going to the default swap file compressed in memory where
+	// possible, and returns the number the worker still has to write.  A
+	// stored page has nothing to write unless the oldest page in the store
+	// had to be evicted in to its frame, which is then written instead
+	PagerIOPage *page;
+	int left = 0;
+
+	for (int i = 0; i < io->count; i++) {
+		page = &io->pages[i];
+
+		if (!zswap_store(page->diskAddr, page->frame, &page->evicted)) {
+			left++;
+		} else if (page->evicted != ADDRESS_NONE) {
+			left++;
+		} else {
+			page->size = 0;
+		}
+	}
+
+	return left;
+}
+
+static void zswapWritten(PagerIO *io) {
+	// Pages evicted from the compressed store have been written out in
+	// place of pages which went in to it, which are safe whatever happened
+	PagerIOPage *page;
+
+	for (int i = 0; i < io->count; i++) {
+		page = &io->pages[i];
+
+		if (page->evicted == ADDRESS_NONE) {
+			continue;
+		}
+
+		if (zswap_written(page->evicted, page->frame, page->rval)) {
+			swapslot_free(defaultSwapfile, page->evicted);
+		}
+
+		page->evicted = ADDRESS_NONE;
+		page->rval = 0;
+	}
+}
+
+static void finishIO(PagerRequest *pr);
+
+static void startIO(PagerRequest *pr) {
+	assert(pr->worker != NULL);
+	assert(pr->worker->ready);
+	assert(pr->io.count > 0);
+
+	if ((pr->io.op == IO_WRITE) && (pr->io.sf == defaultSwapfile) &&
+			(zswapStore(&pr->io) == 0)) {
+		// All compressed, so nothing for the worker to do.  Whoever started
+		// the request (runRequests, the cleaner or workerDone) will go on
+		// to start anything else waiting on the worker
+		pr->io.memory = 1;
+		finishIO(pr);
+		return;
+	}
+
+	// Whoever the file belongs to could go before the I/O is done
+	swapfile_ref(pr->io.sf);
+
+	// The worker is blocked waiting for us, wake it up
+	pr->worker->ready = 0;
+	syscall_reply(pr->worker->tid, 0);
+}
+
+static void finishRequest(PagerRequest *pr) {
+	// Give the worker back before continuing, since the callback may
+	// well queue another request
+	if (pr->worker != NULL) {
+		pr->worker->pr = NULL;
+		pr->worker = NULL;
+	}
+
+	if (pr->pinned != 0) {
+		frame_free(pr->pinned);
+		pr->pinned = 0;
+	}
+}
+
+static void abortRequest(PagerRequest *pr) {
+	dprintf(1, "*** abortRequest: pid=%d addr=%p\n", pr->pid, (void*) pr->addr);
+	finishRequest(pr);
+	free(pr);
+}
+
+static void startSwapout(PagerRequest *pr);
+
+static void swapoutDone(PagerRequest *pr) {
+	Process *p;
+	L4_Word_t *entry, frame;
+
+	if (pr->pid == NIL_PID) {
+		// Only cleaning, nobody is waiting on the frame
+		finishRequest(pr);
+		pr->callback(pr);
+		return;
+	}
+
+	p = process_lookup(pr->pid);
+	if (p == NULL) {
+		// Process died
+		abortRequest(pr);
+		return;
+	}
+
+	// Pager is now guaranteed to find a page (note that the pager
+	// action has been separated, we reply later)
+	pr->swapped = 1;
+
+	if (!pagerAction(pr)) {
+		abortRequest(pr);
+		return;
+	}
+
+	entry = pageEntry(p, pr->addr);
+	frame = *entry & ADDRESS_MASK;
+
+	if (pr->pinned != 0) {
+		// There is contents we need to copy across
+		dprintf(2, "*** swapoutDone: pinned frame is %p\n", pr->pinned);
+		memcpy((char*) frame, (void*) pr->pinned, PAGESIZE);
+	} else {
+		// Zero the frame for debugging, but it may be a good idea anyway
+		dprintf(2, "*** zeroing frame %p\n", (void*) frame);
+		memset((char*) frame, 0x00, PAGESIZE);
+	}
+
+	dprintf(2, "*** swapoutDone: addr=%p for pid=%d now %p\n",
+			(void*) pr->addr, process_get_pid(p), (void*) frame);
+
+	prepareDataOut(p, pr->addr & PAGEALIGN);
+	finishRequest(pr);
+	pr->callback(pr);
+}
+
+static void finishSharedSwapout(PagerRequest *pr) {
+	PagerIOPage *page = &pr->io.pages[0];
+	SharedPage *sp = sharedLookup(page->vaddr);
+
+	if ((sp == NULL) || (sp->entry != (SWAP_MASK | page->diskAddr))) {
+		// Nobody is sharing it any more
+		swapslotFree(page->diskAddr);
+	} else if (page->rval < 0) {
+		dprintf(0, "!!! finishSharedSwapout: write failed (%d)\n", page->rval);
+		swapslotFree(page->diskAddr);
+
+		// Everybody sharing it has lost it, the last to go frees the share
+		while ((sp = sharedLookup(page->vaddr)) != NULL) {
+			if (processDelete(((Pair*) list_peek(sp->sharers))->fst) != 0) break;
+		}
+	}
+
+	pagerFrameFree(NULL, page->frame);
+	swapoutDone(pr);
+}
+
+static int swapoutKept(Process *victim, PagerIOPage *page) {
+	// Whether the page still refers to the slot it was written to, which
+	// it then has for as long as it is swapped out or clean
+	L4_Word_t *entry = pageEntry(victim, page->vaddr);
+
+	if (!(*entry & SWAP_MASK) || (*entry & FILE_MASK) ||
+			((*entry & ADDRESS_MASK) != page->diskAddr)) {
+		return 0;
+	}
+
+	swapCount(pageOwner(victim, page->vaddr), 1);
+	return 1;
+}
+
+static void finishSwapout(PagerRequest *pr) {
+	dprintf(1, "*** finishSwapout: %d pages\n", pr->io.count);
+
+	Process *victim;
+	PagerIOPage *page;
+	int toSwap = (pr->io.sf == defaultSwapfile);
+
+	if (toSwap) {
+		zswapWritten(&pr->io);
+	}
+
+	if (pr->io.pid == SHARED_PID) {
+		finishSharedSwapout(pr);
+		return;
+	}
+
+	// The victim's pages are now safely on disk, unless a write failed
+	// in which case there is nothing to do but kill it.  Pages written back
+	// to a mapped file are in the file rather than in swap slots
+	victim = process_lookup(pr->io.pid);
+
+	for (int i = 0; i < pr->io.count; i++) {
+		page = &pr->io.pages[i];
+
+		if (victim == NULL) {
+			if (toSwap) swapslotFree(page->diskAddr);
+		} else if (page->rval < 0) {
+			dprintf(0, "!!! finishSwapout: write failed (%d)\n", page->rval);
+			if (toSwap) swapslotFree(page->diskAddr);
+			processDelete(pr->io.pid);
+			victim = NULL;
+		} else if (toSwap && !swapoutKept(victim, page)) {
+			// Discarded (or shared) while it was being written
+			swapslotFree(page->diskAddr);
+		}
+
+		pagerFrameFree(victim, page->frame);
+	}
+
+	swapoutDone(pr);
+}
+
+static void finishSwapfile(Process *p, L4_Word_t page, L4_Word_t frame) {
+	Region *r = list_find(process_get_regions(p), findRegion, (void*) page);
+
+	// Zero the area between the end of the file (i.e. region_get_filesize)
+	// and the end of the page, which will be the bss
+	L4_Word_t fileTop = region_get_base(r) + region_get_filesize(r);
+
+	if (fileTop < page + PAGESIZE) {
+		L4_Word_t from = (fileTop > page) ? fileTop - page : 0;
+		dprintf(2, "*** finishSwapfile: zeroing from %p in page %p\n",
+				(void*) (page + from), (void*) page);
+		memset((char*) frame + from, 0x00, PAGESIZE - from);
+	}
+}
+
+static void finishReadahead(Process *p, PagerIOPage *page) {
+	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), page->vaddr);
+	Region *r;
+	CachedPage *cp;
+
+	// The page actually faulted on comes first for any free frames
+	if ((page->rval < 0) || (allocLimit <= 1) ||
+			(process_get_info(p)->size + 1 >= process_get_info(p)->rss_limit) ||
+			!(*entry & SWAP_MASK) ||
+			((*entry & ADDRESS_MASK) != page->diskAddr)) {
+		// Failed, or no longer wanted
+		dprintf(2, "*** finishReadahead: dropping %p\n", (void*) page->vaddr);
+		frame_free(page->frame);
+		return;
+	}
 
-		case REQUEST_ELFLOAD:
-			er = (ElfloadRequest *) pair->snd;
-			printf("stage=%d path=%s parent=%d child=%d\n",
-					er->stage, er->path, er->parent, er->child);
-			break;
+	if (*entry & FILE_MASK) {
+		finishSwapfile(p, page->vaddr, page->frame);
+	}
 
-		default:
-			assert(!"default");
+	r = list_find(process_get_regions(p), findRegion, (void*) page->vaddr);
+
+	// Make it resident but leave it unmapped and unreferenced, so that it
+	// is first in line to go again unless the process actually uses it
+	if (isCached(r)) {
+		cp = cacheLookup(region_get_cache(r), page->diskAddr);
+
+		if (cp == NULL) {
+			allocLimit--;
+			cp = cacheInsert(region_get_cache(r), page->diskAddr, page->frame);
+			frame_set_flags(page->frame, FRAME_PREFETCHED);
+		} else {
+			// Another process got there first
+			frame_free(page->frame);
+		}
+
+		cacheAttach(cp, p, page->vaddr);
+	} else {
+		allocLimit--;
+		process_get_info(p)->size++;
+		frame_set_owner(page->frame, process_get_pid(p), page->vaddr);
+		frame_set_backing(page->frame, page->diskAddr);
+		frame_set_refs(page->frame, 1);
+		frame_set_flags(page->frame, FRAME_PREFETCHED);
+
+		*entry &= ~(SWAP_MASK | ADDRESS_MASK);
+		*entry |= page->frame;
 	}
+
+	prepareDataOut(p, page->vaddr);
+
+	// Faulting on the next page after this is still sequential
+	lastSwapin[process_get_pid(p)] = page->vaddr;
+	stats.readahead_pages++;
 }
 
-static int pagerAction(PagerRequest *pr) {
+static void finishSwapin(PagerRequest *pr) {
+	dprintf(1, "*** finishSwapin\n");
 	Process *p;
-	L4_Word_t frame, *entry;
-
-	dprintf(2, "*** pagerAction: fault on ss=%d, addr=%p rights=%d\n",
-			L4_SpaceNo(L4_SenderSpace()), pr->addr, pr->rights);
+	L4_Word_t *entry, addr;
 
 	p = process_lookup(pr->pid);
-	if (p == NULL) {
-		// Process died
-		return 0;
-	}
 
-	// Find region it belongs in.
-	dprintf(3, "*** pagerAction: finding region\n");
-	Region *r = list_find(process_get_regions(p), findRegion, (void*) pr->addr);
+	if (pr->io.sf == defaultSwapfile) {
+		if (pr->io.memory) {
+			swapStats.hits++;
+			swapStats.hit_us += time_stamp() - pr->started;
+		} else {
+			swapStats.misses++;
+			swapStats.miss_us += time_stamp() - pr->started;
+		}
+	}
 
-	if (r == NULL) {
-		printf("Segmentation fault (%d on %p)\n",
-				process_get_pid(p), (void*) pr->addr);
-		processDelete(process_get_pid(p));
-		return 0;
+	if ((p == NULL) || (pr->io.pages[0].rval < 0)) {
+		for (int i = 1; i < pr->io.count; i++) {
+			frame_free(pr->io.pages[i].frame);
+		}
 	}
 
-	if ((region_get_rights(r) & pr->rights) == 0) {
-		printf("Permission fault (%d)\n", process_get_pid(p));
+	if (p == NULL) {
+		// Process died
+		abortRequest(pr);
+		return;
+	} else if (pr->io.pages[0].rval < 0) {
+		dprintf(0, "!!! finishSwapin: read failed (%d)\n", pr->io.pages[0].rval);
+		abortRequest(pr);
 		processDelete(process_get_pid(p));
-		return 0;
+		return;
 	}
 
-	// Place in, or retrieve from, page table.
-	dprintf(3, "*** pagerAction: finding entry\n");
-	entry = pagetableLookup(process_get_pagetable(p), pr->addr);
-	frame = *entry & ADDRESS_MASK;
-	dprintf(3, "*** pagerAction: entry %p found at %p\n", (void*) *entry, entry);
+	for (int i = 1; i < pr->io.count; i++) {
+		finishReadahead(p, &pr->io.pages[i]);
+	}
 
-	if (*entry & SWAP_MASK) {
-		// On disk, queue a swapin request
-		dprintf(2, "*** pagerAction: page is on disk (%p)\n", (void*) *entry);
-		queueRequest(REQUEST_SWAPIN, pr);
-		return 0;
-	} else if ((frame & ADDRESS_MASK) != 0) {
-		// Already appears in page table as a frame, just got unmapped
-		// (probably to update the refbit)
-		dprintf(3, "*** pagerAction: got unmapped\n");
-	} else if (region_map_directly(r)) {
-		// Wants to be mapped directly (code/data probably).
-		dprintf(3, "*** pagerAction: mapping directly\n");
-		frame = pr->addr & PAGEALIGN;
-	} else {
-		// Didn't appear in frame table so we need to allocate a new one.
-		// However there are potentially no free frames.
-		dprintf(3, "*** pagerAction: allocating frame\n");
+	// Either there is a frame free which we can immediately copy
+	// the fresh page in to, or there isn't in which case we need
+	// to swap something out first
+	addr = pr->addr & PAGEALIGN;
+	entry = pageEntry(p, addr);
 
-		frame = pagerFrameAlloc(p, pr->addr & PAGEALIGN);
-		assert((frame & ~ADDRESS_MASK) == 0); // no flags set
+	// In either case the page is no longer only on disk, although the
+	// copy there stays valid until the page is first written to
+	assert(*entry & SWAP_MASK);
 
-		if (frame == 0) {
-			dprintf(2, "*** pagerAction: no free frames\n");
-			queueRequest(REQUEST_SWAPIN, pr);
-			return 0;
-		}
+	if (*entry & FILE_MASK) {
+		finishSwapfile(p, addr, pr->pinned);
 	}
 
-	*entry = frame | REF_MASK;
+	pr->backing = *entry & ADDRESS_MASK;
+	*entry &= ~SWAP_MASK;
+	*entry &= ~ADDRESS_MASK;
 
-	dprintf(3, "*** pagerAction: mapping vaddr=%p pid=%d frame=%p rights=%d\n",
-			(void*) (pr->addr & PAGEALIGN), process_get_pid(p),
-			(void*) frame, region_get_rights(r));
-	mapPage(process_get_sid(p), pr->addr & PAGEALIGN, frame, region_get_rights(r));
+	if (canAlloc(pr, p)) {
+		// Pager is guaranteed to find a page
+		pagerAction(pr);
+		L4_Word_t frame = *entry & ADDRESS_MASK;
 
-	return 1;
-}
+		// Copy data from pinned frame to newly allocated frame
+		memcpy((void*) frame, (void*) pr->pinned, PAGESIZE);
 
-static void pager(PagerRequest *pr) {
-	if (pagerAction(pr)) {
-		pr->callback(pr);
+		// Fix caches
+		prepareDataOut(p, addr);
 
-		// This very rarely happens unless frames are being freed very quickly -
-		// for example, in a fork bomb
-		if (!list_null(requests) && !requestActive) {
-			startRequest();
-		}
+		finishRequest(pr);
+		pr->callback(pr);
 	} else {
-		dprintf(3, "*** pager: pagerAction stalled\n");
+		// Need to swap something out before being able to continue -
+		// the swapout will deal with the pinned frame etc
+		startSwapout(pr);
 	}
 }
 
-static void finishElfload(int rval) {
-	assert(requestsPeekType() == REQUEST_ELFLOAD);
-	ElfloadRequest *er = (ElfloadRequest *) requestsPeek();
-	L4_ThreadId_t replyTo = process_get_tid(process_lookup(er->parent));
+static int readaheadWindow(pid_t pid, L4_Word_t addr) {
+	int window = readAhead[pid];
 
-	free(er->fdout);
-	free(er->fderr);
-	free(er->fdin);
-	free(er);
-	syscall_reply(replyTo, rval);
-	dequeueRequest();
-}
+	if (addr == lastSwapin[pid] + PAGESIZE) {
+		// Sequential, read further ahead
+		window = max(1, window * 2);
+		window = min(window, PAGER_CLUSTER - 1);
+	} else {
+		window /= 2;
+	}
 
-static void setRegionOnElf(Process *p, Region *r, L4_Word_t addr) {
-	assert((addr & ~PAGEALIGN) == 0);
-	L4_Word_t *entry;
-	L4_Word_t base = region_get_base(r);
+	readAhead[pid] = window;
+	lastSwapin[pid] = addr;
 
-	for (int size = 0; size < region_get_size(r); size += PAGESIZE) {
-		entry = pagetableLookup(process_get_pagetable(p), base + size);
-		*entry = (addr + size) | SWAP_MASK | ELF_MASK;
-	}
+	return window;
 }
 
-static char *wordAlign(char *s) {
-	unsigned int x = (unsigned int) s;
-	x--;
-	x += sizeof(L4_Word_t) - (x % sizeof(L4_Word_t));
-	return (char*) x;
-}
+static void startReadahead(PagerRequest *pr, Process *p, Region *r,
+		L4_Word_t *entry) {
+	int window = readaheadWindow(process_get_pid(p), pr->addr & PAGEALIGN);
+	L4_Word_t addr = pr->addr & PAGEALIGN;
+	L4_Word_t *next, frame;
+
+	// Read the following pages of the region in to free frames at the same
+	// time, as long as they are on disk in the same file and there are
+	// frames to spare
+	for (int i = 0; i < window; i++) {
+		addr += PAGESIZE;
+
+		if ((addr >= region_get_base(r) + region_get_size(r)) ||
+				(allocLimit - pr->io.count <= FRAME_DOOMSDAY_THRESHHOLD) ||
+				(process_get_info(p)->size + pr->io.count >=
+				 process_get_info(p)->rss_limit)) {
+			break;
+		}
 
-static void continueElfload(int vfsRval) {
-	ElfloadRequest *er = (ElfloadRequest *) requestsPeek();
-	struct Elf32_Header *header;
-	char *buf;
-	stat_t *elfStat;
-	Process *p;
+		next = pagetableLookup(process_get_pagetable(p), addr);
 
-	switch (er->stage) {
-		case ELFLOAD_OPEN:
-			dprintf(2, "ELFLOAD_OPEN\n");
-			if (vfsRval < 0) {
-				dprintf(1, "*** continueElfload: failed to open\n");
-				finishElfload(-1);
-			} else {
-				er->fd = vfsRval;
-				copyInOutData[L4_ThreadNo(sos_my_tid())] = 0;
-				strncpy(pager_buffer(sos_my_tid()), er->path, MAX_FILE_NAME);
-				statNonblocking();
-			}
+		if (!(*next & SWAP_MASK) || ((*next & FILE_MASK) != (*entry & FILE_MASK)) ||
+				pageInFlight(process_get_pid(p), addr)) {
+			break;
+		}
 
-			er->stage++;
+		// The swap file's copy of a compressed page is stale (if there
+		// is one at all)
+		if (!(*next & FILE_MASK) && zswap_contains(*next & ADDRESS_MASK)) {
 			break;
+		}
 
-		case ELFLOAD_CHECK_EXEC:
-			assert(vfsRval == 0);
+		// Nor is there any need to read a page that is already cached
+		if (isCached(r) && (cacheLookup(region_get_cache(r),
+						*next & ADDRESS_MASK) != NULL)) {
+			break;
+		}
 
-			buf = pager_buffer(sos_my_tid());
-			elfStat = (stat_t*) wordAlign(buf + strlen(buf) + 1);
+		if ((frame = frame_alloc(FA_SWAPPIN)) == 0) {
+			break;
+		}
 
-			if (!(elfStat->st_fmode & FM_EXEC)) {
-				dprintf(1, "*** continueElfload: not executable\n");
-				finishElfload(-1);
-			} else {
-				readNonblocking(er->fd, IO_MAX_BUFFER);
-				er->stage++;
-			}
+		addIO(pr, addr, frame, *next & ADDRESS_MASK, PAGESIZE);
+	}
 
-			break;
+	dprintf(2, "*** startReadahead: window %d, reading %d\n",
+			window, pr->io.count - 1);
+}
 
-		case ELFLOAD_READ_HEADER:
-			dprintf(2, "ELFLOAD_READ_HEADER\n");
-			header = (struct Elf32_Header*) pager_buffer(sos_my_tid());
+static void startSwapin(PagerRequest *pr) {
+	dprintf(2, "*** startSwapin\n");
+	Process *p;
+	Region *r;
+	Swapfile *sf;
+	L4_Word_t *entry;
 
-			if (elf32_checkFile(header) != 0) {
-				dprintf(1, "*** continueElfload: not an ELF file\n");
-				finishElfload(-1);
-			} else {
-				p = process_init(PS_TYPE_PROCESS);
-
-				for (int i = 0; i < elf32_getNumProgramHeaders(header); i++) {
-					Region *r = region_alloc(
-							REGION_OTHER,
-							elf32_getProgramHeaderVaddr(header, i),
-							elf32_getProgramHeaderMemorySize(header, i),
-							elf32_getProgramHeaderFlags(header, i), 0);
-					region_set_elffile(r, swapfile_init(er->path));
-					region_set_filesize(r, elf32_getProgramHeaderFileSize(
-								header, i));
-					process_add_region(p, r);
-					setRegionOnElf(p, r,
-							elf32_getProgramHeaderOffset(header, i) & PAGEALIGN);
-				}
+	// pin a frame to copy in to (although "pinned" is somewhat of a misnomer
+	// since really it's just a temporary frame and nothing is really pinned)
+	pr->pinned = frame_alloc(FA_SWAPPIN);
 
-				process_set_name(p, er->path);
-				process_get_info(p)->pid = er->child;
-				process_prepare2(p, er->fdout, er->fderr, er->fdin);
-				process_set_ip(p, (void*) elf32_getEntryPoint(header));
+	p = process_lookup(pr->pid);
+	entry = pageEntry(p, pr->addr);
 
-				process_run(p, YES_TIMESTAMP);
-				assert(er->child == process_get_pid(p));
-				closeNonblocking(er->fd);
-			}
+	r = list_find(process_get_regions(p), findRegion, (void*) pr->addr);
+	assert(r != NULL);
 
-			er->stage++;
-			break;
+	if (*entry & FILE_MASK) {
+		// It is in the region's file (ELF or mapped), need to read from that
+		sf = region_get_file(r);
+		assert(sf != NULL);
+	} else {
+		// It is the default swapfile
+		sf = defaultSwapfile;
+	}
 
-		case ELFLOAD_CLOSE:
-			dprintf(2, "ELFLOAD_CLOSE\n");
-			finishElfload(er->child);
-			break;
+	pr->stage = PR_SWAPIN;
+	pr->started = time_stamp();
+	prepareIO(pr, IO_READ, sf, pageOwner(p, pr->addr));
+	addIO(pr, pr->addr & PAGEALIGN, pr->pinned, *entry & ADDRESS_MASK, PAGESIZE);
+
+	if ((sf == defaultSwapfile) &&
+			zswap_load(*entry & ADDRESS_MASK, pr->pinned)) {
+		// Kept compressed, so there is nothing to read
+		dprintf(2, "*** startSwapin: %p from memory\n", (void*) pr->addr);
+		pr->io.memory = 1;
+		finishIO(pr);
+		return;
+	}
 
-		default:
-			assert(!"continueElfload");
+	// Read-ahead is only for the process's own pages
+	if (pr->io.pid == pr->pid) {
+		startReadahead(pr, p, r, entry);
 	}
+
+	startIO(pr);
 }
 
-static void startElfload(void) {
-	assert(requestsPeekType() == REQUEST_ELFLOAD);
+/*
+static void printRegion(void *contents, void *data) {
+	Region *r = (Region*) contents;
 
-	// Open the file and let the continuation take over
-	ElfloadRequest *er = (ElfloadRequest *) requestsPeek();
-	strncpy(pager_buffer(sos_my_tid()), er->path, MAX_FILE_NAME);
-	openNonblocking(NULL, FM_READ);
+	printf("*** region %p -> %p (%p) rights=%d\n",
+			(void*) region_get_base(r),
+			(void*) (region_get_base(r) + region_get_size(r)),
+			(void*) r, region_get_rights(r));
+}
+*/
+
+static int canCluster(Process *p, Region *r, L4_Word_t vaddr) {
+	L4_Word_t *entry, frame;
+
+	if ((vaddr < region_get_base(r)) ||
+			(vaddr >= region_get_base(r) + region_get_size(r))) {
+		return 0;
+	}
+
+	entry = pagetableLookup(process_get_pagetable(p), vaddr);
+	frame = *entry & ADDRESS_MASK;
+
+	// Resident, belonging to the process, dirty, and not recently used
+	return !(*entry & SWAP_MASK) && (frame != 0) &&
+		(frame_get_pid(frame) == process_get_pid(p)) &&
+		(frame_get_vaddr(frame) == vaddr) &&
+		((frame_get_flags(frame) & (FRAME_REF | FRAME_PINNED | FRAME_DIRTY))
+		 == FRAME_DIRTY);
 }
 
-static void dequeueRequest(void) {
-	dprintf(1, "*** dequeueRequest\n");
+static void startSharedSwapout(PagerRequest *pr, L4_Word_t frame) {
+	SharedPage *sp = sharedLookup(frame_get_vaddr(frame));
+	assert(sp != NULL);
+	assert(sp->entry == frame);
 
-	assert(requestActive);
-	requestActive = 0;
+	// Taken away from everybody at once
+	sharedUnmap(sp);
+	please(CACHE_FLUSH_RANGE_INVALIDATE(L4_rootspace, frame, frame + PAGESIZE));
 
-	pair_free(list_unshift(requests));
+	dprintf(1, "*** startSharedSwapout: addr=%p shared by %d was %p\n",
+			(void*) sp->vaddr, frame_get_refs(frame), (void*) frame);
 
-	if (list_null(requests)) {
-		dprintf(1, "*** dequeueRequest: no more items\n");
-	} else {
-		dprintf(1, "*** dequeueRequest: running next\n");
-		if (verbose > 1) list_iterate(requests, printRequests, NULL);
-		startRequest();
+	if (pr->pid != NIL_PID) {
+		stats.fault_evictions++;
+	}
+
+	if (!(frame_get_flags(frame) & FRAME_DIRTY) &&
+			(frame_get_backing(frame) != ADDRESS_NONE)) {
+		if (pr->pid == NIL_PID) stats.cleaner_drops++;
+
+		sp->entry = SWAP_MASK | frame_get_backing(frame);
+		pagerFrameFree(NULL, frame);
+		swapoutDone(pr);
+		return;
 	}
+
+	// Shared pages are written on their own, since their neighbours needn't
+	// be shared by the same processes
+	L4_Word_t diskAddr = swapslot_alloc(defaultSwapfile);
+	assert(diskAddr != ADDRESS_NONE);
+
+	if (pr->pid == NIL_PID) stats.cleaner_writes++;
+	stats.swapout_clusters++;
+	stats.swapout_pages++;
+
+	frame_set_flags(frame, FRAME_PINNED);
+	sp->entry = SWAP_MASK | diskAddr;
+
+	pr->stage = PR_SWAPOUT;
+	prepareIO(pr, IO_WRITE, defaultSwapfile, SHARED_PID);
+	addIO(pr, sp->vaddr, frame, diskAddr, PAGESIZE);
+	startIO(pr);
 }
 
-static void queueRequest(rtype_t rtype, void *request) {
-	dprintf(1, "*** queueRequest\n");
+static void startCachedSwapout(PagerRequest *pr, L4_Word_t frame) {
+	CachedPage *cp = cacheLookup(frame_get_vaddr(frame),
+			frame_get_backing(frame));
+	assert(cp != NULL);
+
+	dprintf(1, "*** startCachedSwapout: %p in file %p mapped by %d was %p\n",
+			(void*) cp->offset, (void*) cp->file, frame_get_refs(frame),
+			(void*) frame);
+
+	if (frame_get_flags(frame) & FRAME_PREFETCHED) {
+		stats.readahead_wasted++;
+	}
 
-	if (list_null(requests)) {
-		dprintf(2, "*** queueRequest: list null, running request\n");
-		assert(!requestActive);
-		list_push(requests, pair_alloc(rtype, (L4_Word_t) request));
-		startRequest();
+	if (pr->pid == NIL_PID) {
+		stats.cleaner_drops++;
 	} else {
-		dprintf(2, "*** queueRequest: queueing request\n");
-		if (verbose > 1) list_iterate(requests, printRequests, NULL);
-		assert(requestActive);
-		list_push(requests, pair_alloc(rtype, (L4_Word_t) request));
+		stats.fault_evictions++;
 	}
+
+	// Never written to, so taking it away from everybody is all there is
+	list_iterate(cp->mappers, mapperUnmap, cp);
+	cacheFree(cp);
+	swapoutDone(pr);
 }
 
-static void finishSwapout(void) {
-	dprintf(1, "*** finishSwapout\n");
+static void startSwapout(PagerRequest *pr) {
+	dprintf(2, "*** startSwapout\n");
 
 	Process *p;
-	PagerRequest *swapin, *swapout;
-	L4_Word_t *entry, frame;
+	Region *r;
+	Swapfile *sf;
+	L4_Word_t *entry, frame, vaddr, diskAddr, pageAddr;
+
+	// Choose the next page to swap out, one of the process's own if it is
+	// at its limit
+	faultClass(pr, FAULT_SWAPOUT);
+	p = (pr->pid == NIL_PID) ? NULL : process_lookup(pr->pid);
+	frame = chooseVictim(((p != NULL) && !belowLimit(p)) ? pr->pid : NIL_PID);
+
+	if (frame_get_pid(frame) == SHARED_PID) {
+		startSharedSwapout(pr, frame);
+		return;
+	} else if (frame_get_pid(frame) == CACHE_PID) {
+		startCachedSwapout(pr, frame);
+		return;
+	}
+
+	vaddr = frame_get_vaddr(frame);
+	p = process_lookup(frame_get_pid(frame));
+	assert(p != NULL);
 
-	// Done with the swapout
-	assert(requestsPeekType() == REQUEST_SWAPOUT);
-	swapout = (PagerRequest*) requestsUnshift();
+	entry = pagetableLookup(process_get_pagetable(p), vaddr);
+	assert((*entry & ADDRESS_MASK) == frame);
 
-	pagerFrameFree(process_lookup(swapout->pid), swapout->addr);
-	free(swapout);
+	// Need the region for finding the swap file
+	r = list_find(process_get_regions(p), findPaRegion, (void*) vaddr);
+	//list_iterate(process_get_regions(p), printRegion, NULL);
+	//printf(" --- %p\n", (void*) vaddr);
+	assert(r != NULL);
 
-	// Either the swapout was just for a free frame, or it was for
-	// a frame with existing contents
-	assert(requestsPeekType() == REQUEST_SWAPIN);
-	swapin = (PagerRequest*) requestsPeek();
+	// The page is no longer backed
+	assert((vaddr & ~PAGEALIGN) == 0);
+	pageUnmap(p, vaddr);
 
-	p = process_lookup(swapin->pid);
-	if (p == NULL) {
-		// Process died
-		swapin->callback(swapin);
-		dequeueRequest();
+	dprintf(1, "*** startSwapout: addr=%p for pid=%d was %p\n",
+			(void*) vaddr, process_get_pid(p), (void*) frame);
+
+	if (frame_get_flags(frame) & FRAME_PREFETCHED) {
+		// Read ahead for nothing, so don't read so far next time
+		stats.readahead_wasted++;
+		readAhead[process_get_pid(p)] /= 2;
 	}
 
-	// Pager is now guaranteed to find a page (note that the pager
-	// action has been separated, we reply later)
-	pagerAction(swapin);
+	if (!(frame_get_flags(frame) & FRAME_DIRTY) &&
+			(frame_get_backing(frame) != ADDRESS_NONE)) {
+		// Clean and the copy on disk is still good, so just drop it
+		dprintf(1, "*** startSwapout: clean, dropping\n");
 
-	entry = pagetableLookup(process_get_pagetable(p), swapin->addr);
-	frame = *entry & ADDRESS_MASK;
+		if (pr->pid == NIL_PID) {
+			stats.cleaner_drops++;
+		} else {
+			stats.fault_evictions++;
+		}
 
-	if (pinnedFrame != 0) {
-		// There is contents we need to copy across
-		dprintf(2, "*** finishSwapout: pinned frame is %p\n", pinnedFrame);
-		memcpy((char*) frame, (void*) pinnedFrame, PAGESIZE);
-		frame_free(pinnedFrame);
-		pinnedFrame = 0;
-	} else {
-		// Zero the frame for debugging, but it may be a good idea anyway
-		dprintf(2, "*** zeroing frame %p\n", (void*) frame);
-		memset((char*) frame, 0x00, PAGESIZE);
+		*entry &= ~ADDRESS_MASK;
+		*entry |= SWAP_MASK | frame_get_backing(frame);
+
+		pagerFrameFree(p, frame);
+		swapoutDone(pr);
+		return;
 	}
 
-	dprintf(2, "*** finishSwapout: addr=%p for pid=%d now %p\n",
-			(void*) swapin->addr, process_get_pid(p), (void*) frame);
+	// Write out dirty neighbours of the victim that haven't been used
+	// lately at the same time, in to slots next to each other
+	L4_Word_t first = vaddr;
+	int count = 1;
 
-	prepareDataOut(p, swapin->addr & PAGEALIGN);
-	swapin->callback(swapin);
-	dequeueRequest();
-}
+	while ((count < PAGER_CLUSTER) &&
+			canCluster(p, r, first + count * PAGESIZE)) {
+		count++;
+	}
 
-static void finishSwapin(void) {
-	dprintf(1, "*** finishSwapin\n");
-	Process *p;
-	PagerRequest *request;
-	Pair args; // (pid, word)
-	L4_Word_t *entry, addr;
+	while ((count < PAGER_CLUSTER) && canCluster(p, r, first - PAGESIZE)) {
+		first -= PAGESIZE;
+		count++;
+	}
 
-	assert(requestsPeekType() == REQUEST_SWAPIN);
-	request = (PagerRequest*) requestsPeek();
-	p = process_lookup(request->pid);
+	// Set up where on disk to put the pages.  Pages of a writable mapping
+	// go back to where they are in the file, anything else to swap slots
+	// which are only recorded against the process once the write has
+	// finished
+	if (writesBack(r)) {
+		sf = region_get_file(r);
+		diskAddr = frame_get_backing(frame);
+	} else {
+		sf = defaultSwapfile;
+		diskAddr = swapslot_alloc_run(defaultSwapfile, count);
+
+		if (diskAddr == ADDRESS_NONE) {
+			// No room for them together, just write the victim
+			first = vaddr;
+			count = 1;
+			diskAddr = swapslot_alloc(defaultSwapfile);
+		}
+	}
 
-	if (p == NULL) {
-		// Process died
-		frame_free(pinnedFrame);
-		pinnedFrame = 0;
-		request->callback(request);
-		dequeueRequest();
+	assert(diskAddr != ADDRESS_NONE);
+	assert((diskAddr & ~PAGEALIGN) == 0);
+	dprintf(1, "*** startSwapout: %d pages from %p to 0x%08lx\n",
+			count, (void*) first, diskAddr);
+
+	if (pr->pid == NIL_PID) {
+		stats.cleaner_writes += count;
+	} else {
+		stats.fault_evictions += count;
 	}
 
-	// Either there is a frame free which we can immediately copy
-	// the fresh page in to, or there isn't in which case we need
-	// to swap something out first
-	addr = request->addr & PAGEALIGN;
-	entry = pagetableLookup(process_get_pagetable(p), addr);
+	stats.swapout_clusters++;
+	stats.swapout_pages += count;
 
-	// In either case the page is no longer on disk
-	assert(*entry & SWAP_MASK);
+	pr->stage = PR_SWAPOUT;
+	prepareIO(pr, IO_WRITE, sf, process_get_pid(p));
 
-	args = PAIR(process_get_pid(p), *entry & ADDRESS_MASK);
-	list_delete(swapped, pagerSwapslotFree, &args);
-	*entry &= ~SWAP_MASK;
-	*entry &= ~ADDRESS_MASK;
+	for (int i = 0; i < count; i++) {
+		vaddr = first + i * PAGESIZE;
+		entry = pagetableLookup(process_get_pagetable(p), vaddr);
+		frame = *entry & ADDRESS_MASK;
 
-	if (allocLimit > 0) {
-		// Pager is guaranteed to find a page
-		pagerAction(request);
-		L4_Word_t frame = *entry & ADDRESS_MASK;
+		// Make sure the frame reflects what is stored in the frame, and
+		// keep the clock hand away from it until the write has finished
+		pageUnmap(p, vaddr);
+		prepareDataIn(p, vaddr);
+		frame_set_flags(frame, FRAME_PINNED);
 
-		// Copy data from pinned frame to newly allocated frame
-		memcpy((void*) frame, (void*) pinnedFrame, PAGESIZE);
+		if (sf == defaultSwapfile) {
+			pageAddr = diskAddr + i * PAGESIZE;
+			*entry &= ~FILE_MASK;
+		} else {
+			pageAddr = frame_get_backing(frame);
+		}
 
-		// Fix caches
-		prepareDataOut(p, addr);
+		*entry |= SWAP_MASK;
+		*entry &= ~ADDRESS_MASK;
+		*entry |= pageAddr;
 
-		frame_free(pinnedFrame);
-		pinnedFrame = 0;
-		request->callback(request);
-		dequeueRequest();
-	} else {
-		// Need to swap something out before being able to continue -
-		// the swapout process will deal with the pinned frame etc
-		startSwapout();
+		addIO(pr, vaddr, frame, pageAddr,
+				(sf == defaultSwapfile) ? PAGESIZE : fileBytes(r, vaddr));
 	}
+
+	startIO(pr);
 }
 
-static void finishSwapelf(void) {
-	PagerRequest *pr = (PagerRequest*) requestsPeek();
-	Process *p = process_lookup(pr->pid);
-	Region *r = list_find(process_get_regions(p), findRegion, (void*) pr->addr);
-	L4_Word_t *entry = pagetableLookup(process_get_pagetable(p), pr->addr);
+static void nextWriteback(PagerRequest *pr) {
+	PagerIOPage *page;
 
-	// Zero the area between the end of memory (i.e. the end of the region) and
-	// the end of the file (i.e. region_get_filesize)
-	L4_Word_t fileTop = region_get_base(r) + region_get_filesize(r);
+	pr->stage = PR_WRITEBACK;
+	prepareIO(pr, IO_WRITE, pr->file, NIL_PID);
 
-	if ((fileTop & PAGEALIGN) == (pr->addr & PAGEALIGN)) {
-		dprintf(2, "*** finishSwapelf: zeroing from %p because of addr %p\n",
-				(void*) fileTop, (void*) pr->addr);
-		assert(region_get_size(r) >= region_get_filesize(r));
-		memset((char*) pinnedFrame + (fileTop % PAGESIZE), 0x00,
-				region_get_size(r) - region_get_filesize(r));
+	while (!list_null(pr->writeback) && (pr->io.count < PAGER_CLUSTER)) {
+		page = (PagerIOPage*) list_unshift(pr->writeback);
+		addIO(pr, page->vaddr, page->frame, page->diskAddr, page->size);
+		free(page);
 	}
 
-	// Page no longer on ELF file.  Yay.
-	*entry &= ~ELF_MASK;
-
-	// I'm 99.99% sure it's ok to do this without any other magic
-	finishSwapin();
+	startIO(pr);
 }
 
-static void continueSwapin(int vfsRval) {
-	PagerRequest *pr = (PagerRequest*) requestsPeek();
-
-	switch (pr->stage) {
-		case SWAPIN_OPEN: 
-			swapfile_set_fd(pr->sf, vfsRval);
+static void startWriteback(PagerRequest *pr) {
+	dprintf(1, "*** startWriteback: pid=%d addr=%p\n",
+			pr->pid, (void*) pr->addr);
 
-			L4_Word_t *entry = pagetableLookup(
-					process_get_pagetable(process_lookup(pr->pid)),
-					pr->addr & ADDRESS_MASK);
+	// Like any other request the worker is kept until it is finished
+	assert(pr->worker == NULL);
+	pr->worker = findIdleWorker();
+	assert(pr->worker != NULL);
+	pr->worker->pr = pr;
 
-			lseekNonblocking(swapfile_get_fd(pr->sf),
-					*entry & ADDRESS_MASK, SEEK_SET);
-			pr->offset = 0;
+	nextWriteback(pr);
+}
 
-			pr->stage++;
-			break;
+static void finishWriteback(PagerRequest *pr) {
+	dprintf(1, "*** finishWriteback: %d pages\n", pr->io.count);
+	PagerIOPage *page;
 
-		case SWAPIN_LSEEK:
-			readNonblocking(swapfile_get_fd(pr->sf),
-					min(IO_MAX_BUFFER, pr->size - pr->offset));
-			pr->stage++;
-			break;
+	// Nothing can be done about a failed write, the process is gone
+	for (int i = 0; i < pr->io.count; i++) {
+		page = &pr->io.pages[i];
 
-		case SWAPIN_READ:
-			assert(vfsRval > 0);
-			assert(pr->offset <= PAGESIZE);
+		if (page->rval < 0) {
+			dprintf(0, "!!! finishWriteback: write to %p failed (%d)\n",
+					(void*) page->diskAddr, page->rval);
+		}
 
-			memcpy(((char*) pinnedFrame) + pr->offset,
-					pager_buffer(virtualPager), vfsRval);
-			pr->offset += vfsRval;
-			assert(pr->offset <= pr->size);
+		pagerFrameFree(NULL, page->frame);
+	}
 
-			if (pr->offset == pr->size) {
-				swapfile_close(pr->sf);
-				pr->stage++;
-			} else {
-				readNonblocking(swapfile_get_fd(pr->sf),
-						min(IO_MAX_BUFFER, pr->size - pr->offset));
-			}
+	if (!list_null(pr->writeback)) {
+		nextWriteback(pr);
+		return;
+	}
 
-			break;
+	list_destroy(pr->writeback);
+	swapfile_free(pr->file);
+	finishRequest(pr);
+	pr->callback(pr);
+}
 
-		case SWAPIN_CLOSE:
-			pr->swapinFinish();
-			break;
+static void startPagerRequest(PagerRequest *pr) {
+	dprintf(1, "*** startPagerRequest\n");
+	Process *p = process_lookup(pr->pid);
 
-		default:
-			assert(!"default");
+	if (p == NULL) {
+		// Process died while waiting
+		abortRequest(pr);
+		return;
 	}
-}
 
-static void continueSwapout(int vfsRval) {
-	PagerRequest *pr = (PagerRequest*) requestsPeek();
-	assert(pr->offset <= PAGESIZE);
+	// Each request keeps the same worker until it is finished
+	assert(pr->worker == NULL);
+	pr->worker = findIdleWorker();
+	assert(pr->worker != NULL);
+	pr->worker->pr = pr;
 
-	switch (pr->stage) {
-		case SWAPOUT_OPEN:
-			swapfile_set_fd(pr->sf, vfsRval);
-			pr->offset = 0;
+	L4_Word_t *entry = pageEntry(p, pr->addr);
 
-			lseekNonblocking(swapfile_get_fd(pr->sf), pr->diskAddr, SEEK_SET);
+	if (*entry & SWAP_MASK) {
+		// At the very least a page needs to be swapped in first
+		startSwapin(pr);
+		// Afterwards, may have to swap something out
+	} else if (canAlloc(pr, p)) {
+		// In the meantime a frame has become free
+		finishRequest(pr);
+		pager(pr);
+	} else {
+		// Needed to swap something out
+		startSwapout(pr);
+	}
+}
 
-			pr->stage++;
+static void finishIO(PagerRequest *pr) {
+	switch (pr->stage) {
+		case PR_SWAPIN:
+			finishSwapin(pr);
 			break;
 
-		case SWAPOUT_WRITE:
-			assert(pr->offset <= pr->size);
-
-			if (pr->offset == pr->size) {
-				swapfile_close(pr->sf);
-				pr->stage++;
-			} else {
-				int size = min(IO_MAX_BUFFER, pr->size - pr->offset);
-				memcpy(pager_buffer(sos_my_tid()),
-						(void*) (pr->addr + pr->offset), size);
-				writeNonblocking(swapfile_get_fd(pr->sf), size);
-				pr->offset += size;
-			}
-
+		case PR_SWAPOUT:
+			finishSwapout(pr);
 			break;
 
-		case SWAPOUT_CLOSE:
-			finishSwapout();
+		case PR_WRITEBACK:
+			finishWriteback(pr);
 			break;
 
 		default:
@@ -1048,183 +3438,180 @@ static void continueSwapout(int vfsRval) {
 	}
 }
 
-static void startSwapin(void) {
-	dprintf(2, "*** startSwapin\n");
-	Process *p;
-	PagerRequest *pr;
-	Region *r;
-	L4_Word_t *entry;
-
-	// pin a frame to copy in to (although "pinned" is somewhat of a misnomer
-	// since really it's just a temporary frame and nothing is really pinned)
-	pinnedFrame = frame_alloc(FA_SWAPPIN);
+static void workerDone(int id, int rval) {
+	dprintf(2, "*** workerDone: worker %d rval=%d\n", id, rval);
+	assert(id >= 0 && id < PAGER_IO_DEPTH);
 
-	// kick-start the chain of NFS requests and callbacks by opening swapfile
-	assert(requestsPeekType() == REQUEST_SWAPIN);
-	pr = requestsPeek();
-	p = process_lookup(pr->pid);
-	entry = pagetableLookup(process_get_pagetable(p), pr->addr);
+	PagerWorker *w = &workers[id];
+	PagerRequest *pr = w->pr;
+	Swapfile *sf;
+	w->ready = 1;
 
-	r = list_find(process_get_regions(p), findRegion, (void*) pr->addr);
-	assert(r != NULL);
+	// Otherwise the worker has just started
+	if (pr != NULL) {
+		sf = pr->io.sf;
+		finishIO(pr);
 
-	if (*entry & ELF_MASK) {
-		// It is on an ELF file, need to read from that
-		assert(pr->sf != NULL);
-		pr->sf = region_get_elffile(r);
-		pr->swapinFinish = finishSwapelf;
-	} else {
-		// It is the default swapfile
-		pr->sf = defaultSwapfile;
-		pr->swapinFinish = finishSwapin;
+		// Taken in startIO
+		swapfile_free(sf);
 	}
 
-	pr->size = PAGESIZE;
-	pr->stage = SWAPIN_OPEN;
-	swapfile_open(pr->sf, FM_READ);
+	runRequests();
 }
 
-/*
-static void printRegion(void *contents, void *data) {
-	Region *r = (Region*) contents;
+static int workerPage(PagerIO *io, PagerIOPage *page, fildes_t fd,
+		L4_Word_t owner) {
+	int rval;
 
-	printf("*** region %p -> %p (%p) rights=%d\n",
-			(void*) region_get_base(r),
-			(void*) (region_get_base(r) + region_get_size(r)),
-			(void*) r, region_get_rights(r));
-}
-*/
+	// The whole page is one request, straight in to or out of the frame
+	if (io->op == IO_READ) {
+		rval = ipc_send_simple(L4_rootserver, PSOS_READ, SOS_IPC_CALL, 5,
+				fd, page->diskAddr, PAGESIZE, owner, page->frame);
 
-static void startSwapout(void) {
-	dprintf(2, "*** startSwapout\n");
+		if (rval == SOS_VFS_EOF) rval = 0;
 
-	Process *p;
-	PagerRequest *swapoutPr;
-	Region *r;
-	Swapfile *sf;
-	Pair *swapout; // (pid, word)
-	L4_Word_t *entry, frame;
+		if (rval >= 0 && rval < PAGESIZE) {
+			// Past the end of the file (e.g. ELF bss)
+			memset((char*) page->frame + rval, 0x00, PAGESIZE - rval);
+			rval = PAGESIZE;
+		}
+	} else if (page->size > 0) {
+		rval = ipc_send_simple(L4_rootserver, PSOS_WRITE, SOS_IPC_CALL, 5, fd,
+				(page->evicted != ADDRESS_NONE) ? page->evicted : page->diskAddr,
+				page->size, owner, page->frame);
+	} else {
+		// Past the end of a mapped file (so there is nowhere for it to go),
+		// or kept in the compressed store
+		rval = 0;
+	}
 
-	// Choose the next page to swap out
-	swapout = deleteAllocList();
-	p = process_lookup(swapout->fst);
-	assert(p != NULL);
+	if (rval == page->size) {
+		return 0;
+	} else {
+		return (rval < 0) ? rval : SOS_VFS_ERROR;
+	}
+}
 
-	entry = pagetableLookup(process_get_pagetable(p), swapout->snd);
-	frame = *entry & ADDRESS_MASK;
+static int workerIO(PagerIO *io) {
+	L4_Word_t owner;
+	fildes_t fd;
 
-	// Need the region for finding the swap file
-	r = list_find(process_get_regions(p), findPaRegion, (void*) swapout->snd);
-	//list_iterate(process_get_regions(p), printRegion, NULL);
-	//printf(" --- %p\n", (void*) swapout->snd);
-	assert(r != NULL);
-	sf = defaultSwapfile;
+	if (swapfile_is_open(io->sf)) {
+		// Kept open by the pager
+		fd = swapfile_get_fd(io->sf);
+		owner = L4_ThreadNo(virtualPager);
+	} else {
+		// Other files (ELF or mapped) are opened for each batch
+		fd = swapfile_open(io->sf, (io->op == IO_READ) ? FM_READ : FM_WRITE);
+		owner = L4_ThreadNo(sos_my_tid());
 
-	// Make sure the frame reflects what is stored in the frame
-	assert((swapout->snd & ~PAGEALIGN) == 0);
-	prepareDataIn(p, swapout->snd);
+		if (fd < 0) {
+			for (int i = 0; i < io->count; i++) io->pages[i].rval = fd;
+			return fd;
+		}
+	}
 
-	// The page is no longer backed
-	unmapPage(process_get_sid(p), swapout->snd);
+	// The pages are done back to back, which for a cluster means the
+	// writes are to consecutive slots
+	for (int i = 0; i < io->count; i++) {
+		io->pages[i].rval = workerPage(io, &io->pages[i], fd, owner);
+	}
 
-	dprintf(1, "*** startSwapout: addr=%p for pid=%d was %p\n",
-			(void*) swapout->snd, process_get_pid(p), (void*) frame);
+	if (!swapfile_is_open(io->sf)) {
+		swapfile_close(io->sf, fd);
+	}
 
-	// Set up the swapout
-	swapoutPr = allocPagerRequest(swapout->fst, frame, FM_READ, sf, NULL);
-	list_shift(requests, pair_alloc(REQUEST_SWAPOUT, (L4_Word_t) swapoutPr));
+	return io->pages[0].rval;
+}
 
-	// Set up where on disk to put the page
-	L4_Word_t diskAddr = pagerSwapslotAlloc(p);
-	assert((diskAddr & ~PAGEALIGN) == 0);
-	dprintf(1, "*** startSwapout: swapslot is 0x%08lx\n", diskAddr);
+static void pagerWorker(void) {
+	L4_Accept(L4_AddAcceptor(L4_UntypedWordsAcceptor, L4_NotifyMsgAcceptor));
 
-	*entry |= SWAP_MASK;
-	*entry &= ~ADDRESS_MASK;
-	*entry |= diskAddr;
+	// Find out which worker this is - the pager sets this up before we
+	// get the chance to run since it has a higher priority
+	int id = 0, rval = 0;
+	while (L4_ThreadNo(workers[id].tid) != L4_ThreadNo(sos_my_tid())) id++;
+	dprintf(1, "*** pagerWorker: started worker %d\n", id);
 
-	// We open the swapfile on each swapout
-	swapoutPr->diskAddr = diskAddr;
-	swapoutPr->stage = SWAPOUT_OPEN;
-	swapoutPr->size = PAGESIZE;
-	swapfile_open(sf, FM_WRITE);
-	pair_free(swapout);
+	for (;;) {
+		// Report on the last job and wait for the next one
+		ipc_send_simple_2(virtualPager, PSOS_PAGER_IO, SOS_IPC_CALL, id, rval);
+		rval = workerIO(&workers[id].pr->io);
+	}
 }
 
-static void startRequest(void) {
-	dprintf(1, "*** startRequest\n");
-	assert(!list_null(requests));
-
-	assert(!requestActive);
-	requestActive = 1;
+static void startWorkers(void) {
+	Process *p;
 
-	switch (requestsPeekType()) {
-		case REQUEST_SWAPOUT:
-		case REQUEST_SWAPIN:
-			startPagerRequest();
-			break;
+	for (int i = 0; i < PAGER_IO_DEPTH; i++) {
+		p = process_run_rootthread("pager_io", pagerWorker,
+				YES_TIMESTAMP, PAGER_IO_PRIORITY);
+		workers[i].tid = process_get_tid(p);
+		workers[i].pr = NULL;
+		workers[i].ready = 0;
+	}
+}
 
-		case REQUEST_ELFLOAD:
-			startElfload();
-			break;
+static int countIdleWorkers(void) {
+	int count = 0;
 
-		default:
-			dprintf(0, "!!! startRequest: unrecognised request\n");
-			requestActive = 0;
+	for (int i = 0; i < PAGER_IO_DEPTH; i++) {
+		if (workers[i].ready && workers[i].pr == NULL) count++;
 	}
+
+	return count;
 }
 
-static void startPagerRequest(void) {
-	dprintf(1, "*** startPagerRequest\n");
-	assert(!list_null(requests));
+static void cleanerDone(PagerRequest *pr) {
+	dprintf(2, "*** cleanerDone: %d frames free\n", allocLimit);
+	cleansActive--;
+	free(pr);
+}
 
-	// This is called to start running the next pager request, assuming
-	// there is another one 
-	assert(requestsPeekType() != REQUEST_ELFLOAD);
-	PagerRequest *nextPr = requestsPeek();
+static void runCleaner(void) {
+	PagerRequest *pr;
+	int started = 0;
 
-	L4_Word_t *entry = pagetableLookup(
-			process_get_pagetable(process_lookup(nextPr->pid)), nextPr->addr);
+	// Without the go-ahead from the cleaner thread only clean when
+	// things are getting desperate
+	if (!cleanerWaiting && allocLimit >= FRAME_DOOMSDAY_THRESHHOLD) {
+		return;
+	}
 
-	if (*entry & SWAP_MASK) {
-		// At the very least a page needs to be swapped in first
-		startSwapin();
-		// Afterwards, may have to swap something out
-	} else {
-		// Needed to swap something out
-		assert(pinnedFrame == 0);
+	// Clean until enough frames are (or soon will be) free, always leaving
+	// a worker spare for faults
+	while ((allocLimit + cleansActive < FRAME_SWAP_THRESHHOLD) &&
+			(countIdleWorkers() > 1)) {
+		dprintf(2, "*** runCleaner: %d frames free, %d cleaning\n",
+				allocLimit, cleansActive);
 
-		if (allocLimit > 0) {
-			// In the meantime a frame has become free
-			requestActive = 0;
-			pager((PagerRequest*) requestsUnshift());
-		} else {
-			startSwapout();
-		}
-	}
-}
+		pr = allocPagerRequest(NIL_PID, 0, 0, cleanerDone);
+		pr->worker = findIdleWorker();
+		pr->worker->pr = pr;
 
-static void vfsHandler(int vfsRval) {
-	dprintf(2, "*** vfsHandler: vfsRval=%d\n", vfsRval);
+		cleansActive++;
+		started = 1;
+		startSwapout(pr);
+	}
 
-	switch (requestsPeekType()) {
-		case REQUEST_SWAPOUT:
-			dprintf(3, "*** demandPager: swapout continuation\n");
-			continueSwapout(vfsRval);
-			break;
+	if (started) {
+		stats.cleaner_runs++;
 
-		case REQUEST_SWAPIN:
-			dprintf(3, "*** demandPager: swapin continuation\n");
-			continueSwapin(vfsRval);
-			break;
+		// Make the cleaner wait for its next turn before doing any more
+		if (cleanerWaiting) {
+			cleanerWaiting = 0;
+			syscall_reply(cleaner, 0);
+		}
+	}
+}
 
-		case REQUEST_ELFLOAD:
-			dprintf(3, "*** vfsHandler: elfload continuation\n");
-			continueElfload(vfsRval);
-			break;
+static void pagerCleaner(void) {
+	L4_Accept(L4_AddAcceptor(L4_UntypedWordsAcceptor, L4_NotifyMsgAcceptor));
 
-		default:
-			assert(!"default");
+	for (;;) {
+		// Getting to run at all means nothing more important is, so it's
+		// a good time to clean
+		ipc_send_simple_0(virtualPager, PSOS_PAGER_CLEAN, SOS_IPC_CALL);
 	}
 }
 
@@ -1241,6 +3628,18 @@ static void virtualPagerHandler(void) {
 	virtualPager = sos_my_tid();
 	dprintf(1, "*** virtualPagerHandler: tid=%ld\n", L4_ThreadNo(virtualPager));
 
+	// Keep the default swapfile open for the workers to share, rather
+	// than opening it for every page
+	fildes_t fd = swapfile_open(defaultSwapfile, FM_READ | FM_WRITE);
+
+	if (fd < 0) {
+		dprintf(0, "!!! virtualPagerHandler: can't open swapfile (%d)\n", fd);
+	} else {
+		swapfile_set_fd(defaultSwapfile, fd);
+	}
+
+	startWorkers();
+
 	L4_Msg_t msg;
 	L4_MsgTag_t tag;
 	L4_ThreadId_t tid = L4_nilthread;
@@ -1263,8 +3662,9 @@ static void virtualPagerHandler(void) {
 
 		switch (TAG_SYSLAB(tag)) {
 			case L4_PAGEFAULT:
+				if (p != NULL) process_get_info(p)->faults++;
 				pager(allocPagerRequest(process_get_pid(p), L4_MsgWord(&msg, 0),
-							L4_Label(tag) & 0x7, defaultSwapfile, pagerContinue));
+							L4_Label(tag) & 0x7, pagerContinue));
 				break;
 
 			case SOS_COPYIN:
@@ -1283,12 +3683,29 @@ static void virtualPagerHandler(void) {
 
 			case SOS_REPLY:
 				if (L4_IsSpaceEqual(L4_SenderSpace(), L4_rootspace)) {
-					vfsHandler(L4_MsgWord(&msg, 0));
+					continueElfload(L4_MsgWord(&msg, 0));
 				} else {
 					dprintf(0, "!!! virtualPagerHandler: got reply from user\n");
 				}
 				break;
 
+			case PSOS_PAGER_IO:
+				if (L4_IsSpaceEqual(L4_SenderSpace(), L4_rootspace)) {
+					workerDone(L4_MsgWord(&msg, 0), L4_MsgWord(&msg, 1));
+				} else {
+					dprintf(0, "!!! virtualPagerHandler: worker message from user\n");
+				}
+				break;
+
+			case PSOS_PAGER_CLEAN:
+				if (L4_IsSpaceEqual(L4_SenderSpace(), L4_rootspace)) {
+					cleaner = tid;
+					cleanerWaiting = 1;
+				} else {
+					dprintf(0, "!!! virtualPagerHandler: cleaner message from user\n");
+				}
+				break;
+
 			case SOS_MOREMEM:
 				syscall_reply(tid, heapGrow(
 						(uintptr_t*) pager_buffer(tid), L4_MsgWord(&msg, 0)));
@@ -1311,6 +3728,43 @@ static void virtualPagerHandler(void) {
 				syscall_reply(tid, frames_allocated());
 				break;
 
+			case SOS_MMAP:
+				pager_buffer_in(tid);
+				syscall_reply(tid, mmapRegion(p, L4_MsgWord(&msg, 0),
+							L4_MsgWord(&msg, 1), L4_MsgWord(&msg, 2),
+							L4_MsgWord(&msg, 3), L4_MsgWord(&msg, 4),
+							pager_buffer(tid)));
+				break;
+
+			case SOS_MUNMAP:
+				munmapRegion(p, L4_MsgWord(&msg, 0), L4_MsgWord(&msg, 1));
+				break;
+
+			case SOS_BUFFER:
+				syscall_reply(tid, bufferBase(p));
+				break;
+
+			case SOS_SHARE_VM:
+				syscall_reply(tid, shareVm(p, L4_MsgWord(&msg, 0),
+							L4_MsgWord(&msg, 1), L4_MsgWord(&msg, 2)));
+				break;
+
+			case SOS_PAGER_STATUS:
+				syscall_reply(tid, pagerStatus((pager_stat_t*) pager_buffer(tid)));
+				break;
+
+			case SOS_VM_STATUS:
+				syscall_reply(tid, vmStatus((vm_stat_t*) pager_buffer(tid)));
+				break;
+
+			case SOS_MEMLIMIT:
+				syscall_reply(tid, memLimit(L4_MsgWord(&msg, 0), L4_MsgWord(&msg, 1)));
+				break;
+
+			case SOS_SWAP_STATUS:
+				syscall_reply(tid, swapStatus((swap_stat_t*) pager_buffer(tid)));
+				break;
+
 			case SOS_PROCESS_WAIT:
 				tmp = L4_MsgWord(&msg, 0);
 				if (tmp == ((L4_Word_t) -1)) {
@@ -1336,6 +3790,7 @@ static void virtualPagerHandler(void) {
 				break;
 
 			case SOS_PROCESS_CREATE:
+				pager_buffer_in(tid);
 				pid = reserve_pid();
 
 				if (pid != NIL_PID) {
@@ -1350,7 +3805,7 @@ static void virtualPagerHandler(void) {
 					syscall_reply(tid, -1);
 				} else {
 					er->child = pid;
-					queueRequest(REQUEST_ELFLOAD, er);
+					queueSpawn(er);
 				}
 
 				break;
@@ -1375,6 +3830,9 @@ static void virtualPagerHandler(void) {
 
 		dprintf(2, "*** virtualPagerHandler: finished %s from %d\n",
 				syscall_show(TAG_SYSLAB(tag)), process_get_pid(p));
+
+		// Anything could have used up frames, or freed workers
+		runCleaner();
 	}
 
 	dprintf(0, "!!! virtualPagerHandler: loop failed!\n");
@@ -1384,56 +3842,205 @@ char *pager_buffer(L4_ThreadId_t tid) {
 	return &copyInOutBuffer[L4_ThreadNo(tid) * COPY_BUFSIZ];
 }
 
-static void copyInContinue(PagerRequest *pr) {
-	dprintf(3, "*** copyInContinue pr=%p pid=%d addr=%p\n",
-			pr, pr->pid, (void*) pr->addr);
+void pager_buffer_in(L4_ThreadId_t tid) {
+	// Like prepareDataIn, but for the whole buffer.  The other way is taken
+	// care of by syscall_reply flushing everything
+	Process *p = process_lookup(L4_ThreadNo(tid));
+	L4_Word_t base, buf = (L4_Word_t) pager_buffer(tid);
 
-	Process *p = process_lookup(pr->pid);
-	L4_Word_t addr = pr->addr & PAGEALIGN;
+	if ((p == NULL) || ((base = bufferMapped[process_get_pid(p)]) == 0)) {
+		// Only ever copied in by the pager
+		return;
+	}
 
-	// Prepare caches
-	prepareDataIn(p, addr);
+	please(CACHE_FLUSH_RANGE(process_get_sid(p), base, base + COPY_BUFSIZ));
+	please(CACHE_FLUSH_RANGE_INVALIDATE(L4_rootspace, buf, buf + COPY_BUFSIZ));
+}
 
-	// Data about the copyin operation.
-	L4_Word_t size = min(COPY_BUFSIZ, LO_HALF(copyInOutData[process_get_pid(p)]));
-	L4_Word_t offset = HI_HALF(copyInOutData[process_get_pid(p)]);
+static void copyBytes(char *dst, char *src, size_t n) {
+	// Whole cache lines at a time where possible, words if not, bytes
+	// only for the ends (or if the two sides can never line up)
+	while ((n > 0) && ((L4_Word_t) dst & (sizeof(L4_Word_t) - 1))) {
+		*dst++ = *src++;
+		n--;
+	}
+
+	if (((L4_Word_t) src & (sizeof(L4_Word_t) - 1)) == 0) {
+		L4_Word_t *wdst = (L4_Word_t*) dst;
+		L4_Word_t *wsrc = (L4_Word_t*) src;
+
+		for (; n >= COPY_BURST * sizeof(L4_Word_t);
+				n -= COPY_BURST * sizeof(L4_Word_t)) {
+			wdst[0] = wsrc[0]; wdst[1] = wsrc[1];
+			wdst[2] = wsrc[2]; wdst[3] = wsrc[3];
+			wdst[4] = wsrc[4]; wdst[5] = wsrc[5];
+			wdst[6] = wsrc[6]; wdst[7] = wsrc[7];
+			wdst += COPY_BURST;
+			wsrc += COPY_BURST;
+		}
+
+		for (; n >= sizeof(L4_Word_t); n -= sizeof(L4_Word_t)) {
+			*wdst++ = *wsrc++;
+		}
+
+		dst = (char*) wdst;
+		src = (char*) wsrc;
+	}
+
+	while (n > 0) {
+		*dst++ = *src++;
+		n--;
+	}
+}
+
+static L4_Word_t copyFrame(Process *p, L4_Word_t vaddr, int rights) {
+	// The frame a page of a copy can go straight to or from, or 0 if the
+	// pager has to see to it first - not in memory, not allowed, or not
+	// simply the process's own page (shared and cached pages have rules
+	// about writing, prefetched and pinned ones have bookkeeping)
+	Region *r = list_find(process_get_regions(p), findRegion, (void*) vaddr);
+	L4_Word_t *entry, frame;
+
+	if ((r == NULL) || ((region_get_rights(r) & rights) == 0)) {
+		return 0;
+	}
+
+	entry = pageEntry(p, vaddr);
+	frame = *entry & ADDRESS_MASK;
+
+	if (*entry & SWAP_MASK) {
+		return 0;
+	} else if (*entry & ZERO_MASK) {
+		return (rights & REGION_WRITE) ? 0 : zeroFrame;
+	} else if ((frame == 0) || (frame_get_pid(frame) == NIL_PID) ||
+			(frame_get_flags(frame) & (FRAME_PINNED | FRAME_PREFETCHED))) {
+		return 0;
+	}
+
+	if (rights & REGION_WRITE) {
+		if (frame_get_pid(frame) != process_get_pid(p)) return 0;
+		frame_set_flags(frame, FRAME_DIRTY);
+
+		// Same as a write fault in pagerAction, the copy on disk is now
+		// stale (pages of a writable mapping keep their place in the file)
+		if (!region_map_directly(r) && !writesBack(r)) {
+			backingFree(pageOwner(p, vaddr), entry, frame_get_backing(frame));
+			frame_set_backing(frame, ADDRESS_NONE);
+		}
+	}
+
+	frame_set_flags(frame, FRAME_REF);
+	return frame;
+}
+
+static L4_Word_t copySpan(Process *p, L4_Word_t addr, L4_Word_t end,
+		int rights, L4_Word_t *frames) {
+	// Find the frames for as much of [addr, end) as can be copied in one
+	// go, returning where that stops.  The first page has just been through
+	// the pager so is always there
+	L4_Word_t *entry = pageEntry(p, addr & PAGEALIGN);
+	L4_Word_t page = (addr & PAGEALIGN) + PAGESIZE;
+	int n = 1;
+
+	frames[0] = (*entry & ZERO_MASK) ? zeroFrame : (*entry & ADDRESS_MASK);
+
+	while ((page < end) &&
+			((frames[n] = copyFrame(p, page, rights)) != 0)) {
+		page += PAGESIZE;
+		n++;
+	}
+
+	dprintf(3, "*** copySpan: %p to %p is %d pages\n",
+			(void*) addr, (void*) min(page, end), n);
 
-	// Continue copying in from where we left off
-	char *dst = pager_buffer(process_get_tid(p)) + offset;
+	return min(page, end);
+}
 
-	// Assume it's already there - this function should only get
-	// called as a continutation from the pager, so no problem
-	char *src = (char*) (*pagetableLookup(process_get_pagetable(p), addr)
-			& ADDRESS_MASK);
-	src += pr->addr & ~PAGEALIGN;
+static L4_Word_t copySpanBytes(L4_Word_t *frames, L4_Word_t addr,
+		L4_Word_t end, char *buf, int in) {
+	// Copy between the span's frames and the pager buffer
+	L4_Word_t size;
 
-	// Start the copy - if we reach a page boundary then pause computation
-	// since we can assume that it goes out to disk and waits a long time
-	while (offset < size) {
-		*dst = *src;
+	for (int i = 0; addr < end; i++) {
+		size = min(end, (addr & PAGEALIGN) + PAGESIZE) - addr;
+		char *frame = (char*) (frames[i] + (addr & ~PAGEALIGN));
 
-		dst++;
-		src++;
-		offset++;
+		if (in) {
+			copyBytes(buf, frame, size);
+		} else {
+			copyBytes(frame, buf, size);
+		}
 
-		if (isPageAligned(src)) break; // continue from next page boundary
+		buf += size;
+		addr += size;
 	}
 
-	copyInOutData[process_get_pid(p)] = size | (offset << 16);
+	return addr;
+}
+
+static void copyInOutFinish(PagerRequest *pr, L4_Word_t addr,
+		L4_Word_t size, L4_Word_t offset) {
+	Process *p = process_lookup(pr->pid);
+
+	copyInOutData[process_get_pid(p)] = size | HI_SHIFT(offset);
 
-	// Reached end - either we finished the copy, or we reached a boundary
-	if (offset == size) {
+	// Either finished the copy, or reached a page that needs the pager
+	if (offset >= size) {
 		L4_ThreadId_t tid = process_get_tid(p);
 		free(pr);
-		dprintf(3, "*** copyInContinue: finished\n");
+		dprintf(3, "*** copyInOutFinish: finished\n");
 		syscall_reply_v(tid, 0);
 	} else {
-		pr->addr = (pr->addr + PAGESIZE) & PAGEALIGN;
-		dprintf(3, "*** copyInContinue: continuing\n");
+		pr->addr = addr;
+		pr->faulted = time_stamp();
+		dprintf(3, "*** copyInOutFinish: continuing at %p\n", (void*) addr);
 		pager(pr);
 	}
 }
 
+static void copyInContinue(PagerRequest *pr) {
+	dprintf(3, "*** copyInContinue pr=%p pid=%d addr=%p\n",
+			pr, pr->pid, (void*) pr->addr);
+
+	Process *p = process_lookup(pr->pid);
+	L4_Word_t frames[COPY_PAGES];
+
+	// Data about the copyin operation.
+	L4_Word_t size = min(COPY_BUFSIZ, LO_HALF(copyInOutData[process_get_pid(p)]));
+	L4_Word_t offset = HI_HALF(copyInOutData[process_get_pid(p)]);
+
+	if (offset >= size) {
+		copyInOutFinish(pr, pr->addr, size, offset);
+		return;
+	}
+
+	// Copy everything from here that is already in memory, stopping at the
+	// first page that isn't since it probably goes out to disk
+	L4_Word_t end = copySpan(p, pr->addr, pr->addr + (size - offset),
+			REGION_READ, frames);
+	int pages = ((end - 1 - (pr->addr & PAGEALIGN)) / PAGESIZE) + 1;
+
+	faultRecord(FAULT_COPY, pr->faulted);
+	vmStats.copy_pages += pages;
+
+	// Prepare caches: the user's side of the span all at once, but our
+	// side of each frame (which won't be next to each other)
+	please(CACHE_FLUSH_RANGE(process_get_sid(p), pr->addr & PAGEALIGN,
+				round_up(end, PAGESIZE)));
+
+	for (int i = 0; i < pages; i++) {
+		if (frames[i] != zeroFrame) {
+			please(CACHE_FLUSH_RANGE_INVALIDATE(L4_rootspace,
+						frames[i], frames[i] + PAGESIZE));
+		}
+	}
+
+	copySpanBytes(frames, pr->addr, end,
+			pager_buffer(process_get_tid(p)) + offset, 1);
+
+	copyInOutFinish(pr, end, size, offset + (end - pr->addr));
+}
+
 static void copyIn(L4_ThreadId_t tid, void *src, size_t size, int append) {
 	dprintf(3, "*** copyIn: tid=%ld src=%p size=%d\n",
 			L4_ThreadNo(tid), src, size);
@@ -1454,7 +4061,7 @@ static void copyIn(L4_ThreadId_t tid, void *src, size_t size, int append) {
 
 	// Force a page fault to start the process
 	pager(allocPagerRequest( process_get_pid(p), (L4_Word_t) src,
-				FM_READ, defaultSwapfile, copyInContinue));
+				FM_READ, copyInContinue));
 }
 
 static void copyOutContinue(PagerRequest *pr) {
@@ -1462,45 +4069,37 @@ static void copyOutContinue(PagerRequest *pr) {
 			pr, pr->pid, (void*) pr->addr);
 
 	Process *p = process_lookup(pr->pid);
-	L4_Word_t addr = pr->addr & PAGEALIGN;
+	L4_Word_t frames[COPY_PAGES];
 
 	// Data about the copyout operation.
 	L4_Word_t size = min(COPY_BUFSIZ, LO_HALF(copyInOutData[process_get_pid(p)]));
 	L4_Word_t offset = HI_HALF(copyInOutData[process_get_pid(p)]);
 
-	// Continue copying out from where we left off
-	char *src = pager_buffer(process_get_tid(p)) + offset;
-	char *dst = (char*) (*pagetableLookup(process_get_pagetable(p), addr)
-				& ADDRESS_MASK);
-	dst += pr->addr & ~PAGEALIGN;
+	if (offset >= size) {
+		copyInOutFinish(pr, pr->addr, size, offset);
+		return;
+	}
 
-	// Start the copy, same story as copyin
-	while (offset < size) {
-		*dst = *src;
+	// Same story as copyin
+	L4_Word_t end = copySpan(p, pr->addr, pr->addr + (size - offset),
+			REGION_WRITE, frames);
+	int pages = ((end - 1 - (pr->addr & PAGEALIGN)) / PAGESIZE) + 1;
 
-		dst++;
-		src++;
-		offset++;
+	faultRecord(FAULT_COPY, pr->faulted);
+	vmStats.copy_pages += pages;
 
-		if (isPageAligned(dst)) break; // continue from next page boundary
-	}
+	copySpanBytes(frames, pr->addr, end,
+			pager_buffer(process_get_tid(p)) + offset, 0);
 
-	// Remember data
-	copyInOutData[process_get_pid(p)] = size | HI_SHIFT(offset);
+	// Fix caches, the other way around
+	for (int i = 0; i < pages; i++) {
+		please(CACHE_FLUSH_RANGE(L4_rootspace, frames[i], frames[i] + PAGESIZE));
+	}
 
-	// Fix caches
-	prepareDataOut(p, addr);
+	please(CACHE_FLUSH_RANGE_INVALIDATE(process_get_sid(p),
+				pr->addr & PAGEALIGN, round_up(end, PAGESIZE)));
 
-	if (offset == size) {
-		L4_ThreadId_t tid = process_get_tid(p);
-		free(pr);
-		dprintf(3, "*** copyOutContinue: finished\n");
-		syscall_reply_v(tid, 0);
-	} else {
-		pr->addr = (pr->addr + PAGESIZE) & PAGEALIGN;
-		dprintf(3, "*** copyOutContinue: continuing\n");
-		pager(pr);
-	}
+	copyInOutFinish(pr, end, size, offset + (end - pr->addr));
 }
 
 static void copyOut(L4_ThreadId_t tid, void *dst, size_t size, int append) {
@@ -1523,6 +4122,6 @@ static void copyOut(L4_ThreadId_t tid, void *dst, size_t size, int append) {
 
 	// Force a page fault to start the process
 	pager(allocPagerRequest(process_get_pid(p), (L4_Word_t) dst,
-				FM_WRITE, defaultSwapfile, copyOutContinue));
+				FM_WRITE, copyOutContinue));
 }
 
@@ -13,5 +13,9 @@ L4_ThreadId_t pager_get_tid(void);
 int pager_is_active(void);
 char *pager_buffer(L4_ThreadId_t tid);
 
+// Make what a thread has written to its buffer through its own mapping of
+// it visible to SOS, before SOS reads the buffer for a syscall
+void pager_buffer_in(L4_ThreadId_t tid);
+
 #endif // sos/pager.h
 
@@ -66,6 +66,11 @@ static Process *processAlloc(void) {
 
 	p->info.pid = NIL_PID;   // decide later
 	p->info.size = 0;  // fill in as we go
+	p->info.rss_limit = PROCESS_RSS_LIMIT;
+	p->info.wss = 0;   // estimated by the pager
+	p->info.swap = 0;
+	p->info.faults = 0;
+	p->info.majflt = 0;
 	p->info.stime = 0; // decide later
 	p->info.ctime = 0; // don't ever need
 	p->info.command[0] = '\0';
@@ -178,6 +183,12 @@ static void addBuiltinRegions(Process *p) {
 	list_push(p->regions, region_alloc(REGION_STACK,
 				base - ONE_MEG, ONE_MEG, REGION_READ | REGION_WRITE, 0));
 
+	// The process's pager buffer goes under the stack (with a page between
+	// to catch it overflowing), so that it can pass syscall data in place
+	list_push(p->regions, region_alloc(REGION_BUFFER,
+				base - ONE_MEG - PAGESIZE - COPY_BUFSIZ, COPY_BUFSIZ,
+				REGION_READ | REGION_WRITE, 0));
+
 	// Some times, 3 words are popped unvoluntarily so may as well just
 	// always allow for this
 	p->sp = (void*) (base - (3 * sizeof(L4_Word_t)));
@@ -9,7 +9,8 @@ struct Region_t {
 	unsigned int filesize;
 	int rights;
 	int mapDirectly;
-	Swapfile *elffile;
+	Swapfile *file;
+	L4_Word_t cache;
 };
 
 Region *region_alloc(region_type type, uintptr_t base,
@@ -21,7 +22,8 @@ Region *region_alloc(region_type type, uintptr_t base,
 	new->size = size;
 	new->rights = rights;
 	new->mapDirectly = dirmap;
-	new->elffile = NULL;
+	new->file = NULL;
+	new->cache = 0;
 
 	return new;
 }
@@ -32,8 +34,8 @@ void region_free(Region *r) {
 	}
 
 	// if region isn't default swap file then free it.
-	if (r->elffile != NULL && !swapfile_is_default(r->elffile)) {
-		swapfile_free(r->elffile);
+	if (r->file != NULL && !swapfile_is_default(r->file)) {
+		swapfile_free(r->file);
 	}
 
 	free(r);
@@ -59,14 +61,22 @@ int region_get_rights(Region *r) {
 	return r->rights;
 }
 
-Swapfile *region_get_elffile(Region *r) {
-	return r->elffile;
+Swapfile *region_get_file(Region *r) {
+	return r->file;
+}
+
+L4_Word_t region_get_cache(Region *r) {
+	return r->cache;
 }
 
 int region_map_directly(Region *r) {
 	return r->mapDirectly;
 }
 
+int region_can_share(Region *r) {
+	return !r->mapDirectly && (r->file == NULL) && (r->type != REGION_BUFFER);
+}
+
 void region_set_rights(Region *r, int rights) {
 	r->rights = rights;
 }
@@ -79,7 +89,11 @@ void region_set_filesize(Region *r, unsigned int filesize) {
 	r->filesize = filesize;
 }
 
-void region_set_elffile(Region *r, Swapfile *sf) {
-	r->elffile = sf;
+void region_set_file(Region *r, Swapfile *sf) {
+	r->file = sf;
+}
+
+void region_set_cache(Region *r, L4_Word_t id) {
+	r->cache = id;
 }
 
@@ -11,6 +11,8 @@ typedef enum {
 	REGION_STACK,
 	REGION_HEAP,
 	REGION_OTHER,
+	REGION_MMAP,
+	REGION_BUFFER,
 	REGION_THREAD_INIT
 } region_type;
 
@@ -30,12 +32,21 @@ unsigned int region_get_size(Region *r);
 unsigned int region_get_filesize(Region *r);
 int region_get_rights(Region *r);
 int region_map_directly(Region *r);
-Swapfile *region_get_elffile(Region *r);
+Swapfile *region_get_file(Region *r);
+
+// Id the pager's page cache knows the region's file by, or 0 if its pages
+// aren't shared through the cache
+L4_Word_t region_get_cache(Region *r);
+
+// Whether pages of the region can be shared with other processes, which
+// needs them to be backed by anonymous frames (so not the syscall buffer)
+int region_can_share(Region *r);
 
 // Setters
 void region_set_rights(Region *r, int rights);
 void region_set_size(Region *r, unsigned int size);
 void region_set_filesize(Region *r, unsigned int size);
-void region_set_elffile(Region *r, Swapfile *sf);
+void region_set_file(Region *r, Swapfile *sf);
+void region_set_cache(Region *r, L4_Word_t id);
 
 #endif // sos/region.h
@@ -4,11 +4,20 @@
  * Simple swap file implementation.
  *
  * Hands out free PAGESIZE slots to write out to in the swap file in O(1) time.
- * Currently  only use one frame of memory for the swap file structure so
- * only supports a swap file size of (PAGESIZE / sizeof(L4_Word_t)). On the
- * Arm5 processor this is 4MB.
+ * Slots are tracked with a bitmap of SWAPFILE_MAX_SIZE / PAGESIZE bits, split
+ * in to clusters of 32 slots (one word).  Two levels of summary bitmaps above
+ * that say which clusters have any free slots and which are entirely free,
+ * so finding a slot is a couple of find-first-set operations.
+ *
+ * Allocation carries on from the previous slot where it can, and otherwise
+ * starts on an empty cluster, so pages swapped out one after the other end
+ * up next to each other on disk.  The bitmap pages are only allocated once
+ * slots in them are needed, and nothing at all is allocated for swap files
+ * that are only ever read from (i.e. ELF files).
  */
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "constants.h"
@@ -22,38 +31,44 @@
 
 #define verbose 1
 
-typedef struct SwapfileData_t SwapfileData;
-struct SwapfileData_t {
-	char path[MAX_FILE_NAME];
-	fildes_t fd;
-	L4_Word_t head;
-	int usage;
-};
+// Bitmap dimensions
+#define SWAP_WORDBITS 32
+#define SWAP_FULL ((uint32_t) (-1))
+#define SWAP_SLOTS (SWAPFILE_MAX_SIZE / PAGESIZE)
+#define SWAP_CLUSTERS (SWAP_SLOTS / SWAP_WORDBITS)
+#define SWAP_SUMMARY (SWAP_CLUSTERS / SWAP_WORDBITS)
+#define SWAP_TOP ((SWAP_SUMMARY + SWAP_WORDBITS - 1) / SWAP_WORDBITS)
+#define SWAP_LEAFWORDS (PAGESIZE / sizeof(uint32_t))
+#define SWAP_LEAVES ((SWAP_CLUSTERS + SWAP_LEAFWORDS - 1) / SWAP_LEAFWORDS)
 
-#define SWAPSIZE ((PAGESIZE - sizeof(SwapfileData)) / sizeof(L4_Word_t))
+typedef struct {
+	uint32_t *leaves[SWAP_LEAVES]; // one bit per slot (set if in use)
+	uint32_t avail[SWAP_SUMMARY];  // one bit per cluster with a free slot
+	uint32_t empty[SWAP_SUMMARY];  // one bit per cluster with no slots in use
+	uint32_t availTop[SWAP_TOP];   // one bit per non-zero avail word
+	uint32_t emptyTop[SWAP_TOP];   // one bit per non-zero empty word
+	int cursor;                    // slot after the last one allocated
+} SwapSlots;
 
 struct Swapfile_t {
-	SwapfileData data;
-	L4_Word_t slots[SWAPSIZE];
+	char path[MAX_FILE_NAME];
+	fildes_t fd;
+	int usage;
+	int refs;         // the file is freed when the last one is dropped
+	SwapSlots *slots; // allocated on the first swapslot_alloc
 };
 
 Swapfile *swapfile_init(char *path) {
 	dprintf(1, "*** swapfile_init path=%s\n", path);
-	assert(sizeof(Swapfile) == PAGESIZE);
 	Swapfile *sf;
 
-	sf = (Swapfile*) frame_alloc(FA_SWAPFILE);
+	sf = (Swapfile*) malloc(sizeof(Swapfile));
 
-	for (int i = 0; i < SWAPSIZE - 1; i++) {
-		sf->slots[i] = i + 1;
-	}
-
-	sf->slots[SWAPSIZE - 1] = ADDRESS_NONE;
-
-	sf->data.fd = VFS_NIL_FILE;
-	sf->data.head = 0;
-	sf->data.usage = 0;
-	strncpy(sf->data.path, path, MAX_FILE_NAME);
+	sf->fd = VFS_NIL_FILE;
+	sf->usage = 0;
+	sf->refs = 1;
+	sf->slots = NULL;
+	strncpy(sf->path, path, MAX_FILE_NAME);
 
 	return sf;
 }
@@ -62,68 +77,232 @@ Swapfile *swapfile_init(char *path) {
 #define SWAP_READERS 1
 #define SWAP_WRITERS 1
 
-void swapfile_open(Swapfile *sf, int rights) {
-	dprintf(1, "*** swapfile_open path=%s rights=%d\n", sf->data.path, rights);
-	assert(sf->data.fd == VFS_NIL_FILE);
+fildes_t swapfile_open(Swapfile *sf, int rights) {
+	dprintf(1, "*** swapfile_open path=%s rights=%d\n", sf->path, rights);
+
+	// Only the default swapfile is locked, ELF files can be paged in from
+	// several places at once
+	unsigned int readers = FM_UNLIMITED_RW, writers = FM_UNLIMITED_RW;
+
+	if (swapfile_is_default(sf)) {
+		readers = SWAP_READERS;
+		writers = SWAP_WRITERS;
+	}
 
-	strncpy(pager_buffer(pager_get_tid()), sf->data.path, MAX_FILE_NAME);
-	open_lockNonblocking(NULL, rights | FM_NOTRUNC, SWAP_READERS, SWAP_WRITERS);
+	strncpy(pager_buffer(sos_my_tid()), sf->path, MAX_FILE_NAME);
+	return open_lock(NULL, rights | FM_NOTRUNC, readers, writers);
 }
 
 int swapfile_is_open(Swapfile *sf) {
-	return (sf->data.fd != VFS_NIL_FILE);
+	return (sf->fd != VFS_NIL_FILE);
 }
 
 int swapfile_is_default(Swapfile *sf) {
-	return strncmp(sf->data.path, SWAPFILE_FN, MAX_FILE_NAME) == 0 ? 1 : 0;
+	return strncmp(sf->path, SWAPFILE_FN, MAX_FILE_NAME) == 0 ? 1 : 0;
 }
 
-void swapfile_close(Swapfile *sf) {
-	dprintf(1, "*** swapfile_close path=%s\n", sf->data.path);
-	assert(sf->data.fd != VFS_NIL_FILE);
+void swapfile_close(Swapfile *sf, fildes_t fd) {
+	dprintf(1, "*** swapfile_close path=%s fd=%d\n", sf->path, fd);
+	assert(fd != VFS_NIL_FILE);
+	close(fd);
+}
 
-	closeNonblocking(sf->data.fd);
-	sf->data.fd = VFS_NIL_FILE;
+void swapfile_ref(Swapfile *sf) {
+	sf->refs++;
 }
 
 void swapfile_free(Swapfile *sf) {
-	frame_free((L4_Word_t) sf);
+	assert(sf->refs > 0);
+
+	if (--sf->refs > 0) {
+		// Still in use elsewhere (e.g. by I/O in flight)
+		return;
+	}
+
+	if (sf->slots != NULL) {
+		for (int i = 0; i < SWAP_LEAVES; i++) {
+			if (sf->slots->leaves[i] != NULL) {
+				frame_free((L4_Word_t) sf->slots->leaves[i]);
+			}
+		}
+
+		frame_free((L4_Word_t) sf->slots);
+	}
+
+	free(sf);
+}
+
+char *swapfile_get_path(Swapfile *sf) {
+	return sf->path;
 }
 
 int swapfile_get_usage(Swapfile *sf) {
-	return sf->data.usage;
+	return sf->usage;
 }
 
 fildes_t swapfile_get_fd(Swapfile *sf) {
 	assert(swapfile_is_open(sf));
-	return sf->data.fd;
+	return sf->fd;
 }
 
 void swapfile_set_fd(Swapfile *sf, fildes_t fd) {
-	dprintf(1, "*** swapfile_get_fd path=%s fd=%d\n", sf->data.path, fd);
-	assert(sf->data.fd == VFS_NIL_FILE);
+	dprintf(1, "*** swapfile_get_fd path=%s fd=%d\n", sf->path, fd);
+	assert(sf->fd == VFS_NIL_FILE);
 	assert(fd != VFS_NIL_FILE);
-	sf->data.fd = fd;
+	sf->fd = fd;
+}
+
+fildes_t swapfile_take_fd(Swapfile *sf) {
+	fildes_t fd = swapfile_get_fd(sf);
+	dprintf(1, "*** swapfile_take_fd path=%s fd=%d\n", sf->path, fd);
+	sf->fd = VFS_NIL_FILE;
+	return fd;
+}
+
+static int firstSet(uint32_t word) {
+	assert(word != 0);
+	return __builtin_ctz(word);
+}
+
+static void setBit(uint32_t *map, int i, int val) {
+	if (val) {
+		map[i / SWAP_WORDBITS] |= ((uint32_t) 1 << (i % SWAP_WORDBITS));
+	} else {
+		map[i / SWAP_WORDBITS] &= ~((uint32_t) 1 << (i % SWAP_WORDBITS));
+	}
+}
+
+static SwapSlots *swapSlots(Swapfile *sf) {
+	if (sf->slots == NULL) {
+		dprintf(1, "*** swapSlots: creating slots for %s\n", sf->path);
+		assert(sizeof(SwapSlots) <= PAGESIZE);
+
+		sf->slots = (SwapSlots*) frame_alloc(FA_SWAPFILE);
+		memset(sf->slots, 0x00, sizeof(SwapSlots));
+
+		// Everything is free to start with
+		for (int i = 0; i < SWAP_CLUSTERS; i++) {
+			setBit(sf->slots->avail, i, 1);
+			setBit(sf->slots->empty, i, 1);
+		}
+
+		for (int i = 0; i < SWAP_SUMMARY; i++) {
+			setBit(sf->slots->availTop, i, 1);
+			setBit(sf->slots->emptyTop, i, 1);
+		}
+	}
+
+	return sf->slots;
+}
+
+static uint32_t *clusterWord(SwapSlots *s, int cluster) {
+	uint32_t **leaf = &s->leaves[cluster / SWAP_LEAFWORDS];
+
+	if (*leaf == NULL) {
+		*leaf = (uint32_t*) frame_alloc(FA_SWAPFILE);
+		memset(*leaf, 0x00, PAGESIZE);
+	}
+
+	return &(*leaf)[cluster % SWAP_LEAFWORDS];
+}
+
+static void clusterUpdate(SwapSlots *s, int cluster) {
+	uint32_t word = *clusterWord(s, cluster);
+	int summary = cluster / SWAP_WORDBITS;
+
+	setBit(s->avail, cluster, word != SWAP_FULL);
+	setBit(s->empty, cluster, word == 0);
+	setBit(s->availTop, summary, s->avail[summary] != 0);
+	setBit(s->emptyTop, summary, s->empty[summary] != 0);
+}
+
+static int findCluster(uint32_t *summary, uint32_t *top) {
+	int i;
+
+	for (int j = 0; j < SWAP_TOP; j++) {
+		if (top[j] != 0) {
+			i = j * SWAP_WORDBITS + firstSet(top[j]);
+			return i * SWAP_WORDBITS + firstSet(summary[i]);
+		}
+	}
+
+	return (-1);
+}
+
+static L4_Word_t slotsTake(Swapfile *sf, int cluster, int bit, int n) {
+	SwapSlots *s = sf->slots;
+	uint32_t run = (n == SWAP_WORDBITS) ? SWAP_FULL : ((1 << n) - 1);
+	uint32_t *word = clusterWord(s, cluster);
+
+	assert((*word & (run << bit)) == 0);
+	*word |= run << bit;
+	clusterUpdate(s, cluster);
+
+	s->cursor = cluster * SWAP_WORDBITS + bit + n;
+	sf->usage += n;
+
+	return (cluster * SWAP_WORDBITS + bit) * PAGESIZE;
 }
 
 L4_Word_t swapslot_alloc(Swapfile *sf) {
-	assert(swapfile_get_usage(sf) <= SWAPSIZE);
+	SwapSlots *s = swapSlots(sf);
+	int cluster = s->cursor / SWAP_WORDBITS;
+	int bit = s->cursor % SWAP_WORDBITS;
+	uint32_t unused;
 
-	L4_Word_t slot = sf->data.head;
-	sf->data.head = sf->slots[slot];
-	sf->data.usage++;
+	// Next to the previous slot if possible
+	if (cluster < SWAP_CLUSTERS) {
+		unused = ~(*clusterWord(s, cluster)) & (SWAP_FULL << bit);
+
+		if (unused != 0) {
+			return slotsTake(sf, cluster, firstSet(unused), 1);
+		}
+	}
+
+	// Otherwise start on an empty cluster, or failing that anywhere
+	if ((cluster = findCluster(s->empty, s->emptyTop)) < 0 &&
+			(cluster = findCluster(s->avail, s->availTop)) < 0) {
+		dprintf(0, "!!! swapslot_alloc: %s is full\n", sf->path);
+		return ADDRESS_NONE;
+	}
+
+	return slotsTake(sf, cluster, firstSet(~(*clusterWord(s, cluster))), 1);
+}
+
+L4_Word_t swapslot_alloc_run(Swapfile *sf, int n) {
+	assert(n > 0 && n <= SWAP_WORDBITS);
+
+	SwapSlots *s = swapSlots(sf);
+	int cluster = s->cursor / SWAP_WORDBITS;
+	int bit = s->cursor % SWAP_WORDBITS;
+	uint32_t run = (n == SWAP_WORDBITS) ? SWAP_FULL : ((1 << n) - 1);
+
+	// Carry on from the previous slot if the run fits there
+	if ((cluster < SWAP_CLUSTERS) && (bit + n <= SWAP_WORDBITS) &&
+			((*clusterWord(s, cluster) & (run << bit)) == 0)) {
+		return slotsTake(sf, cluster, bit, n);
+	}
+
+	// Otherwise it needs an empty cluster
+	if ((cluster = findCluster(s->empty, s->emptyTop)) < 0) {
+		dprintf(1, "*** swapslot_alloc_run: no room for %d in %s\n", n, sf->path);
+		return ADDRESS_NONE;
+	}
 
-	return slot * PAGESIZE;
+	return slotsTake(sf, cluster, 0, n);
 }
 
 void swapslot_free(Swapfile *sf, L4_Word_t slot) {
 	assert((slot & ~PAGEALIGN) == 0);
 	assert(swapfile_get_usage(sf) > 0);
 
+	SwapSlots *s = swapSlots(sf);
 	slot /= PAGESIZE;
+	uint32_t *word = clusterWord(s, slot / SWAP_WORDBITS);
 
-	sf->slots[slot] = sf->data.head;
-	sf->data.head = slot;
-	sf->data.usage--;
+	assert(*word & ((uint32_t) 1 << (slot % SWAP_WORDBITS)));
+	*word &= ~((uint32_t) 1 << (slot % SWAP_WORDBITS));
+	clusterUpdate(s, slot / SWAP_WORDBITS);
+	sf->usage--;
 }
 
@@ -11,8 +11,8 @@ typedef struct Swapfile_t Swapfile;
 // useful for when dealing with swapfile ELF structs
 Swapfile *swapfile_init(char *path);
 
-// Open a swapfile (non blocking)
-void swapfile_open(Swapfile *sf, int rights);
+// Open a swapfile from the calling root thread (blocking), returning the fd
+fildes_t swapfile_open(Swapfile *sf, int rights);
 
 // Test if a swapfile is open (compares to fd)
 int swapfile_is_open(Swapfile *sf);
@@ -20,24 +20,39 @@ int swapfile_is_open(Swapfile *sf);
 // Test if the swapfile is the system wide default
 int swapfile_is_default(Swapfile *sf);
 
-// Close a swapfile (non blocking)
-void swapfile_close(Swapfile *sf);
+// Close a file descriptor opened with swapfile_open (blocking)
+void swapfile_close(Swapfile *sf, fildes_t fd);
 
-// Free the swapfile
+// Take another reference to the swapfile, so that it isn't freed until
+// swapfile_free has been called for each one
+void swapfile_ref(Swapfile *sf);
+
+// Free the swapfile (drops a reference, freeing it after the last)
 void swapfile_free(Swapfile *sf);
 
+// Get the path of the file behind a swap file
+char *swapfile_get_path(Swapfile *sf);
+
 // Get the slots in use by a swap file
 int swapfile_get_usage(Swapfile *sf);
 
 // Get the file descriptor used by a swap file, (-1) if not open
 fildes_t swapfile_get_fd(Swapfile *sf);
 
-// Set the file descriptor (only a good idea after opening)
+// Set the file descriptor kept open for the swap file (only a good idea after opening)
 void swapfile_set_fd(Swapfile *sf, fildes_t fd);
 
-// Allocate a new slot in the swapfile
+// Stop keeping the swap file open, returning the file descriptor for the
+// caller to close
+fildes_t swapfile_take_fd(Swapfile *sf);
+
+// Allocate a new slot in the swapfile, ADDRESS_NONE if it is full
 L4_Word_t swapslot_alloc(Swapfile *sf);
 
+// Allocate n (at most 32) contiguous slots in the swapfile, returning the
+// first, or ADDRESS_NONE if there isn't room for them together
+L4_Word_t swapslot_alloc_run(Swapfile *sf, int n);
+
 // Free an allocated slot in the swapfile
 void swapslot_free(Swapfile *sf, L4_Word_t slot);
 
@@ -10,6 +10,7 @@
 #include "l4.h"
 #include "libsos.h"
 #include "network.h"
+#include "nfsfs.h"
 #include "pager.h"
 #include "process.h"
 #include "syscall.h"
@@ -100,6 +101,10 @@ syscall_handle(L4_MsgTag_t tag, L4_ThreadId_t tid, L4_Msg_t *msg)
 	if (!L4_IsSpaceEqual(L4_SenderSpace(), L4_rootspace)) {
 		dprintf(2, "*** syscall_handle: got tid=%ld tag=%s\n",
 				L4_ThreadNo(tid), syscall_show(TAG_SYSLAB(tag)));
+
+		// The data for the syscall could have been written straight in to
+		// the buffer rather than copied in
+		pager_buffer_in(tid);
 	}
 
 	switch(TAG_SYSLAB(tag)) {
@@ -160,6 +165,37 @@ syscall_handle(L4_MsgTag_t tag, L4_ThreadId_t tid, L4_Msg_t *msg)
 					(size_t) L4_MsgWord(msg, 1));
 			break;
 
+		/* SOS ADDRESSPACE PRIVATE SYSCALL */
+		/* Read/write at a position in a file open by another root thread (the owner),
+		 * without touching the file pointer.  The buffer is given directly since it is
+		 * in our address space, e.g. the frame being swapped.
+		 */
+		case PSOS_READ:
+			// check valid caller
+			if (process_get_info(process_lookup(L4_ThreadNo(tid)))->ps_type != PS_TYPE_ROOTTHREAD) {
+				syscall_reply(tid, -1);
+			} else {
+				vfs_pread(L4_ThreadNo(tid), L4_MsgWord(msg, 3),
+						(fildes_t) L4_MsgWord(msg, 0),
+						L4_MsgWord(msg, 1),
+						(char*) L4_MsgWord(msg, 4),
+						(size_t) L4_MsgWord(msg, 2));
+			}
+			break;
+
+		case PSOS_WRITE:
+			// check valid caller
+			if (process_get_info(process_lookup(L4_ThreadNo(tid)))->ps_type != PS_TYPE_ROOTTHREAD) {
+				syscall_reply(tid, -1);
+			} else {
+				vfs_pwrite(L4_ThreadNo(tid), L4_MsgWord(msg, 3),
+						(fildes_t) L4_MsgWord(msg, 0),
+						L4_MsgWord(msg, 1),
+						(char*) L4_MsgWord(msg, 4),
+						(size_t) L4_MsgWord(msg, 2));
+			}
+			break;
+
 		case SOS_FLUSH:
 			vfs_flush(L4_ThreadNo(tid),
 					(fildes_t) L4_MsgWord(msg, 0));
@@ -233,6 +269,20 @@ syscall_handle(L4_MsgTag_t tag, L4_ThreadId_t tid, L4_Msg_t *msg)
 			syscall_reply(tid, L4_ThreadNo(pager_get_tid()));
 			break;
 
+		case PSOS_NFS_TIMEOUT:
+			// check valid caller
+			if (process_get_info(process_lookup(L4_ThreadNo(tid)))->ps_type != PS_TYPE_ROOTTHREAD) {
+				syscall_reply(tid, -1);
+			} else {
+				nfsfs_timeout();
+				syscall_reply(tid, 0);
+			}
+			break;
+
+		case SOS_NFS_STATUS:
+			syscall_reply(tid, nfsfs_status((nfs_stat_t*) pager_buffer(tid)));
+			break;
+
 		default:
 			dprintf(0, "!!! rootserver: unhandled syscall tid=%ld id=%d name=%s\n",
 					L4_ThreadNo(tid), TAG_SYSLAB(tag), syscall_show(TAG_SYSLAB(tag)));
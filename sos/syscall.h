@@ -18,6 +18,17 @@ typedef enum {
 	PSOS_DUP,
 	PSOS_FLUSH,
 	PSOS_CLOSE,
+	// Positional read/write of any size on a file open in another root thread's table,
+	// used by the pager's I/O workers so a page is one request, and several can be in
+	// flight on the one file.  Args are (fd, pos, nbyte, owner, buf)
+	PSOS_READ,
+	PSOS_WRITE,
+	// Sent by a pager I/O worker to report a finished job and wait for the next
+	PSOS_PAGER_IO,
+	// Sent by the pager's cleaner thread when it has the chance to do some cleaning
+	PSOS_PAGER_CLEAN,
+	// Sent by the NFS timeout thread to have the timeouts run by the main thread
+	PSOS_NFS_TIMEOUT,
 } psyscall_t;
 
 void syscall_reply(L4_ThreadId_t tid, L4_Word_t rval);
@@ -39,6 +39,13 @@ static void vfs_read_done(pid_t pid, VNode self, fildes_t file, L4_Word_t pos, c
 static void vfs_write_done(pid_t pid, VNode self, fildes_t file, L4_Word_t offset,
 		const char *buf, size_t nbyte, int status);
 
+/* Positional versions, which just reply with the status */
+static void vfs_pread_done(pid_t pid, VNode self, fildes_t file, L4_Word_t pos, char *buf,
+		size_t nbyte, int status);
+
+static void vfs_pwrite_done(pid_t pid, VNode self, fildes_t file, L4_Word_t offset,
+		const char *buf, size_t nbyte, int status);
+
 // Global open vnodes list
 static VNode GlobalVNodes;
 
@@ -194,6 +201,7 @@ new_vnode(void) {
 	vn->Max_Writers = FM_UNLIMITED_RW;
 	vn->readers = 0;
 	vn->writers = 0;
+	vn->io_size = IO_MAX_BUFFER;
 	vn->extra = NULL;
 
 	// list pointers
@@ -526,6 +534,61 @@ vfs_close_done(pid_t pid, VNode self, fildes_t file, fmode_t mode, int status) {
 	syscall_reply(PS_GET_TID(pid), status);
 }
 
+/* Transfers can be bigger than the FS layer handles in one go (up to the whole
+ * syscall buffer, or anything for positional ones), so they are split up here
+ * and only replied to once the whole lot is done.  Callers block on these so
+ * there is at most one per thread, indexed by pid.
+ */
+typedef struct {
+	VNode vnode;
+	fildes_t file;
+	L4_Word_t pos;  // position of the whole transfer (positional only)
+	char *buf;      // buffer for the whole transfer
+	size_t nbyte;   // size of the whole transfer
+	size_t done;    // bytes transferred so far
+} PositionalIO;
+
+static PositionalIO positionalIO[MAX_THREADS];
+
+/* Set up a transfer through the file pointer */
+static
+PositionalIO *
+stream_start(pid_t pid, VFile *vf, fildes_t file, char *buf, size_t nbyte) {
+	assert(pid >= 0 && pid < MAX_THREADS);
+	PositionalIO *pio = &positionalIO[pid];
+	pio->vnode = vf->vnode;
+	pio->file = file;
+	pio->pos = 0;
+	pio->buf = buf;
+	pio->nbyte = min(nbyte, COPY_BUFSIZ);
+	pio->done = 0;
+
+	return pio;
+}
+
+/* Size of the next chunk of a transfer */
+static
+size_t
+chunk_size(PositionalIO *pio) {
+	return min(pio->vnode->io_size, pio->nbyte - pio->done);
+}
+
+/* Read the next chunk of a read, from the file pointer */
+static
+void
+read_next(pid_t pid, VFile *vf, PositionalIO *pio) {
+	vf->vnode->read(pid, vf->vnode, pio->file, vf->fp, pio->buf + pio->done,
+			chunk_size(pio), vfs_read_done);
+}
+
+/* Write the next chunk of a write, at the file pointer */
+static
+void
+write_next(pid_t pid, VFile *vf, PositionalIO *pio) {
+	vf->vnode->write(pid, vf->vnode, pio->file, vf->fp, pio->buf + pio->done,
+			chunk_size(pio), vfs_write_done);
+}
+
 /* Read from a file */
 void
 vfs_read(pid_t pid, fildes_t file, char *buf, size_t nbyte) {
@@ -544,42 +607,49 @@ vfs_read(pid_t pid, fildes_t file, char *buf, size_t nbyte) {
 	}
 	
 	// restrict max buffer size
-	if (nbyte > IO_MAX_BUFFER) {
+	if (nbyte > COPY_BUFSIZ) {
 		dprintf(2, "vfs_read: tried to read too much data at once: %d\n", nbyte);
-		nbyte = IO_MAX_BUFFER;
 	}
 
-	vf->vnode->read(pid, vf->vnode, file, vf->fp, buf, nbyte, vfs_read_done);
+	read_next(pid, vf, stream_start(pid, vf, file, buf, nbyte));
 }
 
 /* Handle the file pointer in the file handler, status is set already by the fs layer
  * to the value that should be returned to the user, while nbyte is used to tell
  * the vfs layer how much to change the file pos pointer by. These may differ
  * for special file systems such as console where you never want to change the
- * file pos pointer.
+ * file pos pointer.  Reading carries on to the next chunk only if this one was
+ * all there and moved the file pointer, so the console is never waited on for
+ * more than one chunk.
  */
 static
 void
 vfs_read_done(pid_t pid, VNode self, fildes_t file, L4_Word_t pos, char *buf,
 		size_t nbyte, int status) {
 	dprintf(1, "*** vfs_read_done: %d %d %p %d %d\n", pid, file, buf, nbyte, status);
+	PositionalIO *pio = &positionalIO[pid];
+	size_t chunk = chunk_size(pio);
 
 	// get file
 	VFile *vf = get_vfile(pid, file, 1);
 	if (vf == NULL) return;
 	
-	// check no error
+	// check no error, although what was read before it still counts
 	if (status < 0) {
-		syscall_reply(PS_GET_TID(pid), status);
+		syscall_reply(PS_GET_TID(pid), (pio->done > 0) ? pio->done : status);
 		return;
 	}
 
 	// update file
 	vf->fp += nbyte;
-	if (status == 0) {
+	pio->done += status;
+
+	if (((size_t) status == chunk) && (nbyte == chunk) && (pio->done < pio->nbyte)) {
+		read_next(pid, vf, pio);
+	} else if (pio->done == 0) {
 		syscall_reply(PS_GET_TID(pid), SOS_VFS_EOF);
 	} else {
-		syscall_reply(PS_GET_TID(pid), status);
+		syscall_reply(PS_GET_TID(pid), pio->done);
 	}
 }
 
@@ -601,12 +671,11 @@ vfs_write(pid_t pid, fildes_t file, const char *buf, size_t nbyte) {
 	}
 
 	// restrict max buffer size
-	if (nbyte > IO_MAX_BUFFER) {
+	if (nbyte > COPY_BUFSIZ) {
 		dprintf(2, "vfs_write: tried to write too much data at once: %d\n", nbyte);
-		nbyte = IO_MAX_BUFFER;
 	}
 
-	vf->vnode->write(pid, vf->vnode, file, vf->fp, buf, nbyte, vfs_write_done);
+	write_next(pid, vf, stream_start(pid, vf, file, (char*) buf, nbyte));
 }
 
 /* Handle the file pointer in the file handler, status is set already by the fs layer
@@ -621,9 +690,15 @@ vfs_write_done(pid_t pid, VNode self, fildes_t file, L4_Word_t offset,
 		const char *buf, size_t nbyte, int status) {
 	dprintf(1, "*** vfs_write_done: %d %d %p %d %d\n", pid, file,
 			buf, nbyte, status);
+	PositionalIO *pio = &positionalIO[pid];
+	size_t chunk = chunk_size(pio);
 
 	if (status < 0) {
-		syscall_reply(PS_GET_TID(pid), status);
+		if (pio->done > 0) {
+			syscall_reply_v(PS_GET_TID(pid), 2, pio->done, SOS_WRITE);
+		} else {
+			syscall_reply(PS_GET_TID(pid), status);
+		}
 		return;
 	}
 	
@@ -632,7 +707,133 @@ vfs_write_done(pid_t pid, VNode self, fildes_t file, L4_Word_t offset,
 	if (vf == NULL) return;
 	
 	vf->fp += nbyte;
-	syscall_reply_v(PS_GET_TID(pid), 2, status, SOS_WRITE);
+	pio->done += status;
+
+	if (((size_t) status == chunk) && (pio->done < pio->nbyte)) {
+		write_next(pid, vf, pio);
+	} else {
+		syscall_reply_v(PS_GET_TID(pid), 2, pio->done, SOS_WRITE);
+	}
+}
+
+/* Set up a positional transfer, returning NULL (having replied) on error */
+static
+PositionalIO *
+positional_start(pid_t pid, pid_t owner, fildes_t file, L4_Word_t pos, char *buf,
+		size_t nbyte, fmode_t mode) {
+	// get file, errors go to the caller rather than the owner
+	VFile *vf = get_vfile(owner, file, 0);
+	if (vf == NULL) {
+		syscall_reply(PS_GET_TID(pid), SOS_VFS_NOFILE);
+		return NULL;
+	}
+
+	// check permissions
+	if (!(vf->fmode & mode)) {
+		syscall_reply(PS_GET_TID(pid), SOS_VFS_PERM);
+		return NULL;
+	}
+
+	assert(pid >= 0 && pid < MAX_THREADS);
+	PositionalIO *pio = &positionalIO[pid];
+	pio->vnode = vf->vnode;
+	pio->file = file;
+	pio->pos = pos;
+	pio->buf = buf;
+	pio->nbyte = nbyte;
+	pio->done = 0;
+
+	return pio;
+}
+
+/* Read the next chunk of a positional read */
+static
+void
+pread_next(pid_t pid, PositionalIO *pio) {
+	pio->vnode->read(pid, pio->vnode, pio->file, pio->pos + pio->done,
+			pio->buf + pio->done, chunk_size(pio),
+			vfs_pread_done);
+}
+
+/* Write the next chunk of a positional write */
+static
+void
+pwrite_next(pid_t pid, PositionalIO *pio) {
+	pio->vnode->write(pid, pio->vnode, pio->file, pio->pos + pio->done,
+			pio->buf + pio->done, chunk_size(pio),
+			vfs_pwrite_done);
+}
+
+/* Read from a file at a given position on behalf of another root thread */
+void
+vfs_pread(pid_t pid, pid_t owner, fildes_t file, L4_Word_t pos, char *buf,
+		size_t nbyte) {
+	dprintf(1, "*** vfs_pread: %d %d %d %p %d %p\n", pid, owner, file, pos, nbyte, buf);
+
+	PositionalIO *pio = positional_start(pid, owner, file, pos, buf, nbyte, FM_READ);
+	if (pio == NULL) return;
+
+	pread_next(pid, pio);
+}
+
+/* Keep reading until the whole transfer is done, or the file ends */
+static
+void
+vfs_pread_done(pid_t pid, VNode self, fildes_t file, L4_Word_t pos, char *buf,
+		size_t nbyte, int status) {
+	dprintf(1, "*** vfs_pread_done: %d %d %p %d %d\n", pid, file, buf, nbyte, status);
+	PositionalIO *pio = &positionalIO[pid];
+
+	if (status < 0) {
+		syscall_reply(PS_GET_TID(pid), status);
+		return;
+	}
+
+	pio->done += nbyte;
+
+	if (nbyte > 0 && pio->done < pio->nbyte) {
+		pread_next(pid, pio);
+	} else if (pio->done == 0) {
+		syscall_reply(PS_GET_TID(pid), SOS_VFS_EOF);
+	} else {
+		syscall_reply(PS_GET_TID(pid), pio->done);
+	}
+}
+
+/* Write to a file at a given position on behalf of another root thread */
+void
+vfs_pwrite(pid_t pid, pid_t owner, fildes_t file, L4_Word_t pos, const char *buf,
+		size_t nbyte) {
+	dprintf(1, "*** vfs_pwrite: %d %d %d %p %d %p\n", pid, owner, file, pos, nbyte, buf);
+
+	PositionalIO *pio = positional_start(pid, owner, file, pos, (char*) buf, nbyte,
+			FM_WRITE);
+	if (pio == NULL) return;
+
+	pwrite_next(pid, pio);
+}
+
+/* Keep writing until the whole transfer is done */
+static
+void
+vfs_pwrite_done(pid_t pid, VNode self, fildes_t file, L4_Word_t offset,
+		const char *buf, size_t nbyte, int status) {
+	dprintf(1, "*** vfs_pwrite_done: %d %d %p %d %d\n", pid, file,
+			buf, nbyte, status);
+	PositionalIO *pio = &positionalIO[pid];
+
+	if (status < 0) {
+		syscall_reply(PS_GET_TID(pid), status);
+		return;
+	}
+
+	pio->done += nbyte;
+
+	if (nbyte > 0 && pio->done < pio->nbyte) {
+		pwrite_next(pid, pio);
+	} else {
+		syscall_reply(PS_GET_TID(pid), pio->done);
+	}
 }
 
 /* Flush a stream */
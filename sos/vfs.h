@@ -12,6 +12,9 @@ struct VNode_t {
 	char path[MAX_FILE_NAME];
 	stat_t vstat;
 
+	// Most bytes the file system reads or writes in one go
+	size_t io_size;
+
 	// Open counters
 	unsigned int Max_Readers;
 	unsigned int Max_Writers;
@@ -86,6 +89,18 @@ void vfs_read(pid_t pid, fildes_t file, char *buf, size_t nbyte);
 /* Write to a file */
 void vfs_write(pid_t pid, fildes_t file, const char *buf, size_t nbyte);
 
+/* Read from a file at a given position.  The file is looked up in the table of
+ * owner but the reply goes to pid, and the file pointer is left alone, so several
+ * reads can be outstanding on the one file.  Any size can be asked for, it is
+ * split up to suit the file system and replied to once (internal SOS function).
+ */
+void vfs_pread(pid_t pid, pid_t owner, fildes_t file, L4_Word_t pos, char *buf,
+		size_t nbyte);
+
+/* Write to a file at a given position, as for vfs_pread (internal SOS function) */
+void vfs_pwrite(pid_t pid, pid_t owner, fildes_t file, L4_Word_t pos, const char *buf,
+		size_t nbyte);
+
 /* Flush a stream */
 void vfs_flush(pid_t pid, fildes_t file);
 
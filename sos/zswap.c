@@ -0,0 +1,414 @@
+/*
+ * sos/zswap.c
+ *
+ * Compressed swap tier, which keeps pages the pager is swapping out to the
+ * default swap file in memory instead, compressed, until it fills up.
+ *
+ * Pages are compressed with a small LZ77 compressor (in the style of LZF,
+ * which suits 4K pages of mostly words and zeros), and kept in fixed size
+ * chunks of a pool of frames set aside when SOS starts.  A compressed page
+ * can be in chunks anywhere in the pool, so the only thing that matters
+ * when storing is how many chunks are free.  When there aren't enough the
+ * oldest page is thrown out, by decompressing it in to the frame of the
+ * page coming in (whose contents are now safely compressed) and having the
+ * pager write that out to the oldest page's slot in place of the new page.
+ * This way making room never needs any more frames or any more I/O than
+ * swapping without the tier would have.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "frames.h"
+#include "l4.h"
+#include "libsos.h"
+#include "list.h"
+#include "zswap.h"
+
+#define verbose 1
+
+// Compressed pages are kept in chunks of this many bytes
+#define ZSWAP_CHUNK 128
+#define ZSWAP_FRAME_CHUNKS (PAGESIZE / ZSWAP_CHUNK)
+
+// Pages which don't compress to at least this are written out as they are
+#define ZSWAP_MAX_SIZE (PAGESIZE * 3 / 4)
+#define ZSWAP_MAX_CHUNKS ((ZSWAP_MAX_SIZE + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK)
+
+#define ZSWAP_BUCKETS 64
+
+typedef struct {
+	L4_Word_t slot;  // swap slot the page belongs in
+	int size;        // compressed size in bytes
+	L4_Word_t frame; // the frame it is being written out from, or 0
+	int dropped;     // slot freed while it was being written out
+	uint16_t chunks[ZSWAP_MAX_CHUNKS];
+} ZPage;
+
+static List *stored[ZSWAP_BUCKETS]; // [ZPage], hashed on slot
+static List *age;                   // [ZPage], oldest first (not being written)
+
+static L4_Word_t *poolFrames;
+static int poolSize;       // frames in the pool
+static uint16_t *freeChunks; // stack of free chunks
+static int freeCount;
+
+static swap_stat_t stats; // only the tier's counters are kept up to date
+
+// Scratch space for compressing in to and for gathering chunks back up
+static uint8_t packed[PAGESIZE];
+static uint8_t gathered[PAGESIZE];
+
+/*
+ * The compressor.  The output is a sequence of literal runs and back
+ * references, each starting with a control byte:
+ *   000lllll                   a run of l + 1 literal bytes follows
+ *   LLLooooo [LLLLLLLL] oooooooo  copy L + 2 bytes from o + 1 bytes back,
+ *                              with the extra byte for L only if L is 7
+ */
+
+#define LZ_HASH_BITS 10
+#define LZ_MAX_LIT 32
+#define LZ_MAX_OFF (1 << 13)
+#define LZ_MAX_REF ((1 << 8) + 8)
+
+static uint16_t lzHash[1 << LZ_HASH_BITS]; // position + 1 of the last match
+
+static int lzHashOf(const uint8_t *p) {
+	L4_Word_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return ((v * 2654435761u) >> (32 - LZ_HASH_BITS)) & ((1 << LZ_HASH_BITS) - 1);
+}
+
+static int lzCompress(const uint8_t *in, int inLen, uint8_t *out, int outLen) {
+	// Returns the compressed size, or 0 if it doesn't fit in outLen
+	int ip = 0, op = 1, lit = 0;
+	int ref, off, len, max;
+
+	memset(lzHash, 0, sizeof(lzHash));
+
+	while (ip < inLen) {
+		ref = -1;
+
+		if (ip + 2 < inLen) {
+			int h = lzHashOf(in + ip);
+			ref = lzHash[h] - 1;
+			lzHash[h] = ip + 1;
+		}
+
+		if ((ref >= 0) && (ip - ref - 1 < LZ_MAX_OFF) &&
+				(in[ref] == in[ip]) && (in[ref + 1] == in[ip + 1]) &&
+				(in[ref + 2] == in[ip + 2])) {
+			off = ip - ref - 1;
+			max = min(LZ_MAX_REF, inLen - ip);
+
+			for (len = 3; (len < max) && (in[ref + len] == in[ip + len]); len++);
+
+			if (op + 3 >= outLen) return 0;
+
+			// Close off the literal run (or take back its unused control byte)
+			if (lit > 0) {
+				out[op - lit - 1] = lit - 1;
+			} else {
+				op--;
+			}
+
+			if (len - 2 < 7) {
+				out[op++] = (off >> 8) | ((len - 2) << 5);
+			} else {
+				out[op++] = (off >> 8) | (7 << 5);
+				out[op++] = len - 2 - 7;
+			}
+
+			out[op++] = off & 0xff;
+
+			lit = 0;
+			op++;
+			ip += len;
+		} else {
+			if (op + 1 >= outLen) return 0;
+
+			out[op++] = in[ip++];
+			lit++;
+
+			if (lit == LZ_MAX_LIT) {
+				out[op - lit - 1] = lit - 1;
+				lit = 0;
+				op++;
+			}
+		}
+	}
+
+	if (lit > 0) {
+		out[op - lit - 1] = lit - 1;
+	} else {
+		op--;
+	}
+
+	return op;
+}
+
+static int lzDecompress(const uint8_t *in, int inLen, uint8_t *out, int outLen) {
+	// Returns the decompressed size
+	int ip = 0, op = 0, ctrl, len, ref;
+
+	while ((ip < inLen) && (op < outLen)) {
+		ctrl = in[ip++];
+
+		if (ctrl < LZ_MAX_LIT) {
+			len = min(ctrl + 1, outLen - op);
+			memcpy(out + op, in + ip, len);
+			ip += ctrl + 1;
+			op += len;
+		} else {
+			len = ctrl >> 5;
+			if (len == 7) len += in[ip++];
+			ref = op - ((ctrl & 0x1f) << 8) - in[ip++] - 1;
+			len = min(len + 2, outLen - op);
+			assert(ref >= 0);
+
+			// Can overlap with itself, so a byte at a time
+			while (len-- > 0) out[op++] = out[ref++];
+		}
+	}
+
+	return op;
+}
+
+/*
+ * The pool.
+ */
+
+static int chunksFor(int size) {
+	return (size + ZSWAP_CHUNK - 1) / ZSWAP_CHUNK;
+}
+
+static char *chunkAddr(int chunk) {
+	return (char*) poolFrames[chunk / ZSWAP_FRAME_CHUNKS] +
+		(chunk % ZSWAP_FRAME_CHUNKS) * ZSWAP_CHUNK;
+}
+
+static void chunksFill(ZPage *zp, uint8_t *data) {
+	int n = chunksFor(zp->size);
+	assert(n <= freeCount);
+
+	for (int i = 0; i < n; i++) {
+		zp->chunks[i] = freeChunks[--freeCount];
+		memcpy(chunkAddr(zp->chunks[i]), data + i * ZSWAP_CHUNK,
+				min(ZSWAP_CHUNK, zp->size - i * ZSWAP_CHUNK));
+	}
+
+	stats.pages++;
+	stats.bytes_used += zp->size;
+}
+
+static void chunksGather(ZPage *zp, uint8_t *data) {
+	for (int i = 0; i < chunksFor(zp->size); i++) {
+		memcpy(data + i * ZSWAP_CHUNK, chunkAddr(zp->chunks[i]),
+				min(ZSWAP_CHUNK, zp->size - i * ZSWAP_CHUNK));
+	}
+}
+
+static void chunksFree(ZPage *zp) {
+	for (int i = 0; i < chunksFor(zp->size); i++) {
+		freeChunks[freeCount++] = zp->chunks[i];
+	}
+
+	stats.pages--;
+	stats.bytes_used -= zp->size;
+}
+
+static List *storedBucket(L4_Word_t slot) {
+	return stored[(slot / PAGESIZE) % ZSWAP_BUCKETS];
+}
+
+static int findSlot(void *contents, void *data) {
+	return ((ZPage*) contents)->slot == (L4_Word_t) data;
+}
+
+static ZPage *storedLookup(L4_Word_t slot) {
+	return list_find(storedBucket(slot), findSlot, (void*) slot);
+}
+
+static int isPage(void *contents, void *data) {
+	return contents == data;
+}
+
+static void storedRemove(ZPage *zp) {
+	list_delete_first(storedBucket(zp->slot), isPage, zp);
+}
+
+static int storeCompressed(L4_Word_t slot, int size) {
+	// Keep what is in packed, if there is room
+	ZPage *zp;
+
+	if (chunksFor(size) > freeCount) {
+		return 0;
+	}
+
+	zp = (ZPage*) malloc(sizeof(ZPage));
+	zp->slot = slot;
+	zp->size = size;
+	zp->frame = 0;
+	zp->dropped = 0;
+	chunksFill(zp, packed);
+
+	list_push(storedBucket(slot), zp);
+	list_push(age, zp);
+
+	return 1;
+}
+
+void zswap_init(int frames) {
+	dprintf(1, "*** zswap_init: %d frames\n", frames);
+
+	for (int i = 0; i < ZSWAP_BUCKETS; i++) {
+		stored[i] = list_empty();
+	}
+
+	age = list_empty();
+
+	poolFrames = (L4_Word_t*) malloc(max(1, frames) * sizeof(L4_Word_t));
+	freeChunks = (uint16_t*) malloc(max(1, frames * ZSWAP_FRAME_CHUNKS) *
+			sizeof(uint16_t));
+	poolSize = 0;
+	freeCount = 0;
+
+	for (int i = 0; i < frames; i++) {
+		if ((poolFrames[i] = frame_alloc(FA_PAGERALLOC)) == 0) {
+			break;
+		}
+
+		poolSize++;
+
+		for (int j = 0; j < ZSWAP_FRAME_CHUNKS; j++) {
+			freeChunks[freeCount++] = i * ZSWAP_FRAME_CHUNKS + j;
+		}
+	}
+
+	stats.frames = poolSize;
+}
+
+int zswap_store(L4_Word_t slot, L4_Word_t frame, L4_Word_t *evicted) {
+	ZPage *oldest;
+	int size;
+
+	*evicted = ADDRESS_NONE;
+
+	if (poolSize == 0) {
+		return 0;
+	}
+
+	assert(storedLookup(slot) == NULL);
+	size = lzCompress((uint8_t*) frame, PAGESIZE, packed, ZSWAP_MAX_SIZE);
+
+	if (size == 0) {
+		dprintf(2, "*** zswap_store: %p doesn't compress\n", (void*) slot);
+		stats.rejects++;
+		return 0;
+	}
+
+	if (chunksFor(size) > freeCount) {
+		// Full, see if throwing the oldest page out makes enough room
+		oldest = (ZPage*) list_peek(age);
+
+		if ((oldest == NULL) ||
+				(chunksFor(size) > freeCount + chunksFor(oldest->size))) {
+			dprintf(2, "*** zswap_store: no room for %p\n", (void*) slot);
+			stats.full++;
+			return 0;
+		}
+
+		dprintf(2, "*** zswap_store: evicting %p for %p\n",
+				(void*) oldest->slot, (void*) slot);
+
+		list_unshift(age);
+		chunksGather(oldest, gathered);
+		lzDecompress(gathered, oldest->size, (uint8_t*) frame, PAGESIZE);
+		chunksFree(oldest);
+
+		// Still here until it is written out, just uncompressed
+		oldest->frame = frame;
+		*evicted = oldest->slot;
+		stats.evictions++;
+	}
+
+	dprintf(3, "*** zswap_store: %p in %d bytes\n", (void*) slot, size);
+	storeCompressed(slot, size);
+
+	stats.stores++;
+	stats.original_bytes += PAGESIZE;
+	stats.compressed_bytes += size;
+
+	return 1;
+}
+
+int zswap_load(L4_Word_t slot, L4_Word_t frame) {
+	ZPage *zp = storedLookup(slot);
+
+	if (zp == NULL) {
+		return 0;
+	} else if (zp->frame != 0) {
+		// On its way out
+		memcpy((char*) frame, (char*) zp->frame, PAGESIZE);
+	} else {
+		chunksGather(zp, gathered);
+		lzDecompress(gathered, zp->size, (uint8_t*) frame, PAGESIZE);
+	}
+
+	dprintf(3, "*** zswap_load: %p\n", (void*) slot);
+	return 1;
+}
+
+int zswap_contains(L4_Word_t slot) {
+	return (poolSize > 0) && (storedLookup(slot) != NULL);
+}
+
+int zswap_drop(L4_Word_t slot) {
+	ZPage *zp;
+
+	if ((poolSize == 0) || ((zp = storedLookup(slot)) == NULL)) {
+		return 1;
+	} else if (zp->frame != 0) {
+		// The write will finish on a slot nobody wants, and only then
+		// can it be used again
+		zp->dropped = 1;
+		return 0;
+	}
+
+	dprintf(3, "*** zswap_drop: %p\n", (void*) slot);
+	chunksFree(zp);
+	storedRemove(zp);
+	list_delete_first(age, isPage, zp);
+	free(zp);
+
+	return 1;
+}
+
+int zswap_written(L4_Word_t slot, L4_Word_t frame, int rval) {
+	ZPage *zp = storedLookup(slot);
+	int dropped, size;
+
+	assert(zp != NULL);
+	assert(zp->frame == frame);
+
+	dropped = zp->dropped;
+	storedRemove(zp);
+	free(zp);
+
+	if ((rval < 0) && !dropped) {
+		// The only copy is in the frame, so keep it if at all possible
+		size = lzCompress((uint8_t*) frame, PAGESIZE, packed, ZSWAP_MAX_SIZE);
+
+		if ((size == 0) || !storeCompressed(slot, size)) {
+			dprintf(0, "!!! zswap_written: lost %p (%d)\n", (void*) slot, rval);
+		}
+	}
+
+	return dropped;
+}
+
+void zswap_status(swap_stat_t *dest) {
+	*dest = stats;
+}
@@ -0,0 +1,46 @@
+#ifndef _ZSWAP_H
+#define _ZSWAP_H
+
+#include <sos/sos.h>
+
+#include "l4.h"
+
+/**
+ * A compressed store in memory for pages on their way to the default swap
+ * file.  Pages are kept under the swap slot they would have been written
+ * to, so the pager allocates slots as usual and only has to look here
+ * before going to the file.
+ *
+ * Everything is done by the pager thread, so there is no locking.
+ */
+
+// Set aside the given number of frames to keep compressed pages in (none
+// turns it off)
+void zswap_init(int frames);
+
+// Try to keep the page in frame under slot.  Returns 0 (leaving the frame
+// alone) if it doesn't compress well enough or the store is full and
+// throwing out the oldest page wouldn't make room.  Otherwise returns 1,
+// and if the oldest page had to go, it has been copied in to the frame for
+// the caller to write out to *evicted in its place (and is still found
+// here until zswap_written).  *evicted is ADDRESS_NONE if not
+int zswap_store(L4_Word_t slot, L4_Word_t frame, L4_Word_t *evicted);
+
+// Copy the page kept under slot in to frame, returning 0 if there isn't one
+int zswap_load(L4_Word_t slot, L4_Word_t frame);
+
+// Test if a page is kept under slot
+int zswap_contains(L4_Word_t slot);
+
+// Forget the page kept under slot, if any.  Returns 1 if the slot can be
+// freed now, or 0 if the page is still being written out to it
+int zswap_drop(L4_Word_t slot);
+
+// An evicted page has been written out (from frame) with the given result.
+// Returns 1 if it was dropped meanwhile and the slot should now be freed
+int zswap_written(L4_Word_t slot, L4_Word_t frame, int rval);
+
+// Fill in the store's part of the swap status
+void zswap_status(swap_stat_t *dest);
+
+#endif // sos/zswap.h
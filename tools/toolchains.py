@@ -113,6 +113,9 @@ class toolchain:
         self.dict["_CC_COM_FLAGS"] = []
         self.dict["_CCFLAGS"] =  "$_CC_DEBUG $CC_STD_FLAGS $_CC_WARNINGS $CC_PLAT_FLAGS $_CC_OPTIMISATIONS  $CCFLAGS -DNFS_DIR=\\\"%s\\\"" % (nfsdir,)
 
+        if 'NFS_TCP' in os.environ:
+            self.dict["_CCFLAGS"] += ' -DNFS_TCP'
+
         if 'NO_DEBUG' in os.environ:
             print('Warning: compiling with assertions turned OFF')
             self.dict["_CCFLAGS"] += ' -DNDEBUG'